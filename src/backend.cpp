@@ -0,0 +1,193 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "watchdogd.hpp"
+#include "linux.hpp"
+#include "backend.hpp"
+#include "keepalive.hpp"
+#include "logutils.hpp"
+#include "handover.hpp"
+#include "sysroot.hpp"
+
+int IoctlBackend::Open(const char *name)
+{
+	fd = HandoverTake(name);
+
+	if (fd >= 0) {
+		//The previous instance wrote the magic close character. Any other
+		//write clears it again, so the timer keeps running after the last
+		//copy of the descriptor is closed.
+		write(fd, "\n", strlen("\n"));
+		Logmsg(LOG_INFO, "took over %s from the previous instance", name);
+	} else {
+		fd = open(name, O_WRONLY | O_CLOEXEC);
+	}
+
+	if (fd == -1) {
+		return -1;
+	}
+
+	strncpy(path, name, sizeof(path) - 1);
+
+	return 0;
+}
+
+int IoctlBackend::Ioctl(unsigned long request, void *arg)
+{
+	return ioctl(fd, request, arg);
+}
+
+ssize_t IoctlBackend::Write(const void *buf, size_t len)
+{
+	return write(fd, buf, len);
+}
+
+int IoctlBackend::Close()
+{
+	if (fd == -1) {
+		return 0;
+	}
+
+	int ret = close(fd);
+	fd = -1;
+
+	return ret;
+}
+
+static bool FindSoftdogDevice(char *path, size_t len)
+{
+	DIR *dir = SysrootOpendir("/sys/class/watchdog");
+	struct dirent *ent = NULL;
+	bool found = false;
+
+	if (dir == NULL) {
+		return false;
+	}
+
+	while (found == false && (ent = readdir(dir)) != NULL) {
+		char buf[256] = {'\0'};
+		char identity[64] = {'\0'};
+
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+
+		portable_snprintf(buf, sizeof(buf), "/sys/class/watchdog/%s/identity", ent->d_name);
+
+		int attr = SysrootOpen(buf, O_RDONLY);
+
+		if (attr < 0) {
+			continue;
+		}
+
+		ssize_t ret = read(attr, identity, sizeof(identity) - 1);
+		close(attr);
+
+		if (ret > 0 && strncasecmp(identity, "Software Watchdog", strlen("Software Watchdog")) == 0) {
+			portable_snprintf(path, len, "/dev/%s", ent->d_name);
+			found = true;
+		}
+	}
+
+	closedir(dir);
+
+	return found;
+}
+
+int SoftdogBackend::Open(const char *name)
+{
+	char device[64] = {'\0'};
+
+	if (strcmp(name, "softdog") != 0) {
+		return IoctlBackend::Open(name);
+	}
+
+	if (FindSoftdogDevice(device, sizeof(device)) == false) {
+		LoadKernelModule();
+
+		if (FindSoftdogDevice(device, sizeof(device)) == false) {
+			errno = ENODEV;
+			return -1;
+		}
+	}
+
+	if (IoctlBackend::Open(device) < 0) {
+		return -1;
+	}
+
+	//Opening the device starts its timer.
+	lastKeepalive = KeepaliveNow();
+	Ioctl(WDIOC_GETTIMEOUT, &timeout);
+
+	return 0;
+}
+
+int SoftdogBackend::Ioctl(unsigned long request, void *arg)
+{
+	if (request == WDIOC_GETTIMELEFT) {
+		uint64_t last = lastKeepalive;
+		uint64_t now = KeepaliveNow();
+		uint64_t limit = (uint64_t)timeout * 1000000ULL;
+
+		if (last == 0 || timeout <= 0) {
+			errno = ENOTTY;
+			return -1;
+		}
+
+		*(int *)arg = now - last >= limit ? 0 : (int)((limit - (now - last)) / 1000000ULL);
+		return 0;
+	}
+
+	int ret = IoctlBackend::Ioctl(request, arg);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	//Reading the timeout does not ping the device, setting it does.
+	switch (request) {
+	case WDIOC_GETTIMEOUT:
+		timeout = *(int *)arg;
+		break;
+	case WDIOC_SETTIMEOUT:
+		timeout = *(int *)arg;
+		lastKeepalive = KeepaliveNow();
+		break;
+	case WDIOC_KEEPALIVE:
+		lastKeepalive = KeepaliveNow();
+		break;
+	}
+
+	return ret;
+}
+
+WatchdogBackend *NewWatchdogBackend(const char *path)
+{
+	if (path == NULL) {
+		return NULL;
+	}
+
+	if (strncmp(path, "mock", strlen("mock")) == 0
+	    && (path[strlen("mock")] == '\0' || path[strlen("mock")] == ':')) {
+		return new MockBackend();
+	}
+
+	if (strcmp(path, "softdog") == 0) {
+		return new SoftdogBackend();
+	}
+
+	return new IoctlBackend();
+}
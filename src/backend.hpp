@@ -0,0 +1,100 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+#include <atomic>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+//A backend provides the raw device operations that class Watchdog is built
+//on. Requests and arguments follow the kernel watchdog API so every backend
+//behaves like a watchdog character device.
+class WatchdogBackend {
+public:
+	virtual ~WatchdogBackend() {}
+	virtual int Open(const char *) = 0;
+	virtual int Ioctl(unsigned long, void *) = 0;
+	virtual ssize_t Write(const void *, size_t) = 0;
+	virtual int Close() = 0;
+	virtual const char *GetPath() = 0;
+	virtual int GetFd() {
+		return -1;
+	}
+};
+
+class IoctlBackend : public WatchdogBackend {
+protected:
+	char path[64] = {'\0'};
+	int fd = -1;
+public:
+	int Open(const char *);
+	int Ioctl(unsigned long, void *);
+	ssize_t Write(const void *, size_t);
+	int Close();
+	const char *GetPath() {
+		return path;
+	}
+	int GetFd() {
+		return fd;
+	}
+};
+
+//softdog has no WDIOC_GETTIMELEFT, so it is emulated from the time of the
+//last keepalive. Opening "softdog" loads the module and finds its device.
+class SoftdogBackend : public IoctlBackend {
+	std::atomic_ullong lastKeepalive = {0};
+	int timeout = 0;
+public:
+	int Open(const char *);
+	int Ioctl(unsigned long, void *);
+};
+
+#define MOCK_KEEPALIVE_LOG 4096
+
+//An in-process device for benchmarks and tests. Opened with a path of the
+//form "mock[:option=value,...]", options are timeout, pretimeout,
+//bootstatus and delay (microseconds added to every keepalive).
+class MockBackend : public WatchdogBackend {
+	char path[64] = {'\0'};
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	uint64_t keepalives[MOCK_KEEPALIVE_LOG] = {0};
+	uint64_t numberOfKeepalives = 0;
+	uint64_t lastKeepalive = 0;
+	uint64_t expirations = 0;
+	uint64_t delay = 0;
+	unsigned long bootstatus = 0;
+	int timeout = 60;
+	int pretimeout = 0;
+	bool isOpen = false;
+	bool enabled = true;
+	bool magicClose = false;
+	void CheckExpired(uint64_t);
+public:
+	int Open(const char *);
+	int Ioctl(unsigned long, void *);
+	ssize_t Write(const void *, size_t);
+	int Close();
+	const char *GetPath() {
+		return path;
+	}
+	size_t GetKeepaliveTimestamps(uint64_t *, size_t);
+	uint64_t GetExpirations();
+};
+
+WatchdogBackend *NewWatchdogBackend(const char *);
+#endif
@@ -0,0 +1,549 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//Measures the time from a monitored condition going bad to the failure
+//being reported (detection) and to the decision check acting on it (action).
+//The daemon runs in no-action mode against the mock watchdog device, the
+//failures are injected into a throwaway environment under /tmp. That
+//environment is also the sysroot, so the load average and the receive
+//counter of the network interface checked are files nothing but the
+//benchmark writes to.
+
+#include "watchdogd.hpp"
+#include "sub.hpp"
+#include "configfile.hpp"
+#include "testdir.hpp"
+#include "threads.hpp"
+#include "watchdog.hpp"
+#include "backend.hpp"
+#include "keepalive.hpp"
+#include "scheduler.hpp"
+#include "histogram.hpp"
+#include "logutils.hpp"
+#include "benchmark.hpp"
+
+extern ProcessList processes;
+
+#define BENCHMARK_TIMEOUT 30000000ULL
+#define BENCHMARK_SETTLE 1000000ULL
+
+struct scenario {
+	const char *name;
+	void (*inject)(void);
+	void (*heal)(void);
+	Histogram detection;
+	Histogram action;
+	uint64_t missed;
+};
+
+static struct cfgoptions options;
+static char directory[] = "/tmp/watchdogd-bench.XXXXXX";
+static char *pidFile = NULL;
+static pid_t sleeper = -1;
+static std::atomic_bool traffic(true);
+
+static std::atomic<const char *> current(nullptr);
+static std::atomic_ullong injectedAt(0);
+static std::atomic_ullong detectedAt(0);
+static std::atomic_ullong actedAt(0);
+
+static void Sleep(uint64_t usec)
+{
+	struct timespec ts = {(time_t)(usec / 1000000ULL), (long)(usec % 1000000ULL) * 1000L};
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR) ;
+}
+
+static bool WriteFile(const char *path, const char *content, mode_t mode)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+
+	if (fd < 0) {
+		fprintf(stderr, "watchdogd: %s: %s\n", path, MyStrerror(errno));
+		return false;
+	}
+
+	size_t len = strlen(content);
+
+	if (write(fd, content, len) != (ssize_t)len) {
+		fprintf(stderr, "watchdogd: %s: %s\n", path, MyStrerror(errno));
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	return true;
+}
+
+static char *Marker(const char *name)
+{
+	char *path = NULL;
+
+	Wasprintf(&path, "%s/%s.fail", directory, name);
+
+	return path;
+}
+
+static bool StartSleeper(void)
+{
+	char buf[32] = {0};
+
+	sleeper = fork();
+
+	if (sleeper == 0) {
+		while (true) {
+			pause();
+		}
+	} else if (sleeper < 0) {
+		return false;
+	}
+
+	portable_snprintf(buf, sizeof(buf), "%i\n", sleeper);
+
+	return WriteFile(pidFile, buf, 0644);
+}
+
+static void StopSleeper(void)
+{
+	if (sleeper > 0) {
+		kill(sleeper, SIGKILL);
+		waitpid(sleeper, NULL, 0);
+		sleeper = -1;
+	}
+}
+
+//Keeps the receive counter of the fake interface moving. The counter only
+//grows, so writing it over the old value never leaves a shorter number
+//behind and the file needs no truncation.
+static void *TrafficThread(void *arg)
+{
+	char *path = NULL;
+	char buf[32] = {0};
+	unsigned long long rx = 0;
+
+	Wasprintf(&path, "%s/root/sys/class/net/bench0/statistics/rx_bytes", directory);
+
+	int fd = path != NULL ? open(path, O_WRONLY | O_CLOEXEC) : -1;
+
+	free(path);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	while (true) {
+		if (traffic) {
+			int len = portable_snprintf(buf, sizeof(buf), "%llu\n", ++rx);
+			pwrite(fd, buf, (size_t)len, 0);
+		}
+
+		Sleep(1000);
+	}
+
+	return NULL;
+}
+
+static void PidFileInject(void)
+{
+	StopSleeper();
+}
+
+static void PidFileHeal(void)
+{
+	StartSleeper();
+}
+
+//The load average check reads the file every time it runs, it is replaced
+//whole so it is never seen half written.
+static void SetLoad(const char *content)
+{
+	char *path = NULL;
+	char *tmp = NULL;
+
+	Wasprintf(&path, "%s/root/proc/loadavg", directory);
+	Wasprintf(&tmp, "%s/root/proc/loadavg.new", directory);
+
+	if (path != NULL && tmp != NULL && WriteFile(tmp, content, 0644) == true) {
+		rename(tmp, path);
+	}
+
+	free(path);
+	free(tmp);
+}
+
+static void LoadInject(void)
+{
+	SetLoad("200.00 0.00 0.00 1/100 1\n");
+}
+
+static void LoadHeal(void)
+{
+	SetLoad("0.00 0.00 0.00 1/100 1\n");
+}
+
+static void NetworkInject(void)
+{
+	traffic = false;
+}
+
+static void NetworkHeal(void)
+{
+	traffic = true;
+}
+
+static void MarkerInject(void)
+{
+	char *path = Marker(current);
+	WriteFile(path, "", 0644);
+	free(path);
+}
+
+static void MarkerHeal(void)
+{
+	char *path = Marker(current);
+	unlink(path);
+	free(path);
+}
+
+static struct scenario scenarios[] = {
+	{"pid-files", PidFileInject, PidFileHeal},
+	{"load-average", LoadInject, LoadHeal},
+	{"network-interfaces", NetworkInject, NetworkHeal},
+	{"test-binary", MarkerInject, MarkerHeal},
+	{"repair-scripts", MarkerInject, MarkerHeal},
+};
+
+//Called by the decision check right before it acts. Only the first failure
+//of the check under test after the injection counts.
+static void Observe(const char *name, uint64_t failedAt, uint64_t now)
+{
+	const char *check = current;
+
+	if (check == NULL || strcmp(check, name) != 0 || failedAt < injectedAt) {
+		return;
+	}
+
+	unsigned long long expected = 0;
+
+	if (detectedAt.compare_exchange_strong(expected, failedAt)) {
+		actedAt = now;
+	}
+}
+
+static bool IsScheduled(const char *name)
+{
+	struct checkstatus status;
+
+	for (size_t i = 0; SchedulerGetCheckStatus(i, &status) == true; i++) {
+		if (strcmp(status.name, name) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void RunScenario(struct scenario *s)
+{
+	detectedAt = 0;
+	actedAt = 0;
+	current = s->name;
+	injectedAt = KeepaliveNow();
+
+	s->inject();
+
+	while (actedAt == 0 && KeepaliveNow() - injectedAt < BENCHMARK_TIMEOUT) {
+		Sleep(1000);
+	}
+
+	if (actedAt == 0) {
+		s->missed += 1;
+	} else {
+		s->detection.Record(detectedAt > injectedAt ? detectedAt - injectedAt : 0);
+		s->action.Record(actedAt - injectedAt);
+	}
+
+	s->heal();
+	Sleep(BENCHMARK_SETTLE);
+	current = nullptr;
+	SchedulerReset();
+	Sleep(BENCHMARK_SETTLE / 2);
+}
+
+static bool CreateEnvironment(void)
+{
+	char *path = NULL;
+	char *script = NULL;
+	bool ret = false;
+
+	if (mkdtemp(directory) == NULL) {
+		fprintf(stderr, "watchdogd: mkdtemp: %s\n", MyStrerror(errno));
+		return false;
+	}
+
+	Wasprintf(&pidFile, "%s/bench.pid", directory);
+
+	if (pidFile == NULL || StartSleeper() == false) {
+		return false;
+	}
+
+	Wasprintf(&path, "%s/scripts", directory);
+
+	if (path == NULL || mkdir(path, 0755) < 0) {
+		free(path);
+		return false;
+	}
+
+	free(path);
+
+	//The sysroot. The load average stays below max-load-1 until the scenario
+	//raises it.
+	const char *tree[] = {"root", "root/proc", "root/sys", "root/sys/class", "root/sys/class/net",
+			      "root/sys/class/net/bench0", "root/sys/class/net/bench0/statistics"};
+	const char *files[][2] = {
+		{"root/proc/loadavg", "0.00 0.00 0.00 1/100 1\n"},
+		{"root/sys/class/net/bench0/statistics/rx_bytes", "0\n"},
+	};
+
+	//Both fail while the marker named after their check exists.
+	const char *scripts[][2] = {
+		{"test-binary", "test-binary"},
+		{"scripts/repair-scripts", "repair-scripts"},
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(scripts); i++) {
+		Wasprintf(&script, "#!/bin/sh\nexec test ! -e %s/%s.fail\n", directory, scripts[i][1]);
+		Wasprintf(&path, "%s/%s", directory, scripts[i][0]);
+
+		if (script == NULL || path == NULL || WriteFile(path, script, 0755) == false) {
+			goto error;
+		}
+
+		free(script);
+		free(path);
+		script = path = NULL;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(tree); i++) {
+		Wasprintf(&path, "%s/%s", directory, tree[i]);
+
+		if (path == NULL || mkdir(path, 0755) < 0) {
+			goto error;
+		}
+
+		free(path);
+		path = NULL;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(files); i++) {
+		Wasprintf(&path, "%s/%s", directory, files[i][0]);
+
+		if (path == NULL || WriteFile(path, files[i][1], 0644) == false) {
+			goto error;
+		}
+
+		free(path);
+		path = NULL;
+	}
+
+	Wasprintf(&script,
+		  "watchdog-device = \"mock\";\n"
+		  "daemonize = false;\n"
+		  "use-pid-file = false;\n"
+		  "lock-memory = false;\n"
+		  "realtime-scheduling = false;\n"
+		  "log-up-to = \"none\";\n"
+		  "sysroot = \"%s/root\";\n"
+		  "max-load-1 = 100.0;\n"
+		  "check-interval = 0.1;\n"
+		  "monitor-deadline = 10.0;\n"
+		  "pid-files = [\"%s\"];\n"
+		  "network-interfaces = [\"bench0\"];\n"
+		  "test-binary = \"%s/test-binary\";\n"
+		  "test-directory = \"%s/scripts\";\n"
+		  "checks = {\n"
+		  "\ttest-binary = { interval = 0.1; };\n"
+		  "\trepair-scripts = { interval = 0.1; };\n"
+		  "\tfork = { interval = 3600.0; };\n"
+		  "};\n", directory, pidFile, directory, directory);
+	Wasprintf(&path, "%s/watchdogd.conf", directory);
+
+	if (script == NULL || path == NULL || WriteFile(path, script, 0644) == false) {
+		goto error;
+	}
+
+	options.confile = path;
+	path = NULL;
+	ret = true;
+error:
+	free(script);
+	free(path);
+	return ret;
+}
+
+static void RemoveEnvironment(void)
+{
+	const char *files[] = {"bench.pid", "watchdogd.conf", "test-binary", "test-binary.fail",
+			       "repair-scripts.fail", "scripts/repair-scripts", "scripts",
+			       "root/sys/class/net/bench0/statistics/rx_bytes", "root/sys/class/net/bench0/statistics",
+			       "root/sys/class/net/bench0", "root/sys/class/net", "root/sys/class", "root/sys",
+			       "root/proc/loadavg", "root/proc", "root"};
+
+	StopSleeper();
+
+	for (size_t i = 0; i < ARRAY_SIZE(files); i++) {
+		char *path = NULL;
+		Wasprintf(&path, "%s/%s", directory, files[i]);
+
+		if (path != NULL) {
+			remove(path);
+			free(path);
+		}
+	}
+
+	rmdir(directory);
+}
+
+static void PrintResults(void)
+{
+	printf("%-20s %6s %12s %12s %12s %12s %12s %12s %6s\n", "check", "count",
+	       "detect-p50", "detect-p99", "detect-max", "action-p50", "action-p99", "action-max", "missed");
+
+	for (size_t i = 0; i < ARRAY_SIZE(scenarios); i++) {
+		struct histogramstats detection = {0};
+		struct histogramstats action = {0};
+
+		scenarios[i].detection.Snapshot(&detection);
+		scenarios[i].action.Snapshot(&action);
+
+		printf("%-20s %6" PRIu64 " %10" PRIu64 "us %10" PRIu64 "us %10" PRIu64 "us %10" PRIu64
+		       "us %10" PRIu64 "us %10" PRIu64 "us %6" PRIu64 "\n", scenarios[i].name,
+		       detection.count, detection.p50, detection.p99, detection.max,
+		       action.p50, action.p99, action.max, scenarios[i].missed);
+	}
+}
+
+//The gaps between the last keepalives the mock device received show how far
+//the checks hold up the keepalive thread. Returns the number of times the
+//device expired.
+static uint64_t PrintKeepalives(Watchdog *watchdog)
+{
+	static uint64_t timestamps[MOCK_KEEPALIVE_LOG];
+	MockBackend *mock = dynamic_cast<MockBackend *>(watchdog->GetBackend());
+	struct histogramstats stats = {0};
+	Histogram gaps;
+
+	if (mock == NULL) {
+		return 0;
+	}
+
+	size_t count = mock->GetKeepaliveTimestamps(timestamps, ARRAY_SIZE(timestamps));
+
+	for (size_t i = 1; i < count; i++) {
+		gaps.Record(timestamps[i] - timestamps[i - 1]);
+	}
+
+	gaps.Snapshot(&stats);
+
+	uint64_t expirations = mock->GetExpirations();
+
+	printf("\n%-20s %6" PRIu64 " %10" PRIu64 "us %10" PRIu64 "us %10" PRIu64 "us, %" PRIu64 " expirations\n",
+	       "keepalive-gap", stats.count, stats.p50, stats.p99, stats.max, expirations);
+
+	return expirations;
+}
+
+//Returns a non zero exit status if the environment could not be set up, a
+//failure was never acted on or the device expired.
+int Benchmark(unsigned long rounds)
+{
+	Watchdog watchdog;
+	static struct keepalive keepalive;
+	bool armed = false;
+	int ret = EXIT_SUCCESS;
+
+	if (MyStrerrorInit() == false) {
+		std::perror("Unable to create a new locale object");
+		return EXIT_FAILURE;
+	}
+
+	if (CreateEnvironment() == false) {
+		fprintf(stderr, "watchdogd: unable to create benchmark environment\n");
+		RemoveEnvironment();
+		return EXIT_FAILURE;
+	}
+
+	options.options |= NOACTION;
+
+	if (ReadConfigurationFile(&options) < 0) {
+		RemoveEnvironment();
+		return EXIT_FAILURE;
+	}
+
+	//Keepalives keep competing with the checks for the cpu as they would
+	//on a real device.
+	if (watchdog.Open(options.devicepath) == 0) {
+		keepalive.watchdog = &watchdog;
+		KeepaliveInit(&keepalive, &watchdog, (uint64_t)watchdog.GetOptimalPingInterval() * 1000ULL);
+		armed = KeepaliveStartThread(&keepalive, 0, -1) == 0;
+	}
+
+	if (ExecuteRepairScriptsPreFork(&processes, &options) == false
+	    || CreateDetachedThread(TrafficThread, NULL) < 0) {
+		RemoveEnvironment();
+		return EXIT_FAILURE;
+	}
+
+	SchedulerObserve(Observe);
+
+	if (StartHelperThreads(&options) != 0 || SetupAuxManagerThread(&options) != 0) {
+		RemoveEnvironment();
+		return EXIT_FAILURE;
+	}
+
+	Sleep(BENCHMARK_SETTLE * 2);
+	SchedulerReset();
+
+	for (unsigned long i = 0; i < rounds; i++) {
+		for (size_t j = 0; j < ARRAY_SIZE(scenarios); j++) {
+			if (IsScheduled(scenarios[j].name) == true) {
+				RunScenario(&scenarios[j]);
+			}
+		}
+	}
+
+	PrintResults();
+
+	if (PrintKeepalives(&watchdog) != 0) {
+		ret = EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(scenarios); i++) {
+		if (scenarios[i].missed != 0) {
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	if (armed == true) {
+		KeepaliveStopThread(&keepalive);
+		watchdog.Close();
+	}
+
+	RemoveEnvironment();
+
+	return ret;
+}
@@ -31,7 +31,7 @@ int WriteBootStatus(unsigned long status, const char * const pathName, long long
 
 	dprintf(fd, "Reset cause   : 0x%04lx\n", status);
 	dprintf(fd, "Timeout (sec) : %i\n", timeout);
-	dprintf(fd, "Kick Interval : %lli\n", sleeptime);
+	dprintf(fd, "Kick Interval : %lli.%03lli\n", sleeptime / 1000, sleeptime % 1000);
 
 	close(fd);
 
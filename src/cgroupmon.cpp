@@ -0,0 +1,371 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//Checks bound to cgroup v2 directories. The kernel signals a modification
+//of memory.events and cgroup.events whenever a counter or the populated
+//state changes, so both files are watched with inotify and only read again
+//when that happens. Pressure limits use the triggers of the cgroup's
+//*.pressure files. Nothing runs between events. Everything here runs on the
+//scheduler thread.
+
+#include "watchdogd.hpp"
+#include "logutils.hpp"
+#include "configfile.hpp"
+#include "scheduler.hpp"
+#include "sysroot.hpp"
+#include "clock.hpp"
+#include "pressure.hpp"
+#include "cgroupmon.hpp"
+#include <sys/inotify.h>
+
+#define CGROUP_EVENTS (IN_MODIFY | IN_DELETE_SELF | IN_IGNORED)
+
+enum {
+	MEMORY_HIGH,
+	MEMORY_OOM,
+	MEMORY_OOM_KILL,
+	MEMORY_COUNTERS,
+};
+
+static const char *const counterNames[MEMORY_COUNTERS] = {"high", "oom", "oom_kill"};
+static const char *const limitNames[MEMORY_COUNTERS] = {"max-high", "max-oom", "max-oom-kill"};
+
+struct cgroup {
+	const char *name;
+	char *dir;
+	bool populated;
+	bool counters;
+	long limits[MEMORY_COUNTERS];
+	unsigned long long baseline[MEMORY_COUNTERS];
+	int memoryWd;
+	int eventsWd;
+	uint64_t timeout;
+	uint64_t downSince;
+	bool failed;
+};
+
+static struct check *cgroupCheck = NULL;
+static struct cgroup *cgroups = NULL;
+static size_t numberOfCgroups = 0;
+static size_t failing = 0;
+static int inotifyFd = -1;
+
+static void SetFailed(struct cgroup *g, bool failed)
+{
+	if (g->failed != failed) {
+		failing = failed == true ? failing + 1 : failing - 1;
+		g->failed = failed;
+	}
+
+	if (failing != 0) {
+		CheckFail(cgroupCheck, CGROUPERROR);
+	} else {
+		CheckPass(cgroupCheck, CGROUPERROR);
+	}
+}
+
+static bool ReadFile(struct cgroup *g, const char *file, char *buf, size_t len)
+{
+	char path[PATH_MAX] = {'\0'};
+
+	if (snprintf(path, sizeof(path), "%s/%s", g->dir, file) >= (int)sizeof(path)) {
+		return false;
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		return false;
+	}
+
+	ssize_t ret = read(fd, buf, len - 1);
+	close(fd);
+
+	if (ret < 0) {
+		return false;
+	}
+
+	buf[ret] = '\0';
+
+	return true;
+}
+
+//Both files hold lines of the form "<key> <value>".
+static bool Lookup(const char *buf, const char *key, unsigned long long *value)
+{
+	size_t len = strlen(key);
+
+	for (const char *line = buf; line != NULL && *line != '\0'; line = strchr(line, '\n')) {
+		line += *line == '\n' ? 1 : 0;
+
+		if (strncmp(line, key, len) == 0 && line[len] == ' ') {
+			*value = strtoull(line + len + 1, NULL, 10);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool ReadCounters(struct cgroup *g, unsigned long long *counters)
+{
+	char buf[512] = {'\0'};
+
+	if (ReadFile(g, "memory.events", buf, sizeof(buf)) == false) {
+		return false;
+	}
+
+	for (size_t i = 0; i < MEMORY_COUNTERS; i++) {
+		counters[i] = 0;
+		Lookup(buf, counterNames[i], &counters[i]);
+	}
+
+	return true;
+}
+
+//A cgroup that can't be read does not exist yet or was removed. Such a
+//cgroup, or an empty one with populated set, is given timeout to come back,
+//as it does while its service starts or restarts.
+static void Evaluate(struct cgroup *g)
+{
+	unsigned long long counters[MEMORY_COUNTERS] = {0};
+	unsigned long long populated = 1;
+	char buf[128] = {'\0'};
+	const char *down = NULL;
+	bool failed = false;
+
+	if (ReadFile(g, "cgroup.events", buf, sizeof(buf)) == false) {
+		down = "does not exist";
+	} else if (g->populated == true && Lookup(buf, "populated", &populated) == true && populated == 0) {
+		down = "has no processes left";
+	}
+
+	if (down == NULL) {
+		g->downSince = 0;
+	} else if (g->downSince == 0) {
+		Logmsg(LOG_WARNING, "cgroup %s %s, waiting %.0fs for it", g->name, down,
+		       (double)g->timeout / 1000000.0);
+		g->downSince = ClockNow();
+	} else if (ClockNow() - g->downSince >= g->timeout) {
+		if (g->failed == false) {
+			Logmsg(LOG_ERR, "cgroup %s %s", g->name, down);
+		}
+
+		failed = true;
+	}
+
+	if (g->counters == true && ReadCounters(g, counters) == true) {
+		for (size_t i = 0; i < MEMORY_COUNTERS; i++) {
+			if (g->limits[i] >= 0 && counters[i] > g->baseline[i]
+			    && counters[i] - g->baseline[i] > (unsigned long long)g->limits[i]) {
+				Logmsg(LOG_ERR, "cgroup %s: %llu %s events, at most %ld allowed", g->name,
+				       counters[i] - g->baseline[i], counterNames[i], g->limits[i]);
+				failed = true;
+			}
+		}
+	}
+
+	SetFailed(g, failed);
+}
+
+//The counters of a cgroup that was created again start over, the baseline
+//is taken whenever memory.events is watched anew. Pressure triggers are
+//lost with the cgroup and set again once cgroup.events can be watched.
+static void Watch(struct cgroup *g)
+{
+	char path[PATH_MAX] = {'\0'};
+
+	if (g->eventsWd < 0 && snprintf(path, sizeof(path), "%s/cgroup.events", g->dir) < (int)sizeof(path)) {
+		g->eventsWd = inotify_add_watch(inotifyFd, path, CGROUP_EVENTS);
+
+		if (g->eventsWd >= 0 && snprintf(path, sizeof(path), "%s/", g->dir) < (int)sizeof(path)) {
+			PressureRearm(path);
+		}
+	}
+
+	if (g->counters == true && g->memoryWd < 0
+	    && snprintf(path, sizeof(path), "%s/memory.events", g->dir) < (int)sizeof(path)) {
+		g->memoryWd = inotify_add_watch(inotifyFd, path, CGROUP_EVENTS);
+
+		if (g->memoryWd >= 0) {
+			ReadCounters(g, g->baseline);
+		}
+	}
+}
+
+static void CgroupChanged(int fd, uint32_t events, void *arg)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len = 0;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (char *ptr = buf; ptr < buf + len;) {
+			struct inotify_event *event = (struct inotify_event *)ptr;
+
+			ptr += sizeof(struct inotify_event) + event->len;
+
+			for (size_t i = 0; i < numberOfCgroups; i++) {
+				struct cgroup *g = &cgroups[i];
+
+				if (event->mask & IN_Q_OVERFLOW) {
+					Evaluate(g);
+					continue;
+				}
+
+				if (g->eventsWd != event->wd && g->memoryWd != event->wd) {
+					continue;
+				}
+
+				if (event->mask & IN_IGNORED) {
+					g->eventsWd = g->eventsWd == event->wd ? -1 : g->eventsWd;
+					g->memoryWd = g->memoryWd == event->wd ? -1 : g->memoryWd;
+				}
+
+				Evaluate(g);
+			}
+		}
+	}
+}
+
+static bool CgroupRoot(char *root, size_t len)
+{
+	char path[PATH_MAX] = {'\0'};
+	struct stat st = {0};
+
+	if (SysrootPath(path, sizeof(path), "/sys/fs/cgroup/cgroup.controllers") == true && stat(path, &st) == 0) {
+		return SysrootPath(root, len, "/sys/fs/cgroup");
+	}
+
+	return SysrootPath(root, len, "/sys/fs/cgroup/unified");
+}
+
+static bool ParseCgroup(const config_setting_t *entry, struct cgroup *g, const char *root,
+			double retryLimit)
+{
+	const char *path = NULL;
+	double timeout = retryLimit > 0.0 ? retryLimit : 60.0;
+	int populated = 0;
+
+	if (config_setting_is_group(entry) == CONFIG_FALSE
+	    || config_setting_lookup_string(entry, "path", &path) == CONFIG_FALSE) {
+		Logmsg(LOG_ERR, "%s:%i: entry of \"cgroups\" has no path",
+		       LibconfigWraperConfigSettingSourceFile(entry), config_setting_source_line(entry));
+		return false;
+	}
+
+	size_t len = strlen(root) + strlen(path) + 2;
+
+	g->dir = (char *)calloc(1, len);
+
+	if (g->dir == NULL) {
+		return false;
+	}
+
+	snprintf(g->dir, len, "%s%s%s", root, path[0] == '/' ? "" : "/", path);
+
+	g->name = path;
+	g->memoryWd = -1;
+	g->eventsWd = -1;
+
+	if (ConfigSettingLookupNumber(entry, "timeout", &timeout) == CONFIG_TRUE
+	    && (timeout < 0.0 || timeout > 86400.0)) {
+		Logmsg(LOG_ERR, "illegal value for configuration file entry named \"cgroups.timeout\","
+		       " using default value");
+		timeout = retryLimit > 0.0 ? retryLimit : 60.0;
+	}
+
+	g->timeout = (uint64_t)(timeout * 1000000.0);
+
+	if (config_setting_lookup_bool(entry, "populated", &populated) == CONFIG_TRUE) {
+		g->populated = populated != 0;
+	}
+
+	for (size_t i = 0; i < MEMORY_COUNTERS; i++) {
+		int limit = -1;
+
+		if (config_setting_lookup_int(entry, limitNames[i], &limit) == CONFIG_TRUE && limit < 0) {
+			Logmsg(LOG_ERR, "illegal value for configuration file entry named \"cgroups.%s\"", limitNames[i]);
+			limit = -1;
+		}
+
+		g->limits[i] = limit;
+		g->counters = g->counters == true || limit >= 0;
+	}
+
+	return true;
+}
+
+//Counters are compared against their values at start up, events from
+//before watchdogd started are not held against the cgroup. A missing cgroup
+//defaults to retry-timeout, or a minute, to appear, its pressure limits are
+//kept until it does.
+bool CgroupMonitorInit(struct cfgoptions *s, struct check *c)
+{
+	char root[PATH_MAX] = {'\0'};
+	size_t count = (size_t)config_setting_length(s->cgroups);
+
+	cgroupCheck = c;
+
+	if (CgroupRoot(root, sizeof(root)) == false) {
+		return false;
+	}
+
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	cgroups = (struct cgroup *)calloc(count, sizeof(*cgroups));
+
+	if (inotifyFd < 0 || cgroups == NULL || SchedulerAddSource(inotifyFd, EPOLLIN, CgroupChanged, NULL) == NULL) {
+		Logmsg(LOG_ERR, "unable to monitor cgroups: %s", MyStrerror(errno));
+		return false;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const config_setting_t *entry = config_setting_get_elem(s->cgroups, (unsigned int)i);
+		struct cgroup *g = &cgroups[numberOfCgroups];
+		char prefix[PATH_MAX] = {'\0'};
+
+		if (ParseCgroup(entry, g, root, s->retryLimit) == false) {
+			continue;
+		}
+
+		numberOfCgroups += 1;
+
+		Watch(g);
+		Evaluate(g);
+
+		if (snprintf(prefix, sizeof(prefix), "%s/", g->dir) < (int)sizeof(prefix)) {
+			PressureWatchSetting(entry, "cgroups", prefix, ".pressure", c, PRESSURETOOHIGH, true);
+		}
+	}
+
+	return numberOfCgroups > 0;
+}
+
+//Cgroups whose files could not be watched, because they did not exist yet
+//or were removed, are read here until they can be, and missing or empty
+//ones until they are back or out of time.
+void CgroupMonitorCheck(struct cfgoptions *s, struct check *c)
+{
+	PressurePoll(c);
+
+	for (size_t i = 0; i < numberOfCgroups; i++) {
+		struct cgroup *g = &cgroups[i];
+
+		if (g->eventsWd < 0 || (g->counters == true && g->memoryWd < 0) || g->downSince != 0) {
+			Watch(g);
+			Evaluate(g);
+		}
+	}
+}
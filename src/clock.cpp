@@ -0,0 +1,245 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//The clock of the check scheduler and the checks. It follows the monotonic
+//clock unless virtual time is selected, then time only moves when ClockRun
+//advances it to the next deadline once no thread holding the clock can make
+//progress. Threads taking part hold the clock while runnable, waiting on it
+//hands the hold back until the wait is over. The keepalive path always uses
+//the real clock.
+
+#include "watchdogd.hpp"
+#include "clock.hpp"
+
+struct clockwaiter {
+	uint64_t deadline;
+	bool interruptible;
+	bool woken;
+	struct clockwaiter *next;
+};
+
+static bool virtualClock = false;
+static std::atomic_ullong virtualNow(0);
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t update = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static struct clockwaiter *waiters = NULL;
+static unsigned long holds = 0;
+static bool interrupted = false;
+
+static uint64_t MonotonicNow(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+uint64_t ClockNow(void)
+{
+	if (virtualClock == true) {
+		return virtualNow.load(std::memory_order_acquire);
+	}
+
+	return MonotonicNow();
+}
+
+//Called with the lock held.
+static void Release(void)
+{
+	assert(holds > 0);
+
+	holds -= 1;
+
+	if (holds == 0) {
+		pthread_cond_signal(&idle);
+	}
+}
+
+//The hold is handed back to the waiter by whoever wakes it, so the driver
+//can never see the clock idle between the wake up and the waiter running.
+static bool VirtualWait(uint64_t deadline, bool interruptible)
+{
+	struct clockwaiter w = {deadline, interruptible, false, NULL};
+	bool ret = true;
+
+	pthread_mutex_lock(&lock);
+
+	if (interruptible == true && interrupted == true) {
+		interrupted = false;
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+
+	if (deadline <= virtualNow) {
+		pthread_mutex_unlock(&lock);
+		return true;
+	}
+
+	w.next = waiters;
+	waiters = &w;
+	Release();
+
+	while (w.woken == false) {
+		pthread_cond_wait(&update, &lock);
+	}
+
+	for (struct clockwaiter **p = &waiters; *p != NULL; p = &(*p)->next) {
+		if (*p == &w) {
+			*p = w.next;
+			break;
+		}
+	}
+
+	if (virtualNow < deadline) {
+		interrupted = false;
+		ret = false;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+//Returns false if ClockInterrupt ended the wait early.
+bool ClockWaitUntil(uint64_t deadline)
+{
+	if (virtualClock == true) {
+		return VirtualWait(deadline, true);
+	}
+
+	struct timespec ts = {(time_t)(deadline / 1000000ULL), (long)(deadline % 1000000ULL) * 1000L};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) ;
+
+	return true;
+}
+
+void ClockSleep(uint64_t usec)
+{
+	if (virtualClock == true) {
+		VirtualWait(virtualNow + usec, false);
+		return;
+	}
+
+	struct timespec ts = {(time_t)(usec / 1000000ULL), (long)(usec % 1000000ULL) * 1000L};
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR) ;
+}
+
+//Ends the current or next interruptible wait. Only used in virtual time,
+//real waits are woken through file descriptors.
+void ClockInterrupt(void)
+{
+	if (virtualClock == false) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	interrupted = true;
+
+	for (struct clockwaiter *w = waiters; w != NULL; w = w->next) {
+		if (w->interruptible == true && w->woken == false) {
+			w->woken = true;
+			holds += 1;
+		}
+	}
+
+	pthread_cond_broadcast(&update);
+	pthread_mutex_unlock(&lock);
+}
+
+void ClockHold(void)
+{
+	if (virtualClock == false) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	holds += 1;
+	pthread_mutex_unlock(&lock);
+}
+
+void ClockRelease(void)
+{
+	if (virtualClock == false) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	Release();
+	pthread_mutex_unlock(&lock);
+}
+
+//Must be called before any thread reads the clock. Virtual time starts at
+//the current monotonic time so it never reads as zero.
+void ClockSetVirtual(void)
+{
+	virtualNow = MonotonicNow();
+	virtualClock = true;
+}
+
+bool ClockIsVirtual(void)
+{
+	return virtualClock;
+}
+
+//Advances virtual time from deadline to deadline as fast as the threads
+//holding the clock allow, until end or until nothing waits on the clock.
+//Returns the number of steps taken.
+uint64_t ClockRun(uint64_t end)
+{
+	uint64_t steps = 0;
+
+	pthread_mutex_lock(&lock);
+
+	while (true) {
+		while (holds != 0) {
+			pthread_cond_wait(&idle, &lock);
+		}
+
+		uint64_t next = UINT64_MAX;
+
+		for (struct clockwaiter *w = waiters; w != NULL; w = w->next) {
+			if (w->woken == false && w->deadline < next) {
+				next = w->deadline;
+			}
+		}
+
+		if (next == UINT64_MAX || next > end) {
+			virtualNow = end;
+			break;
+		}
+
+		virtualNow = next;
+		steps += 1;
+
+		for (struct clockwaiter *w = waiters; w != NULL; w = w->next) {
+			if (w->woken == false && w->deadline <= next) {
+				w->woken = true;
+				holds += 1;
+			}
+		}
+
+		pthread_cond_broadcast(&update);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return steps;
+}
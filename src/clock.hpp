@@ -0,0 +1,31 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+#include <stdint.h>
+
+//Times are in microseconds on the monotonic clock.
+uint64_t ClockNow(void);
+bool ClockWaitUntil(uint64_t);
+void ClockSleep(uint64_t);
+void ClockInterrupt(void);
+void ClockHold(void);
+void ClockRelease(void);
+void ClockSetVirtual(void);
+bool ClockIsVirtual(void);
+uint64_t ClockRun(uint64_t);
+#endif
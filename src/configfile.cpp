@@ -23,8 +23,11 @@
 #include "repair.hpp"
 #include "logutils.hpp"
 #include "linux.hpp"
+#include "keepalive.hpp"
+#include "sysroot.hpp"
+#include "proccheck.hpp"
 
-static const char *LibconfigWraperConfigSettingSourceFile(const config_setting_t *
+const char *LibconfigWraperConfigSettingSourceFile(const config_setting_t *
 						   setting)
 {
 	const char *fileName = config_setting_source_file(setting);
@@ -35,6 +38,58 @@ static const char *LibconfigWraperConfigSettingSourceFile(const config_setting_t
 	return fileName;
 }
 
+//Without CONFIG_OPTION_AUTOCONVERT libconfig does not read an integer as a
+//float, so both are accepted here. A setting of any other type is
+//reported and treated as absent.
+static int GetNumber(const config_setting_t *setting, const char *name, double *value)
+{
+	if (setting == NULL) {
+		return CONFIG_FALSE;
+	}
+
+	switch (config_setting_type(setting)) {
+	case CONFIG_TYPE_INT:
+		*value = (double)config_setting_get_int(setting);
+		return CONFIG_TRUE;
+	case CONFIG_TYPE_INT64:
+		*value = (double)config_setting_get_int64(setting);
+		return CONFIG_TRUE;
+	case CONFIG_TYPE_FLOAT:
+		*value = config_setting_get_float(setting);
+		return CONFIG_TRUE;
+	}
+
+	fprintf(stderr, "watchdogd: %s:%i: illegal type for configuration file entry \"%s\" expected number\n",
+		LibconfigWraperConfigSettingSourceFile(setting), config_setting_source_line(setting), name);
+
+	return CONFIG_FALSE;
+}
+
+int ConfigLookupNumber(const config_t *config, const char *name, double *value)
+{
+	return GetNumber(config_lookup(config, name), name, value);
+}
+
+int ConfigSettingLookupNumber(const config_setting_t *setting, const char *name, double *value)
+{
+	return GetNumber(config_setting_get_member(setting, name), name, value);
+}
+
+//Intervals are written in seconds and may have a fractional part, e.g.
+//interval = 0.25. They are stored in milliseconds.
+static int LookupInterval(const config_t *config, const char *name, long *ms)
+{
+	double tmp = 0.0;
+
+	if (ConfigLookupNumber(config, name, &tmp) == CONFIG_FALSE) {
+		return CONFIG_FALSE;
+	}
+
+	*ms = (long)(tmp * 1000.0 + 0.5);
+
+	return CONFIG_TRUE;
+}
+
 static bool SetDefaultLogTarget(struct cfgoptions *const cfg)
 {
 	assert(cfg != NULL);
@@ -330,6 +385,15 @@ int ReadConfigurationFile(struct cfgoptions *const cfg)
 
 	config_set_auto_convert(&cfg->cfg, true);
 
+	if (config_lookup_string(&cfg->cfg, "sysroot", &cfg->sysroot) == CONFIG_TRUE) {
+		if (SysrootSet(cfg->sysroot) == false) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"sysroot\"\n");
+			fprintf(stderr, "watchdogd: using default value\n");
+			cfg->sysroot = NULL;
+		}
+	}
+
 	if (!(cfg->options & BUSYBOXDEVOPTCOMPAT)) {
 		if (config_lookup_string(&cfg->cfg, "watchdog-device", &cfg->devicepath)
 		    == CONFIG_FALSE) {
@@ -404,6 +468,30 @@ int ReadConfigurationFile(struct cfgoptions *const cfg)
 		}
 	}
 
+	if (config_lookup_int(&cfg->cfg, "max-process-table", &cfg->maxProcessTable) == CONFIG_TRUE) {
+		if (cfg->maxProcessTable < 0 || cfg->maxProcessTable > 100) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"max-process-table\"\n");
+			fprintf(stderr, "watchdogd: using default value\n");
+			cfg->maxProcessTable = 90;
+		}
+	}
+
+	if (config_lookup_bool(&cfg->cfg, "fork-test", &tmp) == CONFIG_TRUE) {
+		if (tmp) {
+			cfg->options |= FORKTEST;
+		}
+	}
+
+	if (config_lookup_int(&cfg->cfg, "max-zombies", &cfg->maxZombies) == CONFIG_TRUE) {
+		if (cfg->maxZombies < 0) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"max-zombies\"\n");
+			fprintf(stderr, "watchdogd: zombie process monitoring disabled\n");
+			cfg->maxZombies = -1;
+		}
+	}
+
 	if (config_lookup_string(&cfg->cfg, "pid-pathname", &cfg->pidfileName)
 	    == CONFIG_FALSE) {
 		cfg->pidfileName = "/run/watchdogd.pid";
@@ -489,7 +577,7 @@ int ReadConfigurationFile(struct cfgoptions *const cfg)
 		cfg->priority = GetDefaultPriority();
 	}
 
-	if (config_lookup_float(&cfg->cfg, "max-load-1", &cfg->maxLoadOne) ==
+	if (ConfigLookupNumber(&cfg->cfg, "max-load-1", &cfg->maxLoadOne) ==
 	    CONFIG_TRUE) {
 		if (cfg->maxLoadOne < 0 || cfg->maxLoadOne > 100L) {
 			fprintf(stderr,
@@ -499,7 +587,7 @@ int ReadConfigurationFile(struct cfgoptions *const cfg)
 		}
 	}
 
-	if (config_lookup_float(&cfg->cfg, "max-load-5", &cfg->maxLoadFive) ==
+	if (ConfigLookupNumber(&cfg->cfg, "max-load-5", &cfg->maxLoadFive) ==
 	    CONFIG_TRUE) {
 		if (cfg->maxLoadFive <= 0 || cfg->maxLoadFive > 100L) {
 			if (cfg->maxLoadFive != 0) {
@@ -516,7 +604,7 @@ int ReadConfigurationFile(struct cfgoptions *const cfg)
 		cfg->maxLoadFive = cfg->maxLoadOne * 0.75;
 	}
 
-	if (config_lookup_float(&cfg->cfg, "max-load-15", &cfg->maxLoadFifteen)
+	if (ConfigLookupNumber(&cfg->cfg, "max-load-15", &cfg->maxLoadFifteen)
 	    == CONFIG_TRUE) {
 		if (cfg->maxLoadFifteen <= 0 || cfg->maxLoadFifteen > 100L) {
 
@@ -533,7 +621,7 @@ int ReadConfigurationFile(struct cfgoptions *const cfg)
 		cfg->maxLoadFifteen = cfg->maxLoadOne * 0.5;
 	}
 
-	if (config_lookup_float(&cfg->cfg, "retry-timeout", &cfg->retryLimit) ==
+	if (ConfigLookupNumber(&cfg->cfg, "retry-timeout", &cfg->retryLimit) ==
 	    CONFIG_TRUE) {
 		if (cfg->retryLimit > 86400L) {
 			fprintf(stderr,
@@ -545,7 +633,40 @@ int ReadConfigurationFile(struct cfgoptions *const cfg)
 		cfg->retryLimit = 0L;
 	}
 
-	if (config_lookup_bool(&cfg->cfg, "realtime-scheduling", &tmp)) {
+	if (config_lookup_bool(&cfg->cfg, "keepalive-thread", &tmp) == CONFIG_TRUE) {
+		if (tmp) {
+			cfg->options |= KEEPALIVETHREAD;
+		}
+	}
+
+	if (config_lookup_int(&cfg->cfg, "keepalive-priority", &tmp) == CONFIG_TRUE) {
+		if (CheckPriority(tmp) < 0) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"keepalive-priority\"\n");
+			fprintf(stderr, "watchdogd: using default value\n");
+			cfg->keepalivePriority = GetDefaultKeepalivePriority();
+		} else {
+			cfg->keepalivePriority = tmp;
+		}
+	} else {
+		cfg->keepalivePriority = GetDefaultKeepalivePriority();
+	}
+
+	if (config_lookup_int(&cfg->cfg, "keepalive-cpu", &tmp) == CONFIG_TRUE) {
+		if (tmp < 0 || tmp >= GetCpuCount()) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"keepalive-cpu\"\n");
+			fprintf(stderr, "watchdogd: keepalive thread will not be pinned\n");
+			cfg->keepaliveCpu = -1;
+		} else {
+			cfg->keepaliveCpu = tmp;
+		}
+	}
+
+	if (cfg->options & KEEPALIVETHREAD) {
+		//Only the keepalive thread runs with a realtime policy, everything
+		//else stays SCHED_OTHER so a busy check can't delay a keepalive.
+	} else if (config_lookup_bool(&cfg->cfg, "realtime-scheduling", &tmp)) {
 		if (tmp) {
 			if (SetSchedulerPolicy(cfg->priority) < 0) {
 				return -1;
@@ -571,6 +692,32 @@ int ReadConfigurationFile(struct cfgoptions *const cfg)
 		}
 	}
 
+	if (config_lookup_int(&cfg->cfg, "watchdog-pretimeout", &tmp) == CONFIG_TRUE) {
+		if (tmp <= 0 || tmp >= 60 || (cfg->watchdogTimeout != -1 && tmp >= cfg->watchdogTimeout)) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"watchdog-pretimeout\"\n");
+			fprintf(stderr, "watchdogd: pretimeout disabled\n");
+			cfg->watchdogPretimeout = -1;
+		} else {
+			cfg->watchdogPretimeout = tmp;
+		}
+	}
+
+	if (config_lookup_string(&cfg->cfg, "pretimeout-governor", &cfg->pretimeoutGovernor) == CONFIG_FALSE) {
+		cfg->pretimeoutGovernor = NULL;
+	}
+
+	if (config_lookup_string(&cfg->cfg, "pretimeout-script", &cfg->pretimeoutScript) == CONFIG_FALSE) {
+		cfg->pretimeoutScript = NULL;
+	}
+
+	if (cfg->pretimeoutScript != NULL && IsExe(cfg->pretimeoutScript, false) < 0) {
+		fprintf(stderr, "watchdogd: %s: Invalid executeable image\n",
+			cfg->pretimeoutScript);
+		fprintf(stderr, "watchdogd: ignoring pretimeout-script option\n");
+		cfg->pretimeoutScript = NULL;
+	}
+
 	if (config_lookup_int(&cfg->cfg, "repair-timeout", &tmp) == CONFIG_TRUE) {
 		if (tmp < 0 || tmp > 499999) {
 			fprintf(stderr,
@@ -595,19 +742,81 @@ int ReadConfigurationFile(struct cfgoptions *const cfg)
 		}
 	}
 
-	if (config_lookup_int(&cfg->cfg, "interval", &tmp) == CONFIG_TRUE) {
-		if (tmp < 0 || tmp > 60 || tmp == 0) {
-			tmp = 1;
+	if (LookupInterval(&cfg->cfg, "interval", &cfg->sleeptime) == CONFIG_TRUE) {
+		if (cfg->sleeptime < 10 || cfg->sleeptime > 60000) {
 			fprintf(stderr,
 				"watchdogd: illegal value for configuration file entry named \"interval\"\n");
 			fprintf(stderr, "watchdogd: using default value\n");
-		} else {
-			cfg->sleeptime = (time_t) tmp;
+			cfg->sleeptime = -1;
 		}
 	} else {
 		cfg->sleeptime = -1;
 	}
 
+	if (cfg->sleeptime != -1 && cfg->watchdogTimeout != -1
+	    && KeepaliveWorstCaseLatency(cfg, cfg->sleeptime) >= cfg->watchdogTimeout * 1000L
+	    && !(cfg->options & FORCE)) {
+		fprintf(stderr,
+			"watchdogd: worst case keepalive latency of %lims exceeds the watchdog timeout of %is\n",
+			KeepaliveWorstCaseLatency(cfg, cfg->sleeptime), cfg->watchdogTimeout);
+		fprintf(stderr, "watchdogd: use the -f option to force this configuration\n");
+		return -1;
+	}
+
+	if (config_lookup_bool(&cfg->cfg, "adaptive-interval", &tmp) == CONFIG_TRUE) {
+		if (tmp) {
+			cfg->options |= ADAPTIVEINTERVAL;
+		}
+	}
+
+	if (LookupInterval(&cfg->cfg, "min-interval", &cfg->minInterval) == CONFIG_TRUE) {
+		if (cfg->minInterval < 10 || cfg->minInterval > 60000) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"min-interval\"\n");
+			fprintf(stderr, "watchdogd: using default value\n");
+			cfg->minInterval = 0;
+		}
+	}
+
+	if (LookupInterval(&cfg->cfg, "max-interval", &cfg->maxInterval) == CONFIG_TRUE) {
+		if (cfg->maxInterval < 10 || cfg->maxInterval > 60000 || cfg->maxInterval < cfg->minInterval) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"max-interval\"\n");
+			fprintf(stderr, "watchdogd: using default value\n");
+			cfg->maxInterval = 0;
+		}
+	}
+
+	if (LookupInterval(&cfg->cfg, "check-interval", &cfg->checkInterval) == CONFIG_TRUE) {
+		if (cfg->checkInterval < 10 || cfg->checkInterval > 300000) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"check-interval\"\n");
+			fprintf(stderr, "watchdogd: using default value\n");
+			cfg->checkInterval = 5000;
+		}
+	} else {
+		cfg->checkInterval = 5000;
+	}
+
+	if (config_lookup_bool(&cfg->cfg, "health-gated-keepalive", &tmp) == CONFIG_TRUE) {
+		if (tmp) {
+			cfg->options |= HEALTHGATE;
+		}
+	} else {
+		cfg->options |= HEALTHGATE;
+	}
+
+	if (LookupInterval(&cfg->cfg, "monitor-deadline", &cfg->monitorDeadline) == CONFIG_TRUE) {
+		if (cfg->monitorDeadline <= cfg->checkInterval || cfg->monitorDeadline > 3600000) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"monitor-deadline\"\n");
+			fprintf(stderr, "watchdogd: using default value\n");
+			cfg->monitorDeadline = cfg->checkInterval * 2 + 10000;
+		}
+	} else {
+		cfg->monitorDeadline = cfg->checkInterval * 2 + 10000;
+	}
+
 	if (config_lookup_int(&cfg->cfg, "allocatable-memory", &cfg->allocatableMemory) == CONFIG_FALSE) {
 		cfg->allocatableMemory = 0;
 	}
@@ -641,6 +850,71 @@ int ReadConfigurationFile(struct cfgoptions *const cfg)
 		}
 	}
 
+	cfg->processes = config_lookup(&cfg->cfg, "processes");
+
+	if (cfg->processes != NULL) {
+		if (config_setting_is_list(cfg->processes) == CONFIG_FALSE) {
+			fprintf(stderr,
+				"watchdogd: %s:%i: illegal type for configuration file entry"
+				" \"processes\" expected list\n",
+				LibconfigWraperConfigSettingSourceFile
+				(cfg->processes),
+				config_setting_source_line(cfg->processes));
+			return -1;
+		}
+
+		if (config_setting_length(cfg->processes) == 0) {
+			cfg->processes = NULL;
+		} else if (ProcCheckInit(cfg->processes) == false) {
+			return -1;
+		}
+	}
+
+	cfg->pressure = config_lookup(&cfg->cfg, "pressure");
+
+	if (cfg->pressure != NULL && config_setting_is_group(cfg->pressure) == CONFIG_FALSE) {
+		fprintf(stderr,
+			"watchdogd: %s:%i: illegal type for configuration file entry"
+			" \"pressure\" expected group\n",
+			LibconfigWraperConfigSettingSourceFile
+			(cfg->pressure),
+			config_setting_source_line(cfg->pressure));
+		return -1;
+	}
+
+	cfg->cgroups = config_lookup(&cfg->cfg, "cgroups");
+
+	if (cfg->cgroups != NULL) {
+		if (config_setting_is_list(cfg->cgroups) == CONFIG_FALSE) {
+			fprintf(stderr,
+				"watchdogd: %s:%i: illegal type for configuration file entry"
+				" \"cgroups\" expected list\n",
+				LibconfigWraperConfigSettingSourceFile
+				(cfg->cgroups),
+				config_setting_source_line(cfg->cgroups));
+			return -1;
+		}
+
+		if (config_setting_length(cfg->cgroups) == 0) {
+			cfg->cgroups = NULL;
+		}
+	}
+
+	cfg->watchdogDevices = config_lookup(&cfg->cfg, "watchdog-devices");
+
+	if (cfg->watchdogDevices != NULL) {
+		if (config_setting_is_list(cfg->watchdogDevices) == CONFIG_FALSE
+		    && config_setting_is_array(cfg->watchdogDevices) == CONFIG_FALSE) {
+			fprintf(stderr,
+				"watchdogd: %s:%i: illegal type for configuration file entry"
+				" \"watchdog-devices\" expected list\n",
+				LibconfigWraperConfigSettingSourceFile
+				(cfg->watchdogDevices),
+				config_setting_source_line(cfg->watchdogDevices));
+			return -1;
+		}
+	}
+
 	cfg->networkInterfaces = config_lookup(&cfg->cfg, "network-interfaces");
 
 	if (cfg->networkInterfaces != NULL) {
@@ -724,3 +998,53 @@ int PingInit(struct cfgoptions *const cfg)
 
 	return 0;
 }
+
+//Reads the optional per check settings, e.g.
+//checks = { load-average = { interval = 1.0; jitter = 0.1; deadline = 20.0; }; };
+//Values that are absent or invalid are left unchanged.
+void LookupCheckSettings(struct cfgoptions *const cfg, const char *name, long *interval,
+			 long *jitter, long *deadline)
+{
+	config_setting_t *checks = config_lookup(&cfg->cfg, "checks");
+	double tmp = 0.0;
+
+	if (checks == NULL) {
+		return;
+	}
+
+	config_setting_t *check = config_setting_get_member(checks, name);
+
+	if (check == NULL) {
+		return;
+	}
+
+	if (ConfigSettingLookupNumber(check, "interval", &tmp) == CONFIG_TRUE) {
+		if (tmp < 0.01 || tmp > 3600.0) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"checks.%s.interval\"\n", name);
+			fprintf(stderr, "watchdogd: using default value\n");
+		} else {
+			*interval = (long)(tmp * 1000.0 + 0.5);
+		}
+	}
+
+	if (ConfigSettingLookupNumber(check, "jitter", &tmp) == CONFIG_TRUE) {
+		if (tmp < 0.0 || tmp * 1000.0 >= *interval) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"checks.%s.jitter\"\n", name);
+			fprintf(stderr, "watchdogd: using default value\n");
+		} else {
+			*jitter = (long)(tmp * 1000.0 + 0.5);
+		}
+	}
+
+	if (ConfigSettingLookupNumber(check, "deadline", &tmp) == CONFIG_TRUE) {
+		if (tmp < 0.01 || tmp > 3600.0) {
+			fprintf(stderr,
+				"watchdogd: illegal value for configuration file entry named \"checks.%s.deadline\"\n", name);
+			fprintf(stderr, "watchdogd: using default value\n");
+		} else {
+			*deadline = (long)(tmp * 1000.0 + 0.5);
+		}
+	}
+}
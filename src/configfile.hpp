@@ -2,4 +2,8 @@
 #define CONFIGFILE_H
 int ReadConfigurationFile(struct cfgoptions *const cfg);
 void NoWhitespace(char *);
+void LookupCheckSettings(struct cfgoptions *const, const char *, long *, long *, long *);
+const char *LibconfigWraperConfigSettingSourceFile(const config_setting_t *);
+int ConfigLookupNumber(const config_t *, const char *, double *);
+int ConfigSettingLookupNumber(const config_setting_t *, const char *, double *);
 #endif
@@ -16,6 +16,10 @@
 
 #define DBUSAPI_PROTOTYPES
 #include "dbusapi.hpp"
+#include "histogram.hpp"
+#include "watchdog.hpp"
+#include "keepalive.hpp"
+#include "scheduler.hpp"
 #include <errno.h>
 #include <stdlib.h>
 #include <zlib.h>
@@ -46,6 +50,14 @@ static const sd_bus_vtable watchdogPmon[] = {
 		SD_BUS_METHOD("Version", "", "x", Version, 0),
 		SD_BUS_METHOD("GetTimeout", "", "x", GetTimeoutDbus, 0),
 		SD_BUS_METHOD("GetTimeleft", "", "x", GetTimeleftDbus, 0),
+		SD_BUS_METHOD("GetPingLatency", "", "ttttt", GetPingLatencyDbus, 0),
+		SD_BUS_METHOD("GetPingLatencyHistogram", "", "at", GetPingLatencyHistogramDbus, 0),
+		SD_BUS_METHOD("DeviceCount", "", "u", DeviceCountDbus, 0),
+		SD_BUS_METHOD("DeviceStatus", "u", "ssxxttttttt", DeviceStatusDbus, 0),
+		SD_BUS_METHOD("AdaptiveStatus", "u", "btttxttts", AdaptiveStatusDbus, 0),
+		SD_BUS_METHOD("CheckCount", "", "u", CheckCountDbus, 0),
+		SD_BUS_METHOD("CheckStatus", "u", "sbbtttt", CheckStatusDbus, 0),
+		SD_BUS_METHOD("GetEscalationLatency", "", "ttttt", GetEscalationLatencyDbus, 0),
 		SD_BUS_METHOD("PmonInit", "t", "u", PmonInit, 0),
 		SD_BUS_METHOD("PmonPing", "u", "b", PmonPing, 0),
 		SD_BUS_METHOD("PmonRemove", "u", "b", PmonRemove, 0),
@@ -216,6 +228,145 @@ static int GetTimeleftDbus(sd_bus_message *m, void *userdata, sd_bus_error *retE
 	return sd_bus_reply_method_return(m, "x", buf);
 }
 
+static void GetPingStats(struct histogramstats *stats)
+{
+	unsigned int cmd = DBUSPINGSTATS;
+
+	memset(stats, 0, sizeof(*stats));
+	write(fd, &cmd, sizeof(cmd));
+	read(fd, stats, sizeof(*stats));
+}
+
+static int GetPingLatencyDbus(sd_bus_message *m, void *userdata, sd_bus_error *retError)
+{
+	struct histogramstats stats;
+
+	GetPingStats(&stats);
+
+	return sd_bus_reply_method_return(m, "ttttt", stats.count, stats.p50, stats.p99,
+					  stats.max, stats.missed);
+}
+
+static int GetPingLatencyHistogramDbus(sd_bus_message *m, void *userdata, sd_bus_error *retError)
+{
+	struct histogramstats stats;
+	sd_bus_message *reply = NULL;
+
+	GetPingStats(&stats);
+
+	int ret = sd_bus_message_new_method_return(m, &reply);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = sd_bus_message_append_array(reply, 't', stats.buckets, sizeof(stats.buckets));
+
+	if (ret >= 0) {
+		ret = sd_bus_send(NULL, reply, NULL);
+	}
+
+	sd_bus_message_unref(reply);
+
+	return ret;
+}
+
+static int DeviceCountDbus(sd_bus_message *m, void *userdata, sd_bus_error *retError)
+{
+	unsigned int cmd = DBUSDEVICECOUNT;
+	uint32_t count = 0;
+
+	write(fd, &cmd, sizeof(cmd));
+	read(fd, &count, sizeof(count));
+
+	return sd_bus_reply_method_return(m, "u", count);
+}
+
+static int DeviceStatusDbus(sd_bus_message *m, void *userdata, sd_bus_error *retError)
+{
+	unsigned int cmd = DBUSDEVICESTATUS;
+	uint32_t index = 0;
+	struct devicestatus status;
+
+	sd_bus_message_read(m, "u", &index);
+
+	memset(&status, 0, sizeof(status));
+	write(fd, &cmd, sizeof(cmd));
+	write(fd, &index, sizeof(index));
+	read(fd, &status, sizeof(status));
+
+	status.path[sizeof(status.path) - 1] = '\0';
+	status.identity[sizeof(status.identity) - 1] = '\0';
+
+	return sd_bus_reply_method_return(m, "ssxxttttttt", status.path, status.identity,
+					  status.timeout, status.timeleft, status.interval,
+					  status.lastPingAge, status.stats.count, status.stats.p50,
+					  status.stats.p99, status.stats.max, status.stats.missed);
+}
+
+static int AdaptiveStatusDbus(sd_bus_message *m, void *userdata, sd_bus_error *retError)
+{
+	unsigned int cmd = DBUSDEVICESTATUS;
+	uint32_t index = 0;
+	struct devicestatus status;
+
+	sd_bus_message_read(m, "u", &index);
+
+	memset(&status, 0, sizeof(status));
+	write(fd, &cmd, sizeof(cmd));
+	write(fd, &index, sizeof(index));
+	read(fd, &status, sizeof(status));
+
+	return sd_bus_reply_method_return(m, "btttxttts", (int)status.adaptive, status.interval,
+					  status.minInterval, status.maxInterval, status.margin,
+					  status.latencyPeak, status.shortened, status.lengthened,
+					  KeepaliveDecisionName(status.lastDecision));
+}
+
+static int CheckCountDbus(sd_bus_message *m, void *userdata, sd_bus_error *retError)
+{
+	unsigned int cmd = DBUSCHECKCOUNT;
+	uint32_t count = 0;
+
+	write(fd, &cmd, sizeof(cmd));
+	read(fd, &count, sizeof(count));
+
+	return sd_bus_reply_method_return(m, "u", count);
+}
+
+static int CheckStatusDbus(sd_bus_message *m, void *userdata, sd_bus_error *retError)
+{
+	unsigned int cmd = DBUSCHECKSTATUS;
+	uint32_t index = 0;
+	struct checkstatus status;
+
+	sd_bus_message_read(m, "u", &index);
+
+	memset(&status, 0, sizeof(status));
+	write(fd, &cmd, sizeof(cmd));
+	write(fd, &index, sizeof(index));
+	read(fd, &status, sizeof(status));
+
+	status.name[sizeof(status.name) - 1] = '\0';
+
+	return sd_bus_reply_method_return(m, "sbbtttt", status.name, (int)status.running,
+					  (int)status.hung, status.runningFor, status.lastDuration,
+					  status.deadline, status.hangs);
+}
+
+static int GetEscalationLatencyDbus(sd_bus_message *m, void *userdata, sd_bus_error *retError)
+{
+	unsigned int cmd = DBUSESCALATIONSTATS;
+	struct histogramstats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	write(fd, &cmd, sizeof(cmd));
+	read(fd, &stats, sizeof(stats));
+
+	return sd_bus_reply_method_return(m, "ttttt", stats.count, stats.p50, stats.p99,
+					  stats.max, stats.missed);
+}
+
 static int BusHandler(sd_event_source *es, int fd, uint32_t revents, void *userdata)
 {
 	sd_bus_process(bus, NULL);
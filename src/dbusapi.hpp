@@ -23,6 +23,12 @@
 #define DBUSGETNAME  5
 #define DBUSVERSION  6
 #define DBUSHUTDOWN  7
+#define DBUSPINGSTATS 8
+#define DBUSDEVICECOUNT 9
+#define DBUSDEVICESTATUS 10
+#define DBUSCHECKCOUNT 11
+#define DBUSCHECKSTATUS 12
+#define DBUSESCALATIONSTATS 13
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -36,6 +42,14 @@ static int Identity(sd_bus_message *, void *, sd_bus_error *);
 static int Version(sd_bus_message *, void *, sd_bus_error *);
 static int GetTimeoutDbus(sd_bus_message *, void *, sd_bus_error *);
 static int GetTimeleftDbus(sd_bus_message *, void *, sd_bus_error *);
+static int GetPingLatencyDbus(sd_bus_message *, void *, sd_bus_error *);
+static int GetPingLatencyHistogramDbus(sd_bus_message *, void *, sd_bus_error *);
+static int DeviceCountDbus(sd_bus_message *, void *, sd_bus_error *);
+static int DeviceStatusDbus(sd_bus_message *, void *, sd_bus_error *);
+static int AdaptiveStatusDbus(sd_bus_message *, void *, sd_bus_error *);
+static int CheckCountDbus(sd_bus_message *, void *, sd_bus_error *);
+static int CheckStatusDbus(sd_bus_message *, void *, sd_bus_error *);
+static int GetEscalationLatencyDbus(sd_bus_message *, void *, sd_bus_error *);
 static int PmonInit(sd_bus_message *, void *, sd_bus_error *);
 static int PmonPing(sd_bus_message *, void *, sd_bus_error *);
 static int PmonRemove(sd_bus_message *, void *, sd_bus_error *);
@@ -27,6 +27,7 @@
 #define	WECHKILL	248
 #define WESYSCALL	249
 #define WECUSTOM	246
+#define WECHECKHUNG	245
 #define WESCRIPT	251
 #define WEPIDFILE	250
 #define WEOTHER		WEZERO
@@ -0,0 +1,348 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "watchdogd.hpp"
+#include "linux.hpp"
+#include "handover.hpp"
+#include "logutils.hpp"
+#include "sub.hpp"
+
+struct handoverfd {
+	int fd;
+	bool taken;
+	char name[64];
+};
+
+struct handovermsg {
+	uint32_t type;
+	uint32_t count;
+	char names[MAX_HANDOVER_FDS][64];
+};
+
+//Descriptors received from a previous instance.
+static struct handoverfd inherited[MAX_HANDOVER_FDS];
+static size_t numberOfInherited = 0;
+
+//Descriptors this instance passes on when it is reloaded.
+static struct handoverfd offered[MAX_HANDOVER_FDS];
+static pthread_mutex_t offerLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool IsWatchdogFd(int fd)
+{
+	struct stat buf = {0};
+
+	return fstat(fd, &buf) == 0 && S_ISCHR(buf.st_mode);
+}
+
+void HandoverAdd(int fd, const char *name)
+{
+	if (fd < 0 || name == NULL) {
+		return;
+	}
+
+	if (numberOfInherited >= MAX_HANDOVER_FDS) {
+		Logmsg(LOG_ERR, "too many inherited descriptors, closing %s", name);
+		close(fd);
+		return;
+	}
+
+	struct handoverfd *h = &inherited[numberOfInherited];
+
+	h->fd = fd;
+	h->taken = false;
+	memset(h->name, 0, sizeof(h->name));
+	strncpy(h->name, name, sizeof(h->name) - 1);
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	numberOfInherited += 1;
+}
+
+//Called first thing in main() while LISTEN_PID still names this process.
+void HandoverInit(void)
+{
+	char *env = getenv(HANDOVER_ENV);
+
+	if (env != NULL) {
+		char *copy = strdup(env);
+		char *save = NULL;
+
+		for (char *entry = strtok_r(copy, ",", &save); copy != NULL && entry != NULL;
+		     entry = strtok_r(NULL, ",", &save)) {
+			char *name = strchr(entry, ':');
+
+			if (name == NULL) {
+				continue;
+			}
+
+			*name++ = '\0';
+
+			long fd = ConvertStringToInt(entry);
+
+			if (fd < 0 || fcntl((int)fd, F_GETFD) < 0) {
+				continue;
+			}
+
+			HandoverAdd((int)fd, name);
+		}
+
+		free(copy);
+		unsetenv(HANDOVER_ENV);
+	}
+
+	char **names = NULL;
+	int n = sd_listen_fds_with_names(1, &names);
+
+	for (int i = 0; i < n; i++) {
+		HandoverAdd(SD_LISTEN_FDS_START + i, names != NULL ? names[i] : "unknown");
+	}
+
+	if (names != NULL) {
+		for (int i = 0; i < n; i++) {
+			free(names[i]);
+		}
+		free(names);
+	}
+}
+
+//Returns the inherited descriptor called name, or -1.
+int HandoverTake(const char *name)
+{
+	for (size_t i = 0; i < numberOfInherited; i++) {
+		struct handoverfd *h = &inherited[i];
+
+		if (h->taken == false && strcmp(h->name, name) == 0) {
+			h->taken = true;
+			return h->fd;
+		}
+	}
+
+	return -1;
+}
+
+//Anything the new configuration does not use again is disarmed with the
+//magic close character and dropped from the systemd fd store.
+void HandoverCloseUnused(void)
+{
+	for (size_t i = 0; i < numberOfInherited; i++) {
+		struct handoverfd *h = &inherited[i];
+
+		if (h->taken == true) {
+			continue;
+		}
+
+		if (IsWatchdogFd(h->fd)) {
+			Logmsg(LOG_INFO, "%s is no longer used, disarming", h->name);
+			write(h->fd, "V", strlen("V"));
+			sd_notifyf(0, "FDSTOREREMOVE=1\nFDNAME=%s", h->name);
+		}
+
+		close(h->fd);
+	}
+
+	numberOfInherited = 0;
+}
+
+size_t HandoverCount(void)
+{
+	return numberOfInherited;
+}
+
+//Used by the supervisor to bridge the time between two service processes.
+void HandoverPing(void)
+{
+	for (size_t i = 0; i < numberOfInherited; i++) {
+		int tmp = 0;
+
+		if (IsWatchdogFd(inherited[i].fd)) {
+			ioctl(inherited[i].fd, WDIOC_KEEPALIVE, &tmp);
+		}
+	}
+}
+
+//A quarter of the shortest timeout of the inherited devices in milliseconds.
+int HandoverPingInterval(void)
+{
+	int interval = 1000;
+
+	for (size_t i = 0; i < numberOfInherited; i++) {
+		int timeout = 0;
+
+		if (IsWatchdogFd(inherited[i].fd) && ioctl(inherited[i].fd, WDIOC_GETTIMEOUT, &timeout) == 0
+		    && timeout > 0 && timeout * 250 < interval) {
+			interval = timeout * 250;
+		}
+	}
+
+	return interval;
+}
+
+//Drop the supervisor's copies once the new service process pings on its own.
+void HandoverRelease(void)
+{
+	for (size_t i = 0; i < numberOfInherited; i++) {
+		close(inherited[i].fd);
+	}
+
+	numberOfInherited = 0;
+}
+
+void HandoverOffer(int fd, const char *name)
+{
+	pthread_mutex_lock(&offerLock);
+
+	for (size_t i = 0; i < ARRAY_SIZE(offered); i++) {
+		if (offered[i].taken == false) {
+			offered[i].fd = fd;
+			offered[i].taken = true;
+			memset(offered[i].name, 0, sizeof(offered[i].name));
+			strncpy(offered[i].name, name, sizeof(offered[i].name) - 1);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&offerLock);
+
+	//systemd ignores a descriptor it already holds, so this is safe to
+	//repeat on every start. Outside of systemd it does nothing. The store
+	//only outlives a restart with FileDescriptorStorePreserve=yes.
+	char *msg = NULL;
+
+	Wasprintf(&msg, "FDSTORE=1\nFDNAME=%s", name);
+
+	if (msg != NULL) {
+		sd_pid_notify_with_fds(0, 0, msg, &fd, 1);
+		free(msg);
+	}
+}
+
+void HandoverWithdraw(int fd)
+{
+	pthread_mutex_lock(&offerLock);
+
+	for (size_t i = 0; i < ARRAY_SIZE(offered); i++) {
+		if (offered[i].taken == true && offered[i].fd == fd) {
+			offered[i].taken = false;
+		}
+	}
+
+	pthread_mutex_unlock(&offerLock);
+}
+
+static int SendMessage(int sock, struct handovermsg *msg, const int *fds)
+{
+	char control[CMSG_SPACE(sizeof(int) * MAX_HANDOVER_FDS)] = {0};
+	struct iovec iov = {msg, sizeof(*msg)};
+	struct msghdr hdr = {0};
+
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+
+	if (msg->count > 0) {
+		hdr.msg_control = control;
+		hdr.msg_controllen = CMSG_SPACE(sizeof(int) * msg->count);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * msg->count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * msg->count);
+	}
+
+	return sendmsg(sock, &hdr, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+//Sends every offered descriptor to the supervisor ahead of a reload.
+int HandoverSend(int sock)
+{
+	struct handovermsg msg = {0};
+	int fds[MAX_HANDOVER_FDS] = {0};
+
+	if (sock < 0) {
+		return -1;
+	}
+
+	msg.type = HANDOVER_OFFER;
+
+	pthread_mutex_lock(&offerLock);
+
+	for (size_t i = 0; i < ARRAY_SIZE(offered); i++) {
+		if (offered[i].taken == true) {
+			fds[msg.count] = offered[i].fd;
+			memcpy(msg.names[msg.count], offered[i].name, sizeof(msg.names[0]));
+			msg.count += 1;
+		}
+	}
+
+	pthread_mutex_unlock(&offerLock);
+
+	if (SendMessage(sock, &msg, fds) < 0) {
+		Logmsg(LOG_ERR, "unable to hand over descriptors: %s", MyStrerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+//Tells the supervisor that this process keeps its devices alive now.
+void HandoverReady(int sock)
+{
+	struct handovermsg msg = {0};
+
+	if (sock < 0) {
+		return;
+	}
+
+	msg.type = HANDOVER_READY;
+
+	SendMessage(sock, &msg, NULL);
+}
+
+//Returns the type of the message read from sock, 0 if there was none.
+int HandoverReceive(int sock)
+{
+	char control[CMSG_SPACE(sizeof(int) * MAX_HANDOVER_FDS)] = {0};
+	struct handovermsg msg = {0};
+	struct iovec iov = {&msg, sizeof(msg)};
+	struct msghdr hdr = {0};
+
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+
+	if (recvmsg(sock, &hdr, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) <= 0) {
+		return 0;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int fds[MAX_HANDOVER_FDS] = {0};
+
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (count < MAX_HANDOVER_FDS ? count : MAX_HANDOVER_FDS));
+
+		for (size_t i = 0; i < count && i < MAX_HANDOVER_FDS; i++) {
+			msg.names[i][sizeof(msg.names[i]) - 1] = '\0';
+			HandoverAdd(fds[i], i < msg.count ? msg.names[i] : "unknown");
+		}
+	}
+
+	return (int)msg.type;
+}
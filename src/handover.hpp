@@ -0,0 +1,44 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef HANDOVER_H
+#define HANDOVER_H
+#include <stddef.h>
+
+//Open descriptors survive a reload or restart in three ways: the service
+//process sends them to the supervisor over a socket before it exits, they
+//are listed as fd:name pairs in WATCHDOGD_FD across an execve, or systemd
+//keeps them in its fd store (FileDescriptorStoreMax).
+#define HANDOVER_ENV "WATCHDOGD_FD"
+#define MAX_HANDOVER_FDS 16
+
+#define HANDOVER_OFFER 1
+#define HANDOVER_READY 2
+
+void HandoverInit(void);
+void HandoverAdd(int, const char *);
+int HandoverTake(const char *);
+void HandoverCloseUnused(void);
+size_t HandoverCount(void);
+void HandoverPing(void);
+int HandoverPingInterval(void);
+void HandoverRelease(void);
+void HandoverOffer(int, const char *);
+void HandoverWithdraw(int);
+int HandoverSend(int);
+int HandoverReceive(int);
+void HandoverReady(int);
+#endif
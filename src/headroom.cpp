@@ -0,0 +1,171 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//Process table headroom. The number of tasks on the system, the second
+//half of the fourth field of /proc/loadavg, is compared against pid_max and
+//threads-max, and the pids controller of every cgroup from watchdogd's own
+//up to the root against its limit. The check alarms before fork starts
+//failing with EAGAIN instead of after, without forking.
+
+#include "watchdogd.hpp"
+#include "logutils.hpp"
+#include "scheduler.hpp"
+#include "sysroot.hpp"
+#include "headroom.hpp"
+
+//Fails for "max", which means no limit.
+static bool ReadValue(const char *path, unsigned long *value)
+{
+	FILE *fp = SysrootFopen(path, "re");
+
+	if (fp == NULL) {
+		return false;
+	}
+
+	int ret = fscanf(fp, "%lu", value);
+	fclose(fp);
+
+	return ret == 1;
+}
+
+static bool ReadTasks(unsigned long *tasks)
+{
+	FILE *fp = SysrootFopen("/proc/loadavg", "re");
+	unsigned long running = 0;
+
+	if (fp == NULL) {
+		return false;
+	}
+
+	int ret = fscanf(fp, "%*f %*f %*f %lu/%lu", &running, tasks);
+	fclose(fp);
+
+	return ret == 2;
+}
+
+static bool Exceeds(unsigned long used, unsigned long limit, int percent)
+{
+	return limit != 0 && (double)used * 100.0 >= (double)limit * (double)percent;
+}
+
+//The v1 pids hierarchy if it is mounted, the unified one otherwise.
+static bool PidsCgroup(char *dir, size_t len)
+{
+	FILE *fp = SysrootFopen("/proc/self/cgroup", "re");
+	char line[PATH_MAX] = {'\0'};
+	char path[PATH_MAX] = {'\0'};
+	struct stat st = {0};
+	bool found = false;
+
+	if (fp == NULL) {
+		return false;
+	}
+
+	while (found == false && fgets(line, sizeof(line), fp) != NULL) {
+		char *controllers = strchr(line, ':');
+		char *cgroup = controllers != NULL ? strchr(controllers + 1, ':') : NULL;
+
+		if (cgroup == NULL) {
+			continue;
+		}
+
+		*controllers++ = '\0';
+		*cgroup++ = '\0';
+		cgroup[strcspn(cgroup, "\n")] = '\0';
+
+		if (strcmp(controllers, "pids") == 0) {
+			found = snprintf(dir, len, "/sys/fs/cgroup/pids%s", cgroup) < (int)len;
+		} else if (controllers[0] == '\0' && strcmp(line, "0") == 0) {
+			bool unified = SysrootPath(path, sizeof(path), "/sys/fs/cgroup/cgroup.controllers") == true
+			    && stat(path, &st) == 0;
+
+			snprintf(dir, len, "%s%s", unified ? "/sys/fs/cgroup" : "/sys/fs/cgroup/unified", cgroup);
+		}
+	}
+
+	fclose(fp);
+
+	return found == true || dir[0] != '\0';
+}
+
+static bool CgroupExceeds(int percent)
+{
+	char dir[PATH_MAX] = {'\0'};
+	char path[PATH_MAX] = {'\0'};
+	bool exceeds = false;
+
+	if (PidsCgroup(dir, sizeof(dir)) == false) {
+		return false;
+	}
+
+	for (char *slash = dir + strlen(dir); slash != NULL; slash = strrchr(dir, '/')) {
+		unsigned long current = 0;
+		unsigned long max = 0;
+
+		*slash = '\0';
+
+		if (strchr(dir, '/') == NULL || strcmp(dir, "/sys/fs") == 0) {
+			break;
+		}
+
+		snprintf(path, sizeof(path), "%s/pids.max", dir);
+
+		if (ReadValue(path, &max) == false) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/pids.current", dir);
+
+		if (ReadValue(path, &current) == true && Exceeds(current, max, percent) == true) {
+			Logmsg(LOG_ERR, "%s: %lu of %lu pids in use", dir, current, max);
+			exceeds = true;
+		}
+	}
+
+	return exceeds;
+}
+
+void HeadroomCheck(struct cfgoptions *s, struct check *c)
+{
+	unsigned long tasks = 0;
+	unsigned long pidMax = 0;
+	unsigned long threadsMax = 0;
+	bool exceeds = false;
+
+	if (ReadTasks(&tasks) == true) {
+		if (ReadValue("/proc/sys/kernel/pid_max", &pidMax) == true
+		    && Exceeds(tasks, pidMax, s->maxProcessTable) == true) {
+			Logmsg(LOG_ERR, "%lu tasks running, pid_max is %lu", tasks, pidMax);
+			exceeds = true;
+		}
+
+		if (ReadValue("/proc/sys/kernel/threads-max", &threadsMax) == true
+		    && Exceeds(tasks, threadsMax, s->maxProcessTable) == true) {
+			Logmsg(LOG_ERR, "%lu tasks running, threads-max is %lu", tasks, threadsMax);
+			exceeds = true;
+		}
+	}
+
+	if (CgroupExceeds(s->maxProcessTable) == true) {
+		exceeds = true;
+	}
+
+	if (exceeds == true) {
+		CheckFail(c, FORKFAILED);
+	} else {
+		CheckPass(c, FORKFAILED);
+	}
+}
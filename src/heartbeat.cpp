@@ -0,0 +1,112 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "watchdogd.hpp"
+#include "clock.hpp"
+#include "heartbeat.hpp"
+#include "logutils.hpp"
+
+//Slots are never reused, a heartbeat only goes inactive. This keeps the
+//reader side a plain scan with no locks.
+static struct heartbeat heartbeats[MAX_HEARTBEATS];
+static std::atomic_size_t reserved = {0};
+
+static size_t HeartbeatCount(void)
+{
+	size_t count = reserved.load(std::memory_order_acquire);
+
+	return count > MAX_HEARTBEATS ? MAX_HEARTBEATS : count;
+}
+
+struct heartbeat *HeartbeatRegister(const char *name, uint64_t deadline, unsigned int flags)
+{
+	size_t index = reserved.fetch_add(1);
+
+	if (index >= MAX_HEARTBEATS) {
+		Logmsg(LOG_ERR, "unable to register heartbeat for %s", name);
+		return NULL;
+	}
+
+	struct heartbeat *h = &heartbeats[index];
+
+	h->name = name;
+	h->deadline = deadline;
+	h->flags = flags;
+	h->generation = 0;
+	h->timestamp = ClockNow();
+	h->pendingSince = 0;
+	h->active.store(true, std::memory_order_release);
+
+	return h;
+}
+
+void HeartbeatRemove(struct heartbeat *h)
+{
+	if (h != NULL) {
+		h->active.store(false, std::memory_order_release);
+	}
+}
+
+void HeartbeatBeat(struct heartbeat *h)
+{
+	if (h == NULL) {
+		return;
+	}
+
+	h->timestamp.store(ClockNow(), std::memory_order_release);
+	h->pendingSince.store(0, std::memory_order_release);
+	h->generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+//Called by the scheduler before it starts a run of a paced check. The check
+//can not answer before it is started, so the run is always marked pending
+//before the matching HeartbeatBeat.
+void HeartbeatExpect(struct heartbeat *h, uint64_t now)
+{
+	unsigned long long expected = 0;
+
+	if (h == NULL || !(h->flags & HEARTBEAT_PACED)) {
+		return;
+	}
+
+	//Keep the start of the oldest run that is still unanswered.
+	h->pendingSince.compare_exchange_strong(expected, now);
+}
+
+//Returns the name of the first critical monitor whose result is older than
+//its deadline, or NULL if all are fresh. Takes no locks so it is cheap
+//enough to run before every keepalive.
+const char *HeartbeatFindStale(uint64_t now)
+{
+	size_t count = HeartbeatCount();
+
+	for (size_t i = 0; i < count; i++) {
+		struct heartbeat *h = &heartbeats[i];
+
+		if (h->active.load(std::memory_order_acquire) == false || !(h->flags & HEARTBEAT_CRITICAL)) {
+			continue;
+		}
+
+		uint64_t since = h->flags & HEARTBEAT_PACED ? h->pendingSince.load(std::memory_order_acquire)
+		    : h->timestamp.load(std::memory_order_acquire);
+
+		if (since != 0 && now > since && now - since > h->deadline) {
+			return h->name;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_HEARTBEATS 32
+
+//Checks started by the scheduler are paced: they are only stale if a run
+//they were asked for has been outstanding for longer than the deadline, so
+//pausing the scheduler never makes them stale.
+#define HEARTBEAT_CRITICAL 0x1
+#define HEARTBEAT_PACED 0x2
+
+struct heartbeat {
+	const char *name;
+	uint64_t deadline;
+	unsigned int flags;
+	std::atomic_ullong generation;
+	std::atomic_ullong timestamp;
+	std::atomic_ullong pendingSince;
+	std::atomic_bool active;
+};
+
+struct heartbeat *HeartbeatRegister(const char *, uint64_t, unsigned int);
+void HeartbeatRemove(struct heartbeat *);
+void HeartbeatBeat(struct heartbeat *);
+void HeartbeatExpect(struct heartbeat *, uint64_t);
+const char *HeartbeatFindStale(uint64_t);
+#endif
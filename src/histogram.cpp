@@ -0,0 +1,108 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "histogram.hpp"
+
+static size_t BucketIndex(uint64_t value)
+{
+	if (value == 0) {
+		return 0;
+	}
+
+	size_t index = 64 - __builtin_clzll(value);
+
+	if (index >= HISTOGRAM_BUCKETS) {
+		return HISTOGRAM_BUCKETS - 1;
+	}
+
+	return index;
+}
+
+static uint64_t BucketUpperBound(size_t index)
+{
+	if (index == 0) {
+		return 0;
+	}
+
+	return (1ULL << index) - 1;
+}
+
+void Histogram::Record(uint64_t value)
+{
+	buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+
+	unsigned long long old = max.load(std::memory_order_relaxed);
+	while (value > old && !max.compare_exchange_weak(old, value, std::memory_order_relaxed)) ;
+}
+
+uint64_t Histogram::Count()
+{
+	return count.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::Max()
+{
+	return max.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::Percentile(double p)
+{
+	uint64_t total = Count();
+
+	if (total == 0) {
+		return 0;
+	}
+
+	uint64_t target = (uint64_t)(p * total);
+	uint64_t seen = 0;
+
+	if (target == 0) {
+		target = 1;
+	}
+
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += buckets[i].load(std::memory_order_relaxed);
+		if (seen >= target) {
+			uint64_t bound = BucketUpperBound(i);
+			return bound < Max() ? bound : Max();
+		}
+	}
+
+	return Max();
+}
+
+void Histogram::Snapshot(struct histogramstats *stats)
+{
+	stats->count = Count();
+	stats->p50 = Percentile(0.50);
+	stats->p99 = Percentile(0.99);
+	stats->max = Max();
+
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		stats->buckets[i] = buckets[i].load(std::memory_order_relaxed);
+	}
+}
+
+void Histogram::Reset()
+{
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		buckets[i] = 0;
+	}
+
+	count = 0;
+	max = 0;
+}
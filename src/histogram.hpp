@@ -0,0 +1,47 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+//Bucket n counts samples in [2^(n-1), 2^n) microseconds, bucket 0 counts zero.
+#define HISTOGRAM_BUCKETS 32
+
+struct histogramstats {
+	uint64_t count;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t max;
+	uint64_t missed;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+class Histogram {
+	std::atomic_ullong buckets[HISTOGRAM_BUCKETS] = {};
+	std::atomic_ullong count = {0};
+	std::atomic_ullong max = {0};
+public:
+	void Record(uint64_t);
+	uint64_t Count();
+	uint64_t Max();
+	uint64_t Percentile(double);
+	void Snapshot(struct histogramstats *);
+	void Reset();
+};
+#endif
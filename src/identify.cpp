@@ -15,6 +15,7 @@
  */
 
 #include "watchdogd.hpp"
+#include "sysroot.hpp"
 
 int Identify(long timeout, const char * identity, const char * deviceName, bool verbose)
 {
@@ -72,8 +73,8 @@ direct:
 		sprintf(sysfsIdentity, "/sys/class/watchdog/%s/identity", watchdogBasename);
 		sprintf(sysfsTimeout, "/sys/class/watchdog/%s/timeout", watchdogBasename);
 
-		FILE * timeoutFile = fopen(sysfsTimeout, "r");
-		FILE * identityFile = fopen(sysfsIdentity, "r");
+		FILE * timeoutFile = SysrootFopen(sysfsTimeout, "r");
+		FILE * identityFile = SysrootFopen(sysfsIdentity, "r");
 		if (!identityFile||!timeoutFile||!sysfsIdentity||!sysfsTimeout) {
 			free(watchdogBasename);
 			free(sysfsIdentity);
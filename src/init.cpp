@@ -21,6 +21,8 @@
 #include "multicall.hpp"
 #include "logutils.hpp"
 #include "linux.hpp"
+#include "benchmark.hpp"
+#include "simulate.hpp"
 
 int SetSchedulerPolicy(int priority)
 {
@@ -58,6 +60,9 @@ int ParseCommandLine(int *argc, char **argv, struct cfgoptions *cfg, bool earlyP
 		{"help", no_argument, 0, 'h'},
 		{"identify", no_argument, 0, 'i'},
 		{"version", no_argument, 0, 'V'},
+		{"benchmark", optional_argument, 0, 'B'},
+		{"simulate", optional_argument, 0, 'S'},
+		{"config-file", required_argument, 0, 'c'},
 		{"no-action", no_argument, 0, 'q'},
 		{"foreground", no_argument, 0, 'F'},
 		{"debug", no_argument, 0, 'd'},
@@ -66,22 +71,23 @@ int ParseCommandLine(int *argc, char **argv, struct cfgoptions *cfg, bool earlyP
 		{"softboot", no_argument, 0, 'b'},
 		{"daemonize", no_argument, 0, 'D'},
 		{"verbose", no_argument, 0, 'v'},
-		{"config-file", required_argument, 0, 'c'},
 		{"loglevel", required_argument, 0, 'l'},
 		{0, 0, 0, 0}
 	};
 
 	char const * const loglevels[] = { "\x1b[1mnone", "err", "info", "notice", "debug\x1B[0m"};
 	struct cfgoptions x;
-	const char *opstr;
+	const char *opstr = "iDhqsfFbVvndc:l:";
+	//The early parse knows every option so that their arguments are skipped,
+	//but only acts on those that run instead of the daemon. Errors are left
+	//to the second parse.
+	const char *early = "hiVcBS";
+	long simulate = -1;
 	if (earlyParse) {
-		opstr = "hiV";
-		longOptions[3] = {0,0,0,0};
 		if (!cfg) {
 			cfg = &x;
 		}
 	} else {
-		opstr = "iDhqsfFbVvndc:l:";
 		optind = 0;
 	}
 
@@ -89,6 +95,10 @@ int ParseCommandLine(int *argc, char **argv, struct cfgoptions *cfg, bool earlyP
 	while ((opt =
 		getopt_long(*argc, argv, opstr, longOptions, &tmp)) != -1) {
 
+		if (earlyParse && (opt == '?' || strchr(early, opt) == NULL)) {
+			continue;
+		}
+
 		switch (opt) {
 		case 'n':
 		case 'd':
@@ -130,6 +140,13 @@ int ParseCommandLine(int *argc, char **argv, struct cfgoptions *cfg, bool earlyP
 			if (earlyParse)
 				quick_exit(1);
 			return 1;
+		case 'B':
+			if (earlyParse)
+				quick_exit(Benchmark(optarg ? strtoul(optarg, NULL, 10) : BENCHMARK_ROUNDS));
+			break;
+		case 'S':
+			simulate = optarg ? strtol(optarg, NULL, 10) : SIMULATE_SECONDS;
+			break;
 		case 'h':
 			if (cfg->options & IDENTIFY) {
 				PrintHelpIdentify();
@@ -171,6 +188,10 @@ int ParseCommandLine(int *argc, char **argv, struct cfgoptions *cfg, bool earlyP
 		}
 	}
 
+	if (earlyParse && simulate > 0) {
+		quick_exit(Simulate(cfg, (unsigned long)simulate));
+	}
+
 	if (optind < *argc) {
 		struct stat buf = {0};
 		if (stat(argv[optind], &buf) < 0) {
@@ -201,6 +222,19 @@ int GetDefaultPriority(void)
 	return ret;
 }
 
+int GetDefaultKeepalivePriority(void)
+{
+	int max = sched_get_priority_max(SCHED_FIFO);
+	int min = sched_get_priority_min(SCHED_FIFO);
+
+	if (max < 0 || min < 0) {
+		fprintf(stderr, "watchdogd: %s\n", MyStrerror(errno));
+		return GetDefaultPriority();
+	}
+
+	return min + (max - min) / 2;
+}
+
 int CheckPriority(int priority)
 {
 	int max = 0;
@@ -327,6 +361,8 @@ static void PrintHelpMain(void)
 		{"A watchdog daemon for linux.", ""},
 		{"", ""},
 		{"  -b, --softboot", "ignore file open errors"},
+		{"      --benchmark[=N]", "inject N rounds of failures in no-action mode and print detection latencies"},
+		{"      --simulate[=S]", "run the checks of the configuration file for S seconds of virtual time"},
 		{"  -c, --config-file ", "path to configuration file"},
 		{"  -D, --daemonize ", "daemonize  after  startup"},
 		{"  -f, --force",
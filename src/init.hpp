@@ -24,5 +24,6 @@ int PrintVersionString(void);
 int ParseCommandLine(int *argc, char **argv, struct cfgoptions *s, bool earlyParse = false);
 bool SetDefaultConfig(struct cfgoptions *const options);
 int GetDefaultPriority(void);
+int GetDefaultKeepalivePriority(void);
 int PingInit(struct cfgoptions *const cfg);
 #endif
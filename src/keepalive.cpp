@@ -0,0 +1,599 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "watchdogd.hpp"
+#include "keepalive.hpp"
+#include "heartbeat.hpp"
+#include "backend.hpp"
+#include "configfile.hpp"
+#include "logutils.hpp"
+
+#define KEEPALIVE_STACK_SIZE (PTHREAD_STACK_MIN * 4)
+#define KEEPALIVE_GUARD_SIZE ((size_t)sysconf(_SC_PAGESIZE))
+//Number of consecutive quiet keepalives before the adaptive interval grows.
+#define ADAPT_CALM_PERIODS 16
+
+//Read by the DBus helper while devices are registered and closed.
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static struct keepalive *registry[MAX_WATCHDOG_DEVICES] = {NULL};
+static std::atomic_size_t registered = {0};
+
+//Additional devices from the watchdog-devices list. The primary device is
+//owned by ServiceMain.
+static Watchdog devices[MAX_WATCHDOG_DEVICES - 1];
+static struct keepalive keepalives[MAX_WATCHDOG_DEVICES - 1];
+static size_t numberOfDevices = 0;
+
+uint64_t KeepaliveNow(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+//Longest gap in milliseconds between two keepalives sent every interval
+//milliseconds: the interval plus the latency of the context they run in.
+long KeepaliveWorstCaseLatency(const struct cfgoptions *s, long interval)
+{
+	return interval + (s->options & KEEPALIVETHREAD ? KEEPALIVE_THREAD_LATENCY : KEEPALIVE_LOOP_LATENCY);
+}
+
+void KeepaliveInit(struct keepalive *k, Watchdog *watchdog, uint64_t interval)
+{
+	assert(k != NULL);
+	assert(interval > 0);
+
+	k->watchdog = watchdog;
+	k->interval = interval;
+	k->deadline = KeepaliveNow();
+	k->lastPing = 0;
+	k->missed = 0;
+	k->lateness.Reset();
+	k->adaptive = false;
+	k->latencyPeak = 0;
+	k->calm = 0;
+	k->margin = -1;
+	k->shortened = 0;
+	k->lengthened = 0;
+	k->lastDecision = ADAPT_NONE;
+	k->healthGate = false;
+	k->stale = NULL;
+}
+
+//Let the interval of k move between min and max microseconds. The upper
+//bound is further limited to half of the device timeout.
+void KeepaliveSetAdaptive(struct keepalive *k, uint64_t min, uint64_t max)
+{
+	uint64_t timeout = (uint64_t)k->watchdog->GetRawTimeout() * 1000000ULL;
+
+	if (timeout == 0) {
+		Logmsg(LOG_WARNING, "%s: unknown timeout, adaptive interval disabled",
+		       k->watchdog->GetPath());
+		return;
+	}
+
+	if (max == 0 || max > timeout / 2) {
+		max = timeout / 2;
+	}
+
+	if (min == 0 || min > max) {
+		min = max < 1000000ULL ? max : 1000000ULL;
+	}
+
+	k->timeout = timeout;
+	k->minInterval = min;
+	k->maxInterval = max;
+
+	if (k->interval < min) {
+		k->interval = min;
+	} else if (k->interval > max) {
+		k->interval = max;
+	}
+
+	k->adaptive = true;
+}
+
+const char *KeepaliveDecisionName(int decision)
+{
+	switch (decision) {
+	case ADAPT_HOLD:
+		return "hold";
+	case ADAPT_SHORTEN:
+		return "shorten";
+	case ADAPT_LENGTHEN:
+		return "lengthen";
+	}
+
+	return "none";
+}
+
+//margin is how much of the timeout the device had left when the keepalive
+//landed, late how far behind its deadline the keepalive was. Stress halves
+//the interval at once, a long quiet run grows it by an eighth.
+static void KeepaliveAdapt(struct keepalive *k, int64_t margin, uint64_t late)
+{
+	uint64_t interval = k->interval;
+	uint64_t next = interval;
+
+	k->latencyPeak = late > k->latencyPeak ? late : k->latencyPeak - k->latencyPeak / 8;
+	k->margin = margin;
+
+	//Whatever the bounds say, a latency spike four times the worst recently
+	//seen on top of one lost period must still fit in the timeout.
+	uint64_t reserve = 4 * k->latencyPeak;
+	uint64_t ceiling = k->timeout > reserve ? (k->timeout - reserve) / 2 : 0;
+
+	if (ceiling > k->maxInterval) {
+		ceiling = k->maxInterval;
+	} else if (ceiling < k->minInterval) {
+		ceiling = k->minInterval;
+	}
+
+	bool stressed = late > interval / 8 || (margin >= 0 && (uint64_t)margin < k->timeout / 4);
+
+	if (stressed || interval > ceiling) {
+		k->calm = 0;
+		next = stressed ? interval / 2 : ceiling;
+
+		if (next > ceiling) {
+			next = ceiling;
+		}
+
+		if (next < k->minInterval) {
+			next = k->minInterval;
+		}
+	} else if (late * 100 < interval) {
+		if (++k->calm >= ADAPT_CALM_PERIODS) {
+			k->calm = 0;
+			next = interval + interval / 8;
+
+			if (next > ceiling) {
+				next = ceiling;
+			}
+		}
+	} else {
+		k->calm = 0;
+	}
+
+	if (next < interval) {
+		k->shortened += 1;
+		k->lastDecision = ADAPT_SHORTEN;
+		Logmsg(LOG_INFO, "%s: keepalive interval shortened to %" PRIu64 "ms (margin %" PRId64
+		       "ms, latency %" PRIu64 "us)", k->watchdog->GetPath(), next / 1000,
+		       margin < 0 ? margin : margin / 1000, k->latencyPeak);
+	} else if (next > interval) {
+		k->lengthened += 1;
+		k->lastDecision = ADAPT_LENGTHEN;
+		Logmsg(LOG_DEBUG, "%s: keepalive interval lengthened to %" PRIu64 "ms",
+		       k->watchdog->GetPath(), next / 1000);
+	} else {
+		k->lastDecision = ADAPT_HOLD;
+	}
+
+	k->interval = next;
+}
+
+//Move the deadline to the next period. If we slept through one or more
+//whole periods skip them instead of bursting keepalives, but stay on the
+//original phase.
+static void KeepaliveAdvance(struct keepalive *k, uint64_t now)
+{
+	k->deadline += k->interval;
+
+	if (k->deadline <= now) {
+		uint64_t behind = (now - k->deadline) / k->interval + 1;
+		k->missed += behind;
+		k->deadline += behind * k->interval;
+		Logmsg(LOG_WARNING, "keepalive late, skipped %" PRIu64 " period(s)", behind);
+	}
+}
+
+//A monitor that stopped reporting must not be hidden by a pinger that still
+//runs. Withholding the keepalive lets the hardware reset the machine unless
+//the monitor recovers first.
+static bool KeepaliveWithhold(struct keepalive *k, uint64_t now)
+{
+	const char *stale = HeartbeatFindStale(now);
+
+	if (stale != k->stale) {
+		if (stale != NULL) {
+			Logmsg(LOG_ALERT, "%s: withholding keepalives, %s monitor missed its deadline",
+			       k->watchdog->GetPath(), stale);
+		} else {
+			Logmsg(LOG_ALERT, "%s: all monitors reporting again, keepalives resumed",
+			       k->watchdog->GetPath());
+		}
+		k->stale = stale;
+	}
+
+	return stale != NULL;
+}
+
+int KeepaliveRun(struct keepalive *k)
+{
+	int64_t margin = -1;
+
+	if (k->healthGate && KeepaliveWithhold(k, KeepaliveNow())) {
+		KeepaliveAdvance(k, KeepaliveNow());
+		return -1;
+	}
+
+	//Sample the margin before the keepalive resets it. Drivers without
+	//WDIOC_GETTIMELEFT get an estimate from the previous keepalive.
+	if (k->adaptive) {
+		long timeleft = k->watchdog->GetTimeleft();
+		uint64_t lastPing = k->lastPing;
+		uint64_t before = KeepaliveNow();
+
+		if (timeleft >= 0) {
+			margin = (int64_t)timeleft * 1000000LL;
+		} else if (lastPing != 0) {
+			margin = before - lastPing >= k->timeout ? 0 : (int64_t)(k->timeout - (before - lastPing));
+		}
+	}
+
+	int ret = k->watchdog->Ping();
+	uint64_t now = KeepaliveNow();
+	uint64_t late = now > k->deadline ? now - k->deadline : 0;
+
+	//lateness is measured against the moment WDIOC_KEEPALIVE returned, so a
+	//slow driver shows up in the histogram as well as a late wakeup.
+	k->lateness.Record(late);
+
+	if (ret == 0) {
+		k->lastPing = now;
+	}
+
+	if (k->adaptive) {
+		KeepaliveAdapt(k, margin, late);
+	}
+
+	KeepaliveAdvance(k, now);
+
+	return ret;
+}
+
+void KeepaliveGetStats(struct keepalive *k, struct histogramstats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (k == NULL) {
+		return;
+	}
+
+	k->lateness.Snapshot(stats);
+	stats->missed = k->missed;
+}
+
+static void UsecToTimespec(uint64_t usec, struct timespec *ts)
+{
+	ts->tv_sec = usec / 1000000ULL;
+	ts->tv_nsec = (usec % 1000000ULL) * 1000ULL;
+}
+
+static void *KeepaliveThread(void *arg)
+{
+	struct keepalive *k = (struct keepalive *)arg;
+	int x = 0;
+
+	while (k->threadRunning) {
+		struct timespec ts = {0};
+		UsecToTimespec(k->deadline, &ts);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &x);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) ;
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &x);
+
+		KeepaliveRun(k);
+	}
+
+	return NULL;
+}
+
+int KeepaliveStartThread(struct keepalive *k, int priority, int cpu)
+{
+	pthread_attr_t attr;
+	struct sched_param param = {0};
+
+	//The stack is pre-faulted and locked so the first keepalive after an idle
+	//period never waits on a page fault. A page below it is left inaccessible
+	//so an overflow faults instead of overwriting other memory.
+	k->stack = mmap(NULL, KEEPALIVE_GUARD_SIZE + KEEPALIVE_STACK_SIZE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	char *stack = k->stack == MAP_FAILED ? (char *)MAP_FAILED : (char *)k->stack + KEEPALIVE_GUARD_SIZE;
+
+	if (stack != MAP_FAILED) {
+		stack = (char *)mmap(stack, KEEPALIVE_STACK_SIZE, PROT_READ | PROT_WRITE,
+				     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_POPULATE | MAP_FIXED, -1, 0);
+	}
+
+	if (stack == MAP_FAILED) {
+		Logmsg(LOG_ERR, "unable to allocate keepalive stack: %s", MyStrerror(errno));
+
+		if (k->stack != MAP_FAILED) {
+			munmap(k->stack, KEEPALIVE_GUARD_SIZE + KEEPALIVE_STACK_SIZE);
+		}
+
+		k->stack = NULL;
+		return -1;
+	}
+
+	if (mlock(stack, KEEPALIVE_STACK_SIZE) < 0) {
+		Logmsg(LOG_WARNING, "unable to lock keepalive stack: %s", MyStrerror(errno));
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, stack, KEEPALIVE_STACK_SIZE);
+
+	if (priority > 0) {
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		param.sched_priority = priority;
+		pthread_attr_setschedparam(&attr, &param);
+	}
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+
+	k->threadRunning = true;
+
+	int ret = pthread_create(&k->thread, &attr, KeepaliveThread, k);
+
+	pthread_attr_destroy(&attr);
+
+	if (ret != 0) {
+		Logmsg(LOG_ERR, "unable to start keepalive thread: %s", MyStrerror(ret));
+		k->threadRunning = false;
+		munmap(k->stack, KEEPALIVE_GUARD_SIZE + KEEPALIVE_STACK_SIZE);
+		k->stack = NULL;
+		return -1;
+	}
+
+	pthread_setname_np(k->thread, "wd_keepalive");
+
+	Logmsg(LOG_INFO, "keepalive thread for %s started (priority %i, cpu %i)",
+	       k->watchdog->GetPath(), priority, cpu);
+
+	return 0;
+}
+
+void KeepaliveStopThread(struct keepalive *k)
+{
+	if (k->threadRunning == false) {
+		return;
+	}
+
+	k->threadRunning = false;
+	pthread_cancel(k->thread);
+	pthread_join(k->thread, NULL);
+	munmap(k->stack, KEEPALIVE_GUARD_SIZE + KEEPALIVE_STACK_SIZE);
+	k->stack = NULL;
+}
+
+bool KeepaliveRegister(struct keepalive *k)
+{
+	unsigned char *identity = k->watchdog->GetIdentity();
+
+	if (identity != NULL) {
+		strncpy(k->identity, (const char *)identity, sizeof(k->identity) - 1);
+	}
+
+	pthread_mutex_lock(&registryLock);
+
+	size_t index = registered;
+
+	if (index < MAX_WATCHDOG_DEVICES) {
+		registry[index] = k;
+		registered = index + 1;
+	}
+
+	pthread_mutex_unlock(&registryLock);
+
+	return index < MAX_WATCHDOG_DEVICES;
+}
+
+//Must be called before the device is closed so its status is no longer
+//read. Does nothing if k is not registered.
+void KeepaliveUnregister(struct keepalive *k)
+{
+	pthread_mutex_lock(&registryLock);
+
+	for (size_t i = 0; i < registered; i++) {
+		if (registry[i] != k) {
+			continue;
+		}
+
+		memmove(&registry[i], &registry[i + 1], (registered - i - 1) * sizeof(registry[0]));
+		registered -= 1;
+		registry[registered] = NULL;
+		break;
+	}
+
+	pthread_mutex_unlock(&registryLock);
+}
+
+//The devices are armed before the repair script helper is forked, which
+//never execs. Its copies of the descriptors are closed so the devices are
+//still released when the service closes them.
+void KeepaliveCloseInherited(void)
+{
+	for (size_t i = 0; i < registered; i++) {
+		WatchdogBackend *backend = registry[i]->watchdog->GetBackend();
+
+		if (backend != NULL && backend->GetFd() >= 0) {
+			close(backend->GetFd());
+		}
+	}
+}
+
+size_t KeepaliveCount(void)
+{
+	return registered;
+}
+
+bool KeepaliveGetDeviceStatus(size_t index, struct devicestatus *status)
+{
+	memset(status, 0, sizeof(*status));
+
+	pthread_mutex_lock(&registryLock);
+
+	if (index >= registered) {
+		pthread_mutex_unlock(&registryLock);
+		return false;
+	}
+
+	struct keepalive *k = registry[index];
+	uint64_t lastPing = k->lastPing;
+
+	strncpy(status->path, k->watchdog->GetPath(), sizeof(status->path) - 1);
+	memcpy(status->identity, k->identity, sizeof(status->identity));
+	status->timeout = k->watchdog->GetRawTimeout();
+	status->timeleft = k->watchdog->GetTimeleft();
+	status->interval = k->interval;
+	status->lastPingAge = lastPing == 0 ? 0 : KeepaliveNow() - lastPing;
+	KeepaliveGetStats(k, &status->stats);
+	status->adaptive = k->adaptive;
+	status->minInterval = k->minInterval;
+	status->maxInterval = k->maxInterval;
+	status->margin = k->margin;
+	status->latencyPeak = k->latencyPeak;
+	status->shortened = k->shortened;
+	status->lengthened = k->lengthened;
+	status->lastDecision = k->lastDecision;
+
+	pthread_mutex_unlock(&registryLock);
+
+	return true;
+}
+
+static int OpenDevice(struct cfgoptions *s, const config_setting_t *entry, Watchdog *watchdog,
+		      struct keepalive *k)
+{
+	const char *path = NULL;
+	int timeout = -1;
+	long interval = -1;
+	double seconds = 0.0;
+
+	if (config_setting_is_group(entry) == CONFIG_TRUE) {
+		config_setting_lookup_string(entry, "device", &path);
+		config_setting_lookup_int(entry, "timeout", &timeout);
+		if (ConfigSettingLookupNumber(entry, "interval", &seconds) == CONFIG_TRUE) {
+			interval = (long)(seconds * 1000.0 + 0.5);
+		}
+	} else {
+		path = config_setting_get_string(entry);
+	}
+
+	if (path == NULL) {
+		Logmsg(LOG_ERR, "watchdog-devices: entry is missing a device path");
+		return -1;
+	}
+
+	if (s->devicepath != NULL && strcmp(path, s->devicepath) == 0) {
+		Logmsg(LOG_ERR, "watchdog-devices: %s is already the primary device", path);
+		return -1;
+	}
+
+	if (watchdog->Open(path) < 0) {
+		return -1;
+	}
+
+	if (timeout > 0 && watchdog->ConfigureWatchdogTimeout(timeout) < 0) {
+		Logmsg(LOG_ERR, "unable to set timeout of %s", path);
+		watchdog->Close();
+		return -1;
+	}
+
+	if (interval <= 0) {
+		interval = watchdog->GetOptimalPingInterval();
+	}
+
+	if (watchdog->CheckWatchdogTimeout(KeepaliveWorstCaseLatency(s, interval)) && !(s->options & FORCE)) {
+		Logmsg(LOG_ERR, "%s: worst case keepalive latency %lims exceeds the device timeout %is",
+		       path, KeepaliveWorstCaseLatency(s, interval), watchdog->GetRawTimeout());
+		watchdog->Close();
+		return -1;
+	}
+
+	watchdog->SetPingInterval(interval);
+	KeepaliveInit(k, watchdog, (uint64_t)interval * 1000ULL);
+
+	if (s->options & ADAPTIVEINTERVAL) {
+		KeepaliveSetAdaptive(k, (uint64_t)s->minInterval * 1000ULL,
+				     (uint64_t)s->maxInterval * 1000ULL);
+	}
+
+	k->healthGate = s->options & HEALTHGATE;
+
+	//Every device gets its own thread so a slow ioctl on one (IPMI BMC
+	//watchdogs can take tens of milliseconds) never delays the others.
+	int priority = s->options & KEEPALIVETHREAD ? s->keepalivePriority : 0;
+
+	if (KeepaliveStartThread(k, priority, s->keepaliveCpu) < 0) {
+		watchdog->Close();
+		return -1;
+	}
+
+	KeepaliveRegister(k);
+
+	Logmsg(LOG_INFO, "watchdog device %s: timeout=%is interval=%lims", path,
+	       watchdog->GetRawTimeout(), interval);
+
+	return 0;
+}
+
+int KeepaliveOpenDevices(struct cfgoptions *s)
+{
+	if (s->watchdogDevices == NULL) {
+		return 0;
+	}
+
+	for (int cnt = 0; cnt < config_setting_length(s->watchdogDevices); cnt++) {
+		if (numberOfDevices >= ARRAY_SIZE(devices)) {
+			Logmsg(LOG_ERR, "watchdog-devices: at most %i devices are supported",
+			       MAX_WATCHDOG_DEVICES);
+			return -1;
+		}
+
+		const config_setting_t *entry = config_setting_get_elem(s->watchdogDevices, cnt);
+
+		if (OpenDevice(s, entry, &devices[numberOfDevices], &keepalives[numberOfDevices]) < 0) {
+			return -1;
+		}
+
+		numberOfDevices += 1;
+	}
+
+	return 0;
+}
+
+void KeepaliveCloseDevices(void)
+{
+	for (size_t i = 0; i < numberOfDevices; i++) {
+		KeepaliveStopThread(&keepalives[i]);
+		KeepaliveUnregister(&keepalives[i]);
+		devices[i].Close();
+	}
+
+	numberOfDevices = 0;
+}
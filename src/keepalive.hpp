@@ -0,0 +1,98 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef KEEPALIVE_H
+#define KEEPALIVE_H
+#include <pthread.h>
+#include "histogram.hpp"
+
+#define MAX_WATCHDOG_DEVICES 8
+//Scheduling latency in milliseconds allowed on top of the interval when a
+//configuration is validated.
+#define KEEPALIVE_THREAD_LATENCY 10
+#define KEEPALIVE_LOOP_LATENCY 250
+
+enum {
+	ADAPT_NONE,
+	ADAPT_HOLD,
+	ADAPT_SHORTEN,
+	ADAPT_LENGTHEN
+};
+
+//All times are CLOCK_MONOTONIC microseconds. Deadlines are absolute so that
+//callback latency and wall clock steps never accumulate as drift.
+struct keepalive {
+	Watchdog *watchdog;
+	char identity[32];
+	std::atomic_ullong interval;
+	uint64_t deadline;
+	std::atomic_ullong lastPing;
+	std::atomic_ullong missed;
+	Histogram lateness;
+	//Adaptive interval state, see KeepaliveSetAdaptive().
+	bool adaptive;
+	uint64_t timeout;
+	uint64_t minInterval;
+	uint64_t maxInterval;
+	uint64_t latencyPeak;
+	unsigned int calm;
+	std::atomic_llong margin;
+	std::atomic_ullong shortened;
+	std::atomic_ullong lengthened;
+	std::atomic_int lastDecision;
+	//Skip keepalives while a critical monitor is stale, see heartbeat.hpp.
+	bool healthGate;
+	const char *stale;
+	pthread_t thread;
+	void *stack;
+	std::atomic_bool threadRunning;
+};
+
+struct devicestatus {
+	char path[64];
+	char identity[32];
+	int64_t timeout;
+	int64_t timeleft;
+	uint64_t interval;
+	uint64_t lastPingAge;
+	struct histogramstats stats;
+	bool adaptive;
+	uint64_t minInterval;
+	uint64_t maxInterval;
+	int64_t margin;
+	uint64_t latencyPeak;
+	uint64_t shortened;
+	uint64_t lengthened;
+	int lastDecision;
+};
+
+uint64_t KeepaliveNow(void);
+long KeepaliveWorstCaseLatency(const struct cfgoptions *, long);
+void KeepaliveInit(struct keepalive *, Watchdog *, uint64_t);
+int KeepaliveRun(struct keepalive *);
+void KeepaliveSetAdaptive(struct keepalive *, uint64_t, uint64_t);
+const char *KeepaliveDecisionName(int);
+void KeepaliveGetStats(struct keepalive *, struct histogramstats *);
+int KeepaliveStartThread(struct keepalive *, int, int);
+void KeepaliveStopThread(struct keepalive *);
+bool KeepaliveRegister(struct keepalive *);
+void KeepaliveUnregister(struct keepalive *);
+void KeepaliveCloseInherited(void);
+size_t KeepaliveCount(void);
+bool KeepaliveGetDeviceStatus(size_t, struct devicestatus *);
+int KeepaliveOpenDevices(struct cfgoptions *);
+void KeepaliveCloseDevices(void);
+#endif
@@ -20,7 +20,9 @@
 #include "sub.hpp"
 #include "repair.hpp"
 #include "logutils.hpp"
+#include "sysroot.hpp"
 #include <zlib.h>
+#include <sys/sysmacros.h>
 static int ConfigureKernelOutOfMemoryKiller(void)
 {
 	int fd = 0;
@@ -169,12 +171,6 @@ bool MakeDeviceFile(const char *file)
 	return true;
 }
 
-struct bestDevice {
-	char *driverName;
-	char *deviceName;
-	short score;
-};
-
 static short ScoreDriver(char *driver)
 {
 	short score = 0;
@@ -184,54 +180,77 @@ static short ScoreDriver(char *driver)
 	return score;
 }
 
+//Returns the name of the driver bound to the watchdog class device name,
+//e.g. "iTCO_wdt" for "watchdog0".
+static bool GetWatchdogDriver(const char *name, char *driver, size_t len)
+{
+	char path[128] = {'\0'};
+	char link[PATH_MAX] = {'\0'};
+
+	portable_snprintf(path, sizeof(path), "/sys/class/watchdog/%s/device/driver", name);
+
+	ssize_t ret = SysrootReadlink(path, link, sizeof(link) - 1);
+
+	if (ret <= 0) {
+		return false;
+	}
+
+	link[ret] = '\0';
+
+	const char *base = strrchr(link, '/');
+
+	strncpy(driver, base != NULL ? base + 1 : link, len - 1);
+	driver[len - 1] = '\0';
+
+	return true;
+}
+
+//Only the watchdog class is enumerated, one readlink and one stat per
+//watchdog, independent of how many other devices the system has.
 char *FindBestWatchdogDevice(void)
 {
-	DIR *devFolder = opendir("/dev");
-	struct dirent *device = NULL;
-	struct bestDevice bestDevice = { 0 };
-	if (!devFolder) {
+	DIR *dir = SysrootOpendir("/sys/class/watchdog");
+	struct dirent *ent = NULL;
+	char best[64] = {'\0'};
+	short bestScore = SHRT_MIN;
+
+	if (dir == NULL) {
 		return NULL;
 	}
-	while ((device = readdir(devFolder)) != NULL) {
-		const char *devName = strstr(device->d_name, "watchdog");
-		if (devName == NULL || *(1 + strrchr(devName, 'g')) == '\0') {
+
+	while ((ent = readdir(dir)) != NULL) {
+		char driver[64] = {'\0'};
+		char node[128] = {'\0'};
+		dev_t rdev = 0;
+
+		if (strncmp(ent->d_name, "watchdog", strlen("watchdog")) != 0) {
 			continue;
 		}
-		if (bestDevice.driverName == NULL) {
-			char *path;
-			asprintf(&path,
-				 "/sys/class/watchdog/%s/device/driver/module",
-				 device->d_name);
-			bestDevice.deviceName = strdup(device->d_name);
-			char *derefedPath = realpath(path, NULL);
-			bestDevice.driverName = strdup(basename(derefedPath));
-			free(derefedPath);
-			free(path);
-		} else {
-			struct bestDevice potentialDevice = { 0 };
-			char *path;
-			asprintf(&path,
-				 "/sys/class/watchdog/%s/device/driver/module",
-				 device->d_name);
-			char *derefedPath = realpath(path, NULL);
-			potentialDevice.driverName =
-			    strdup(basename(derefedPath));
-			potentialDevice.deviceName = strdup(device->d_name);
-			if (ScoreDriver(potentialDevice.driverName) >
-			    ScoreDriver(bestDevice.driverName)) {
-				free(bestDevice.driverName);
-				free(bestDevice.deviceName);
-				bestDevice = potentialDevice;
-			}
-			free(derefedPath);
-			free(path);
+
+		portable_snprintf(node, sizeof(node), "/dev/%s", ent->d_name);
+
+		if (SysrootGetDeviceNumber(node, &rdev) == false) {
+			continue;
+		}
+
+		short score = GetWatchdogDriver(ent->d_name, driver, sizeof(driver)) ? ScoreDriver(driver) : 0;
+
+		//Equal scores keep the lowest numbered device, as readdir order is
+		//arbitrary.
+		if (score > bestScore || (score == bestScore && strverscmp(ent->d_name, best) < 0)) {
+			bestScore = score;
+			strncpy(best, ent->d_name, sizeof(best) - 1);
 		}
 	}
-	closedir(devFolder);
 
-	free(bestDevice.driverName); //will use detected driver name in the future
+	closedir(dir);
+
+	if (best[0] == '\0') {
+		return NULL;
+	}
+
 	static char * ret;
-	asprintf(&ret, "/dev/%s",  bestDevice.deviceName);
+	asprintf(&ret, "/dev/%s", best);
 	return ret;
 }
 
@@ -241,132 +260,85 @@ bool GetDeviceMajorMinor(struct dev * m, char *name)
 		return false;
 	}
 
-	char *tmp = basename(name);
-	size_t len = 0;
-	char *buf = NULL;
-	struct dev tmpdev = { 0 };
-
-	DIR *dir = opendir("/sys/dev/char");
+	dev_t rdev = 0;
 
-	if (dir == NULL) {
+	if (SysrootGetDeviceNumber(name, &rdev) == false) {
 		return false;
 	}
 
-	for (struct dirent * node = readdir(dir); node != NULL;
-	     node = readdir(dir)) {
-		if (node->d_name[0] == '.') {
-			continue;
-		}
-		Wasnprintf(&len, &buf, "/sys/dev/char/%s/uevent", node->d_name);
+	const char *base = strrchr(name, '/');
 
-		if (buf == NULL) {
-			abort();
-		}
+	memset(m->name, 0, sizeof(m->name));
+	strncpy(m->name, base != NULL ? base + 1 : name, sizeof(m->name) - 1);
+	m->major = major(rdev);
+	m->minor = minor(rdev);
 
-		FILE *fp = fopen(buf, "r");
+	return true;
+}
 
-		if (fp == NULL) {
-			abort();
-		}
+//Returns 1 if nowayout is in effect for the driver behind name, 0 if it is
+//not and -1 if that can't be determined. The module parameter is checked
+//first so /proc/config.gz is only inflated as a last resort.
+int ConfigWatchdogNowayoutIsSet(char *name)
+{
+	struct dev ad = { 0 };
+	char path[128] = {'\0'};
+	char link[PATH_MAX] = {'\0'};
 
-		int x = 1;
-		while (getline(&buf, &len, fp) != -1) {
-			char *const name = strtok(buf, "=");
-			char *const value = strtok(NULL, "=");
+	if (GetDeviceMajorMinor(&ad, name) == true) {
+		portable_snprintf(path, sizeof(path), "/sys/dev/char/%lu:%lu/device/driver", ad.major,
+				  ad.minor);
 
-			if (Validate(name, value) == false) {
-				continue;
-			}
-			if (x == 1) {
-				tmpdev.major = strtoul(value, NULL, 0);
-				x++;
-			} else if (x == 2) {
-				tmpdev.minor = strtoul(value, NULL, 0);
-				x++;
-			} else if (x == 3) {
-				strcpy(tmpdev.name, value);
-				x = 1;
+		ssize_t ret = SysrootReadlink(path, link, sizeof(link) - 1);
+
+		if (ret > 0) {
+			link[ret] = '\0';
+			const char *driver = strrchr(link, '/');
+			portable_snprintf(path, sizeof(path), "/sys/module/%s/parameters/nowayout",
+					  driver != NULL ? driver + 1 : link);
+
+			FILE *fp = SysrootFopen(path, "re");
+
+			if (fp != NULL) {
+				int c = fgetc(fp);
+				fclose(fp);
+				return c == '1' || c == 'Y' ? 1 : 0;
 			}
 		}
+	}
 
-		if (strcmp(tmpdev.name, tmp) == 0) {
-			closedir(dir);
-			free(buf);
-			fclose(fp);
-			strcpy(m->name, tmpdev.name);
-			m->major = tmpdev.major;
-			m->minor = tmpdev.minor;
-			return true;
-		}
+	char configPath[PATH_MAX] = {'\0'};
+	gzFile config = NULL;
 
-		fclose(fp);
+	if (SysrootPath(configPath, sizeof(configPath), "/proc/config.gz") == true) {
+		config = gzopen(configPath, "r");
 	}
-	closedir(dir);
-	free(buf);
-	return false;
-}
-
-int ConfigWatchdogNowayoutIsSet(char *name)
-{
-	bool found = false;
-	char *buf = NULL;
-	gzFile config = gzopen("/proc/config.gz", "r");
 
 	if (config == NULL) {
 		return -1;
 	}
 
-	gzbuffer(config, 8192);
+	gzbuffer(config, 65536);
 
-	while (true) {
-		char buf[72] = { '\0' };
-		size_t bytesRead = gzread(config, buf, sizeof(buf) - 1);
-		if (strstr(buf, "# CONFIG_WATCHDOG_NOWAYOUT is not set") !=
-		    NULL) {
-			found = true;
+	int found = -1;
+	char line[256] = {'\0'};
+
+	while (gzgets(config, line, sizeof(line)) != NULL) {
+		if (strncmp(line, "CONFIG_WATCHDOG_NOWAYOUT=y", strlen("CONFIG_WATCHDOG_NOWAYOUT=y")) == 0) {
+			found = 1;
 			break;
 		}
 
-		if (bytesRead < sizeof(buf) - 1) {
-			if (gzeof(config)) {
-				break;
-			} else {
-				break;
-			}
+		if (strncmp(line, "# CONFIG_WATCHDOG_NOWAYOUT is not set",
+			    strlen("# CONFIG_WATCHDOG_NOWAYOUT is not set")) == 0) {
+			found = 0;
+			break;
 		}
 	}
 
 	gzclose(config);
 
-	struct dev ad = { 0 };
-
-	GetDeviceMajorMinor(&ad, name);
-	char *devicePath = NULL;
-	Wasprintf(&devicePath, "/sys/dev/char/%lu:%lu/device/driver", ad.major,
-		  ad.minor);
-	buf = (char *)calloc(1, 4096);
-	if (devicePath == NULL) {
-		abort();
-	}
-	readlink(devicePath, buf, 4096 - 1);
-	Wasprintf(&buf, "/sys/module/%s/parameters/nowayout", basename(buf));
-	free(devicePath);
-	FILE *fp = fopen(buf, "r");
-
-	if (fp != NULL) {
-		if (fgetc(fp) == '1') {
-			found = false;
-		}
-		fclose(fp);
-	}
-
-	free(buf);
-
-	if (found) {
-		return 0;
-	}
-
-	return 1;
+	return found;
 }
 
 bool IsClientAdmin(int sock)
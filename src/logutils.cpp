@@ -179,6 +179,15 @@ static void CloseOldTarget(sig_atomic_t oldTarget)
 
 }
 
+void LogFlush(void)
+{
+	if (logFile != -1) {
+		fsync(logFile);
+	}
+
+	fflush(stderr);
+}
+
 void SetAutoPeriod(bool x)
 {
 	if (x) {
@@ -26,4 +26,5 @@ bool LogUpToInt(long pri, bool);
 bool MyStrerrorInit(void);
 char * MyStrerror(int);
 void FreeLocale(void);
+void LogFlush(void);
 #endif
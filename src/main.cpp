@@ -29,22 +29,38 @@
 #include "dbusapi.hpp"
 #include "logutils.hpp"
 #include "linux.hpp"
+#include "keepalive.hpp"
+#include "pretimeout.hpp"
+#include "handover.hpp"
 #include <systemd/sd-event.h>
+#include <poll.h>
 const bool DISARM_WATCHDOG_BEFORE_REBOOT = true;
 static volatile sig_atomic_t quit = 0;
 volatile sig_atomic_t stop = 0;
 volatile sig_atomic_t stopPing = 0;
 ProcessList processes;
+//Connects the service process to the supervisor for descriptor handover.
+static int handoverSocket = -1;
 
 static void PrintConfiguration(struct cfgoptions *const cfg)
 {
 	Logmsg(LOG_INFO,
-	       "int=%lis realtime=%s sync=%s softboot=%s force=%s mla=%.2f mem=%li pid=%i",
+	       "int=%lims realtime=%s sync=%s softboot=%s force=%s mla=%.2f mem=%li pid=%i",
 	       cfg->sleeptime, cfg->options & REALTIME ? "yes" : "no",
 	       cfg->options & SYNC ? "yes" : "no",
 	       cfg->options & SOFTBOOT ? "yes" : "no",
 	       cfg->options & FORCE ? "yes" : "no", cfg->maxLoadOne, cfg->minfreepages, getppid());
 
+	if (cfg->options & KEEPALIVETHREAD) {
+		Logmsg(LOG_INFO, "keepalive-thread=yes priority=%i cpu=%i",
+		       cfg->keepalivePriority, cfg->keepaliveCpu);
+	}
+
+	if (cfg->options & ADAPTIVEINTERVAL) {
+		Logmsg(LOG_INFO, "adaptive-interval=yes min=%lims max=%lims",
+		       cfg->minInterval, cfg->maxInterval);
+	}
+
 	if (cfg->options & ENABLEPING) {
 		for (int cnt = 0; cnt < config_setting_length(cfg->ipAddresses); cnt++) {
 			const char *ipAddress = config_setting_get_string_elem(cfg->ipAddresses,
@@ -100,6 +116,9 @@ static int SignalHandler(sd_event_source * s, const signalfd_siginfo * si, void
 		sd_event_exit((sd_event *) cxt, 0);
 		break;
 	case SIGHUP:
+		//The supervisor keeps the devices alive until the next instance
+		//takes them over.
+		HandoverSend(handoverSocket);
 		kill(getppid(), SIGHUP);
 		break;
 	}
@@ -120,27 +139,163 @@ static void InstallSignalHandlers(sd_event * event)
 
 static int Pinger(sd_event_source * s, uint64_t usec, void *cxt)
 {
-	Watchdog *watchdog = (Watchdog *) cxt;
-	watchdog->Ping();
+	struct keepalive *k = (struct keepalive *)cxt;
 
-	sd_event_now(sd_event_source_get_event(s), CLOCK_REALTIME, &usec);
-	usec += watchdog->GetPingInterval() * 1000000;
-	sd_event_add_time(sd_event_source_get_event(s), &s, CLOCK_REALTIME, usec, 1, Pinger, (void *)cxt);
+	KeepaliveRun(k);
+
+	sd_event_source_set_time(s, k->deadline);
+	sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
 	return 0;
 }
 
-static bool InstallPinger(sd_event * e, int time, Watchdog * w)
+static bool InstallPinger(sd_event * e, struct keepalive * k)
 {
 	sd_event_source *s = NULL;
-	uint64_t usec = 0;
-	w->SetPingInterval(time);
 
-	sd_event_now(e, CLOCK_REALTIME, &usec);
+	if (sd_event_add_time(e, &s, CLOCK_MONOTONIC, k->deadline, 1, Pinger, (void *)k) < 0) {
+		return false;
+	}
 
-	sd_event_add_time(e, &s, CLOCK_REALTIME, usec, 1, Pinger, (void *)w);
 	return true;
 }
 
+//Milliseconds spent in each startup phase, logged once READY=1 has been sent.
+static struct {
+	uint64_t start;
+	uint64_t last;
+	size_t len;
+	char buf[256];
+} startupTrace;
+
+static void StartupPhase(const char *name)
+{
+	uint64_t now = KeepaliveNow();
+
+	if (startupTrace.start == 0) {
+		startupTrace.start = startupTrace.last = now;
+	}
+
+	if (name == NULL) {
+		return;
+	}
+
+	int ret = snprintf(startupTrace.buf + startupTrace.len, sizeof(startupTrace.buf) - startupTrace.len,
+			   "%s%s=%" PRIu64 "ms", startupTrace.len == 0 ? "" : " ", name,
+			   (now - startupTrace.last) / 1000);
+
+	if (ret > 0 && (size_t)ret < sizeof(startupTrace.buf) - startupTrace.len) {
+		startupTrace.len += ret;
+	}
+
+	startupTrace.last = now;
+}
+
+static void PrintStartupTrace(void)
+{
+	Logmsg(LOG_INFO, "startup: %s total=%" PRIu64 "ms", startupTrace.buf,
+	       (startupTrace.last - startupTrace.start) / 1000);
+}
+
+//Opens, configures and pings the watchdog devices before anything else is
+//initialized. The keepalive thread is started right away so slow monitor
+//setup (repair script directories, name resolution) can no longer delay the
+//first keepalive. Returns an exit status if the service can not continue.
+static int ArmWatchdog(cfgoptions *options, Watchdog *watchdog, struct keepalive *keepalive)
+{
+	int ret = 0;
+
+	errno = 0;
+
+	ret = watchdog->Open(options->devicepath);
+
+	if (errno == EBUSY && ret < 0) {
+		Logmsg(LOG_ERR, "Unable to open watchdog device");
+		return EXIT_FAILURE;
+	} else if (ret <= -1) {
+		Logmsg(LOG_INFO, "Trying to load software watchdog timer...");
+		ret = watchdog->Open("softdog");
+		if (ret == 0) {
+			options->devicepath = watchdog->GetPath();
+			Logmsg(LOG_INFO, "Successfully loaded watchdog device");
+		}
+	}
+
+	if (ret <= -1) {
+		FatalError(options);
+	}
+
+	if (watchdog->ConfigureWatchdogTimeout(options->watchdogTimeout)
+	    < 0 && options->watchdogTimeout != -1) {
+		Logmsg(LOG_ERR, "unable to set watchdog device timeout\n");
+		Logmsg(LOG_ERR, "program exiting\n");
+		EndDaemon(options, false);
+		watchdog->Close();
+		return EXIT_FAILURE;
+	}
+
+	if (options->watchdogPretimeout != -1 && watchdog->ConfigurePretimeout(options->watchdogPretimeout) < 0) {
+		Logmsg(LOG_WARNING, "unable to set watchdog device pretimeout");
+	}
+
+	if (options->pretimeoutGovernor != NULL && watchdog->SetPretimeoutGovernor(options->pretimeoutGovernor) == false) {
+		Logmsg(LOG_WARNING, "unable to set pretimeout governor to %s", options->pretimeoutGovernor);
+	}
+
+	if (options->sleeptime == -1) {
+		options->sleeptime = watchdog->GetOptimalPingInterval();
+		Logmsg(LOG_INFO, "ping interval autodetect: %lims", options->sleeptime);
+	}
+
+	if (watchdog->CheckWatchdogTimeout(KeepaliveWorstCaseLatency(options, options->sleeptime)) == true) {
+		Logmsg(LOG_ERR, "WDT timeout is less than or equal the worst case keepalive latency of %lims",
+		       KeepaliveWorstCaseLatency(options, options->sleeptime));
+		Logmsg(LOG_ERR, "Using this interval may result in spurious reboots");
+
+		if (!(options->options & FORCE)) {
+			watchdog->Close();
+			Logmsg(LOG_WARNING, "use the -f option to force this configuration");
+			return EXIT_FAILURE;
+		}
+	}
+
+	watchdog->SetPingInterval(options->sleeptime);
+	KeepaliveInit(keepalive, watchdog, (uint64_t)options->sleeptime * 1000ULL);
+
+	if (options->options & ADAPTIVEINTERVAL) {
+		KeepaliveSetAdaptive(keepalive, (uint64_t)options->minInterval * 1000ULL,
+				     (uint64_t)options->maxInterval * 1000ULL);
+	}
+
+	keepalive->healthGate = options->options & HEALTHGATE;
+
+	//Without keepalive-thread the event loop takes over once it runs, until
+	//then an unprioritized thread keeps the device alive.
+	if (options->options & KEEPALIVETHREAD) {
+		ret = KeepaliveStartThread(keepalive, options->keepalivePriority, options->keepaliveCpu);
+	} else {
+		ret = KeepaliveStartThread(keepalive, 0, -1);
+	}
+
+	if (ret < 0) {
+		Logmsg(LOG_WARNING, "falling back to keepalives from the event loop");
+		options->options &= ~KEEPALIVETHREAD;
+	}
+
+	KeepaliveRegister(keepalive);
+
+	if (KeepaliveOpenDevices(options) < 0) {
+		Logmsg(LOG_ERR, "unable to open all watchdog devices");
+		KeepaliveCloseDevices();
+		KeepaliveStopThread(keepalive);
+		KeepaliveUnregister(keepalive);
+		EndDaemon(options, false);
+		watchdog->Close();
+		return EXIT_FAILURE;
+	}
+
+	return 0;
+}
+
 static int ServiceMain(int argc, char **argv, int fd, bool restarted)
 {
 	cfgoptions options;
@@ -148,11 +303,16 @@ static int ServiceMain(int argc, char **argv, int fd, bool restarted)
 	cfgoptions *tmp = &options;
 	Watchdog *tmp2 = &watchdog;
 	Pidfile pidfile;
+	static struct keepalive keepalive;
+	keepalive.watchdog = &watchdog;
 
 	struct dbusinfo temp = {.config = &tmp,.wdt = &tmp2};
+	temp.keepalive = &keepalive;
 	temp.fd = fd;
 	temp.miniMode = false;
 
+	StartupPhase(NULL);
+
 	if (MyStrerrorInit() == false) {
 		std::perror("Unable to create a new locale object");
 		return EXIT_FAILURE;
@@ -190,10 +350,28 @@ static int ServiceMain(int argc, char **argv, int fd, bool restarted)
 		return ret;
 	}
 
+	StartupPhase("config");
+
+	if (!(options.options & NOACTION)) {
+		ret = ArmWatchdog(&options, &watchdog, &keepalive);
+
+		if (ret != 0) {
+			return ret;
+		}
+
+		StartupPhase("arm");
+	}
+
 	if (PingInit(&options) < 0) {
+		KeepaliveCloseDevices();
+		KeepaliveStopThread(&keepalive);
+		KeepaliveUnregister(&keepalive);
+		watchdog.Close();
 		return EXIT_FAILURE;
 	}
 
+	StartupPhase("ping-init");
+
 	if (restarted) {
 		Logmsg(LOG_INFO,"restarting service (%s)", PACKAGE_VERSION);
 	} else {
@@ -207,6 +385,8 @@ static int ServiceMain(int argc, char **argv, int fd, bool restarted)
 		FatalError(&options);
 	}
 
+	StartupPhase("repair-scripts");
+
 	sd_event *event = NULL;
 	sd_event_default(&event);
 
@@ -217,56 +397,13 @@ static int ServiceMain(int argc, char **argv, int fd, bool restarted)
 		FatalError(&options);
 	}
 
+	StartupPhase("helpers");
+
 	pthread_t dbusThread = {0};
 
 	if (!(options.options & NOACTION)) {
-		errno = 0;
-
-		ret = watchdog.Open(options.devicepath);
-
-		if (errno == EBUSY && ret < 0) {
-			Logmsg(LOG_ERR, "Unable to open watchdog device");
-			return EXIT_FAILURE;
-		} else if (ret <= -1) {
-			LoadKernelModule();
-			Logmsg(LOG_INFO, "Trying to load software watchdog timer...");
-			ret = watchdog.Open(options.devicepath);
-			if (ret == 0) {
-				Logmsg(LOG_INFO, "Successfully loaded watchdog device");
-			}
-		}
-
-		if (ret <= -1) {
-			FatalError(&options);
-		}
-
-		if (watchdog.ConfigureWatchdogTimeout(options.watchdogTimeout)
-		    < 0 && options.watchdogTimeout != -1) {
-			Logmsg(LOG_ERR, "unable to set watchdog device timeout\n");
-			Logmsg(LOG_ERR, "program exiting\n");
-			EndDaemon(&options, false);
-			watchdog.Close();
-			return EXIT_FAILURE;
-		}
-
 		watchdog.PrintWdtInfo();
 
-		if (options.sleeptime == -1) {
-			options.sleeptime = watchdog.GetOptimalPingInterval();
-			Logmsg(LOG_INFO, "ping interval autodetect: %li", options.sleeptime);
-		}
-
-		if (options.watchdogTimeout != -1 && watchdog.CheckWatchdogTimeout(options.sleeptime) == true) {
-			Logmsg(LOG_ERR, "WDT timeout is less than or equal watchdog daemon ping interval");
-			Logmsg(LOG_ERR, "Using this interval may result in spurious reboots");
-
-			if (!(options.options & FORCE)) {
-				watchdog.Close();
-				Logmsg(LOG_WARNING, "use the -f option to force this configuration");
-				return EXIT_FAILURE;
-			}
-		}
-
 		WriteBootStatus(watchdog.GetStatus(), "/run/watchdogd.status", options.sleeptime,
 				watchdog.GetRawTimeout());
 
@@ -279,12 +416,21 @@ static int ServiceMain(int argc, char **argv, int fd, bool restarted)
 		i.flags = watchdog.GetStatus();
 		i.firmwareVersion = watchdog.GetFirmwareVersion();
 
-		CreateDetachedThread(IdentityThread, &i);
+		StartIdentityThread(&i);
 		pthread_attr_t attr = {0};
 		pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN*2);
 		pthread_attr_setguardsize(&attr, 0);
+		if (options.options & KEEPALIVETHREAD) {
+			struct sched_param param = {0};
+			pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+			pthread_attr_setschedpolicy(&attr, SCHED_IDLE);
+			pthread_attr_setschedparam(&attr, &param);
+		}
 		pthread_create(&dbusThread, &attr, DbusHelper, &temp);
-		InstallPinger(event, options.sleeptime, &watchdog);
+
+		if (PretimeoutInit(&options, &keepalive) < 0) {
+			Logmsg(LOG_ERR, "unable to start pretimeout monitor");
+		}
 
 		write(fd, "", sizeof(char));
 	} else {
@@ -296,16 +442,38 @@ static int ServiceMain(int argc, char **argv, int fd, bool restarted)
 		write(fd, "", sizeof(char));
 	}
 
+	HandoverCloseUnused();
+	HandoverReady(handoverSocket);
+
 	if (SetupAuxManagerThread(&options) < 0) {
 		FatalError(&options);
 	}
 
+	StartupPhase("monitors");
+
 	if (PlatformInit() != true) {
 		FatalError(&options);
 	}
 
+	StartupPhase("ready");
+	PrintStartupTrace();
+
+	//The event loop sends the keepalives from here on. The timer starts at
+	//the deadline the early thread left behind, it is only read once that
+	//thread was joined.
+	if (!(options.options & KEEPALIVETHREAD)) {
+		KeepaliveStopThread(&keepalive);
+
+		if (!(options.options & NOACTION) && InstallPinger(event, &keepalive) == false) {
+			Logmsg(LOG_ERR, "unable to install keepalive timer");
+			FatalError(&options);
+		}
+	}
+
 	sd_event_loop(event);
 
+	KeepaliveStopThread(&keepalive);
+
 	if (IsDaemon(&options) == true) {
 		pidfile.Delete();
 	}
@@ -314,6 +482,8 @@ static int ServiceMain(int argc, char **argv, int fd, bool restarted)
 		while (true) {
 			if (stopPing == 1) {
 				if (DISARM_WATCHDOG_BEFORE_REBOOT) {
+					KeepaliveCloseDevices();
+					KeepaliveUnregister(&keepalive);
 					watchdog.Close();
 				}
 			} else {
@@ -327,6 +497,14 @@ static int ServiceMain(int argc, char **argv, int fd, bool restarted)
 	pthread_cancel(dbusThread);
 	pthread_join(dbusThread, NULL);
 
+	if (keepalive.lateness.Count() != 0) {
+		Logmsg(LOG_INFO, "keepalive: %" PRIu64 " pings, lateness p99 %" PRIu64 "us max %" PRIu64 "us, %" PRIu64 " missed",
+		       (uint64_t)keepalive.lateness.Count(), keepalive.lateness.Percentile(0.99),
+		       keepalive.lateness.Max(), (uint64_t)keepalive.missed);
+	}
+
+	KeepaliveCloseDevices();
+	KeepaliveUnregister(&keepalive);
 	watchdog.Close();
 
 	unlink("/run/watchdogd.status");
@@ -344,8 +522,34 @@ static void ClosePipe(int *fd)
 	close(fd[1]);
 }
 
+//While the supervisor holds devices handed over by a service process it
+//pings them until the next service process reports that it took over.
+static void WaitForSignal(int sfd, int sock, struct signalfd_siginfo *si)
+{
+	struct pollfd fds[2] = {{sfd, POLLIN, 0}, {sock, POLLIN, 0}};
+
+	while (HandoverCount() != 0) {
+		HandoverPing();
+
+		if (poll(fds, ARRAY_SIZE(fds), HandoverPingInterval()) <= 0) {
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN && HandoverReceive(sock) == HANDOVER_READY) {
+			HandoverRelease();
+		}
+
+		if (fds[0].revents & POLLIN) {
+			break;
+		}
+	}
+
+	read(sfd, si, sizeof(*si));
+}
+
 int main(int argc, char **argv)
 {
+	HandoverInit();
 	opterr = 0;
 	ParseCommandLine(&argc, argv, NULL, true);
 	opterr = 1;
@@ -369,6 +573,7 @@ int main(int argc, char **argv)
 			close(sock[1]);
 			ClosePipe(com);
 			ClosePipe(com1);
+			HandoverRelease();
 			CreateDetachedThread(DbusApiInit, &sock);
 			close(0);close(1);close(2);
 			waitpid(pid, NULL, 0);
@@ -385,6 +590,7 @@ int main(int argc, char **argv)
 		sigaddset(&mask, SIGUSR1);
 
 		pthread_sigmask(SIG_BLOCK, &mask, NULL);
+		HandoverRelease();
 		pid_t x = getpid();
 		close(com1[0]);
 		write(com1[1], &x, sizeof(pid_t));
@@ -436,6 +642,8 @@ daemon:
 	sigaddset(&mask, SIGUSR1);
 	sigprocmask(SIG_BLOCK, &mask, NULL);
 	int sfd = signalfd (-1, &mask, SFD_CLOEXEC);
+	int handover[2] = {-1, -1};
+	socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, handover);
 	pid = getpid();
 	write(com[1], &pid, sizeof(pid));
 	close(com[1]);
@@ -455,6 +663,8 @@ init:
 		close(fildes[1]);
 		read(fildes[0], fildes+1, sizeof(int));
 		close(fildes[0]);
+		close(handover[0]);
+		handoverSocket = handover[1];
 		_Exit(ServiceMain(argc, argv, sock[1], restarted));
 	}
 
@@ -484,7 +694,7 @@ init:
 
 	while (true) {
 		struct signalfd_siginfo si = {0};
-		read (sfd, &si, sizeof(si));
+		WaitForSignal(sfd, handover[0], &si);
 		switch (si.ssi_signo) {
 		case SIGUSR1:
 			if (getppid() != 1) {
@@ -493,6 +703,7 @@ init:
 			si.ssi_signo = 0;
 			break;
 		case SIGHUP:
+			HandoverReceive(handover[0]);
 			sd_bus_open_system(&bus);
 
 			sd_bus_call_method(bus, "org.freedesktop.systemd1",
@@ -501,7 +712,7 @@ init:
 					NULL, "ss", name, "ignore-dependencies");
 			sd_bus_flush_close_unref(bus);
 			restarted = true;
-			read(sfd, &si, sizeof(si));
+			WaitForSignal(sfd, handover[0], &si);
 			if (si.ssi_signo != SIGCHLD) {
 				kill(shell, si.ssi_signo);
 			}
@@ -518,6 +729,8 @@ init:
 					"org.freedesktop.systemd1.Manager", "StopUnit", &error,
 					NULL, "ss", name, "ignore-dependencies");
 			sd_bus_flush_close_unref(bus);
+			//Nobody took over, disarm instead of leaving the devices armed.
+			HandoverCloseUnused();
 			kill(shell, SIGUSR1);
 			si.ssi_signo = 0;
 			_Exit(si.ssi_status);
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//The memory-allocation check. Instead of mapping and writing the whole
+//allocatable-memory every run, the amount is compared against the memory
+//the kernel reports as available plus free swap, and only a small slice is
+//actually allocated and faulted in to time how long the kernel takes to
+//hand out pages. Slow page faults and available memory falling towards the
+//limit are logged as warnings before the check fails.
+
+#include "watchdogd.hpp"
+#include "logutils.hpp"
+#include "scheduler.hpp"
+#include "sysroot.hpp"
+#include "clock.hpp"
+#include "memprobe.hpp"
+
+#define SLICE_PAGES 256
+#define SLOW_FACTOR 20
+#define SLOW_MIN_NS 20000
+#define TREND_HORIZON 60000000
+
+static long pageSize = 0;
+static pthread_once_t getPageSize = PTHREAD_ONCE_INIT;
+static uint64_t fastest = 0;
+static bool slow = false;
+static unsigned long lastAvailable = 0;
+static uint64_t lastRead = 0;
+static bool falling = false;
+
+static void GetPageSize(void)
+{
+	pageSize = sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t Elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000ULL + (uint64_t)end->tv_nsec
+	       - (uint64_t)start->tv_nsec;
+}
+
+//With memory locked by MCL_FUTURE mmap faults the pages in itself, so both
+//are timed.
+static bool Probe(unsigned long pages)
+{
+	size_t len = (size_t)pages * (size_t)pageSize;
+	struct timespec start = {0};
+	struct timespec end = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	volatile char *buf = (volatile char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (buf == MAP_FAILED) {
+		Logmsg(LOG_ALERT, "mmap failed: %s", MyStrerror(errno));
+		return false;
+	}
+
+	for (size_t i = 0; i < len; i += (size_t)pageSize) {
+		buf[i] = 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (munmap((void *)buf, len) != 0) {
+		Logmsg(LOG_CRIT, "munmap failed: %s", MyStrerror(errno));
+		assert(false);
+	}
+
+	uint64_t perPage = Elapsed(&start, &end) / pages;
+
+	if (fastest == 0 || perPage < fastest) {
+		fastest = perPage;
+	}
+
+	bool now = perPage > SLOW_MIN_NS && perPage > fastest * SLOW_FACTOR;
+
+	if (now == true && slow == false) {
+		Logmsg(LOG_WARNING, "page faults take %.1fus, %.1fus at best", (double)perPage / 1000.0,
+		       (double)fastest / 1000.0);
+	}
+
+	slow = now;
+
+	return true;
+}
+
+//Warns once while available memory falls fast enough to reach required
+//within TREND_HORIZON.
+static void Trend(unsigned long available, unsigned long required)
+{
+	uint64_t now = ClockNow();
+	bool warn = false;
+
+	if (lastRead != 0 && now > lastRead && available < lastAvailable) {
+		double rate = (double)(lastAvailable - available) / (double)(now - lastRead);
+
+		warn = (double)(available - required) < rate * TREND_HORIZON;
+
+		if (warn == true && falling == false) {
+			Logmsg(LOG_WARNING, "available memory fell to %lu KiB, at this rate below the required %lu KiB in %.0fs",
+			       available, required, (double)(available - required) / rate / 1000000.0);
+		}
+	}
+
+	falling = warn;
+	lastAvailable = available;
+	lastRead = now;
+}
+
+void MemoryProbeCheck(struct cfgoptions *s, struct check *c)
+{
+	unsigned long pages = (unsigned long)s->allocatableMemory;
+	unsigned long available = 0;
+	unsigned long swap = 0;
+	bool failed = false;
+
+	pthread_once(&getPageSize, GetPageSize);
+
+	unsigned long required = pages * (unsigned long)(pageSize / 1024);
+
+	if (Probe(pages < SLICE_PAGES ? pages : SLICE_PAGES) == false) {
+		failed = true;
+	}
+
+	if (SysrootGetAvailableMemory(&available, &swap) == false) {
+		Logmsg(LOG_ERR, "unable to read available memory");
+	} else if (available + swap < required) {
+		Logmsg(LOG_ALERT, "%lu KiB of memory available, %lu KiB required", available + swap, required);
+		failed = true;
+	} else {
+		Trend(available + swap, required);
+	}
+
+	if (failed == true) {
+		CheckFail(c, OUTOFMEMORY);
+	} else {
+		CheckPass(c, OUTOFMEMORY);
+	}
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "watchdogd.hpp"
+#include "linux.hpp"
+#include "backend.hpp"
+#include "keepalive.hpp"
+#include "logutils.hpp"
+
+static void SleepUsec(uint64_t usec)
+{
+	struct timespec ts = {0};
+
+	ts.tv_sec = usec / 1000000ULL;
+	ts.tv_nsec = (usec % 1000000ULL) * 1000ULL;
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR) ;
+}
+
+int MockBackend::Open(const char *name)
+{
+	char options[64] = {'\0'};
+	char *save = NULL;
+
+	strncpy(path, name, sizeof(path) - 1);
+
+	const char *colon = strchr(name, ':');
+
+	if (colon != NULL) {
+		strncpy(options, colon + 1, sizeof(options) - 1);
+	}
+
+	for (char *opt = strtok_r(options, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(opt, '=');
+
+		if (value == NULL) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		*value++ = '\0';
+
+		if (strcmp(opt, "timeout") == 0) {
+			timeout = (int)strtol(value, NULL, 0);
+		} else if (strcmp(opt, "pretimeout") == 0) {
+			pretimeout = (int)strtol(value, NULL, 0);
+		} else if (strcmp(opt, "bootstatus") == 0) {
+			bootstatus = strtoul(value, NULL, 0);
+		} else if (strcmp(opt, "delay") == 0) {
+			delay = strtoull(value, NULL, 0);
+		} else {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if (timeout <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&lock);
+	isOpen = true;
+	enabled = true;
+	magicClose = false;
+	lastKeepalive = KeepaliveNow();
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+//Called with the lock held. A real card would reset the machine at this
+//point; the mock counts the expiry and re-arms.
+void MockBackend::CheckExpired(uint64_t now)
+{
+	if (enabled && now - lastKeepalive > (uint64_t)timeout * 1000000ULL) {
+		expirations += 1;
+		bootstatus |= WDIOF_CARDRESET;
+		lastKeepalive = now;
+		Logmsg(LOG_ALERT, "%s: timeout expired", path);
+	}
+}
+
+int MockBackend::Ioctl(unsigned long request, void *arg)
+{
+	int ret = 0;
+
+	if (request == WDIOC_KEEPALIVE && delay != 0) {
+		SleepUsec(delay);
+	}
+
+	pthread_mutex_lock(&lock);
+
+	uint64_t now = KeepaliveNow();
+
+	if (isOpen == false) {
+		pthread_mutex_unlock(&lock);
+		errno = EBADF;
+		return -1;
+	}
+
+	CheckExpired(now);
+
+	switch (request) {
+	case WDIOC_GETSUPPORT:
+		{
+			struct watchdog_info *info = (struct watchdog_info *)arg;
+			memset(info, 0, sizeof(*info));
+			info->options = WDIOF_SETTIMEOUT | WDIOF_KEEPALIVEPING | WDIOF_MAGICCLOSE | WDIOF_PRETIMEOUT;
+			info->firmware_version = 0;
+			strncpy((char *)info->identity, "Mock Watchdog", sizeof(info->identity) - 1);
+		}
+		break;
+	case WDIOC_GETSTATUS:
+		*(int *)arg = 0;
+		break;
+	case WDIOC_GETBOOTSTATUS:
+		*(int *)arg = (int)bootstatus;
+		break;
+	case WDIOC_KEEPALIVE:
+		lastKeepalive = now;
+		keepalives[numberOfKeepalives % MOCK_KEEPALIVE_LOG] = now;
+		numberOfKeepalives += 1;
+		break;
+	case WDIOC_SETTIMEOUT:
+		if (*(int *)arg <= 0 || *(int *)arg <= pretimeout) {
+			errno = EINVAL;
+			ret = -1;
+			break;
+		}
+		timeout = *(int *)arg;
+		lastKeepalive = now;
+		break;
+	case WDIOC_GETTIMEOUT:
+		*(int *)arg = timeout;
+		break;
+	case WDIOC_SETPRETIMEOUT:
+		if (*(int *)arg < 0 || *(int *)arg >= timeout) {
+			errno = EINVAL;
+			ret = -1;
+			break;
+		}
+		pretimeout = *(int *)arg;
+		break;
+	case WDIOC_GETPRETIMEOUT:
+		*(int *)arg = pretimeout;
+		break;
+	case WDIOC_GETTIMELEFT:
+		*(int *)arg = timeout - (int)((now - lastKeepalive) / 1000000ULL);
+		break;
+	case WDIOC_SETOPTIONS:
+		if (*(int *)arg & WDIOS_DISABLECARD) {
+			enabled = false;
+		}
+		if (*(int *)arg & WDIOS_ENABLECARD) {
+			enabled = true;
+			lastKeepalive = now;
+		}
+		break;
+	default:
+		errno = ENOTTY;
+		ret = -1;
+		break;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+ssize_t MockBackend::Write(const void *buf, size_t len)
+{
+	pthread_mutex_lock(&lock);
+
+	if (isOpen == false) {
+		pthread_mutex_unlock(&lock);
+		errno = EBADF;
+		return -1;
+	}
+
+	uint64_t now = KeepaliveNow();
+
+	CheckExpired(now);
+
+	//Any write is a keepalive, a 'V' arms the magic close.
+	magicClose = memchr(buf, 'V', len) != NULL;
+	lastKeepalive = now;
+
+	pthread_mutex_unlock(&lock);
+
+	return (ssize_t)len;
+}
+
+int MockBackend::Close()
+{
+	pthread_mutex_lock(&lock);
+
+	if (magicClose) {
+		enabled = false;
+	} else if (enabled) {
+		Logmsg(LOG_CRIT, "%s: closed without magic close, the timer keeps running", path);
+	}
+
+	isOpen = false;
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+size_t MockBackend::GetKeepaliveTimestamps(uint64_t *buf, size_t len)
+{
+	pthread_mutex_lock(&lock);
+
+	uint64_t available = numberOfKeepalives < MOCK_KEEPALIVE_LOG ? numberOfKeepalives : MOCK_KEEPALIVE_LOG;
+	size_t n = len < available ? len : available;
+
+	//Oldest first.
+	for (size_t i = 0; i < n; i++) {
+		buf[i] = keepalives[(numberOfKeepalives - n + i) % MOCK_KEEPALIVE_LOG];
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return n;
+}
+
+uint64_t MockBackend::GetExpirations()
+{
+	pthread_mutex_lock(&lock);
+	uint64_t ret = expirations;
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
@@ -16,7 +16,7 @@
 
 #include "watchdogd.hpp"
 #include "linux.hpp"
-#include <linux/if_link.h>
+#include "sysroot.hpp"
 
 struct NetworkDevices {
 	struct list head;
@@ -31,63 +31,33 @@ struct NetMonNode {
 typedef struct NetMonNode NetMonNode;
 static struct NetworkDevices networkDevices;
 
-static bool NetMonIsValidNetworkInterface(const char *name)
-{
-	struct ifaddrs *ifaddr;
-
-	getifaddrs(&ifaddr);
-
-	for (struct ifaddrs *ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-		if (ifa->ifa_addr->sa_family != AF_PACKET) {
-			continue;
-		}
-
-		if (strcmp(name, ifa->ifa_name) == 0) {
-			freeifaddrs(ifaddr);
-			return true;
-		}
-	}
-
-	freeifaddrs(ifaddr);
-
-	return false;
-}
-
 bool NetMonCheckNetworkInterfaces(char **name)
 {
 	NetMonNode *c = NULL;
 	NetMonNode *next = NULL;
-	struct ifaddrs *ifaddr;
 	*name = NULL;
 
-	getifaddrs(&ifaddr);
-
 	list_for_each_entry(c, next, &networkDevices.head, node) {
-		for (struct ifaddrs *ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-			if (ifa->ifa_addr->sa_family != AF_PACKET) {
-				continue;
-			}
+		unsigned long long rx = 0;
 
-			if (strcmp(c->name, ifa->ifa_name) == 0) {
-				assert(ifa->ifa_data != NULL);
-				struct rtnl_link_stats *stats = (struct rtnl_link_stats*)ifa->ifa_data;
-				if (stats->rx_bytes == c->rx) {
-					*name = c->name;
-					freeifaddrs(ifaddr);
-					return false;
-				}
-				c->rx = stats->rx_bytes;
-				break;
-			}
+		if (SysrootGetReceivedBytes(c->name, &rx) == false) {
+			continue;
 		}
+
+		if (rx == c->rx) {
+			*name = c->name;
+			return false;
+		}
+
+		c->rx = rx;
 	}
-	freeifaddrs(ifaddr);
+
 	return true;
 }
 
 bool NetMonAdd(const char *name)
 {
-	if (NetMonIsValidNetworkInterface(name) == false) {
+	if (SysrootInterfaceExists(name) == false) {
 		return false;
 	}
 
@@ -0,0 +1,518 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//Pid files are resolved once into pidfds that the scheduler polls, so the
+//exit of a monitored process is reported the moment it happens and a reused
+//pid can not be mistaken for the original process. A pid file is only read
+//again when inotify reports it was replaced or removed. Everything here runs
+//on the scheduler thread.
+
+#include "watchdogd.hpp"
+#include "logutils.hpp"
+#include "scheduler.hpp"
+#include "clock.hpp"
+#include "pidmonitor.hpp"
+#include <libgen.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define PIDFILE_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF)
+
+enum pidstate {
+	PIDFILE_RESOLVED,
+	PIDFILE_MISSING,
+	PIDFILE_FAILED,
+};
+
+struct pidentry {
+	char *path;
+	const char *name;
+	int wd;
+	int pidfd;
+	pid_t pid;
+	enum pidstate state;
+	uint64_t missingSince;
+	struct source *source;
+	struct pidentry *next;
+};
+
+static struct check *pidCheck = NULL;
+static struct pidentry *entries = NULL;
+static size_t numberOfEntries = 0;
+static struct pidentry **buckets = NULL;
+static size_t numberOfBuckets = 0;
+static size_t unresolved = 0;
+static int inotifyFd = -1;
+static int deadlineFd = -1;
+static double retryLimit = 0.0;
+
+static size_t Hash(int wd, const char *name)
+{
+	size_t hash = 2166136261u ^ (size_t)wd;
+
+	for (const char *p = name; *p != '\0'; p++) {
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+	}
+
+	return hash & (numberOfBuckets - 1);
+}
+
+static void Watch(struct pidentry *e)
+{
+	char *copy = strdup(e->path);
+
+	if (copy == NULL) {
+		return;
+	}
+
+	e->wd = inotify_add_watch(inotifyFd, dirname(copy), PIDFILE_EVENTS | IN_ONLYDIR);
+	free(copy);
+
+	if (e->wd >= 0) {
+		size_t i = Hash(e->wd, e->name);
+		e->next = buckets[i];
+		buckets[i] = e;
+	}
+}
+
+//The watch is gone with its directory, and the kernel may hand out its
+//descriptor again.
+static void Unwatch(struct pidentry *e)
+{
+	for (struct pidentry **p = &buckets[Hash(e->wd, e->name)]; *p != NULL; p = &(*p)->next) {
+		if (*p == e) {
+			*p = e->next;
+			break;
+		}
+	}
+
+	e->next = NULL;
+	e->wd = -1;
+}
+
+static uint64_t RetryDeadline(struct pidentry *e)
+{
+	return e->missingSince + (uint64_t)(retryLimit * 1000000.0);
+}
+
+//Fires when the first missing pid file runs out of retry-timeout.
+static void ArmDeadline(void)
+{
+	struct itimerspec its = {0};
+	uint64_t next = UINT64_MAX;
+
+	if (deadlineFd < 0) {
+		return;
+	}
+
+	for (size_t i = 0; unresolved != 0 && i < numberOfEntries; i++) {
+		if (entries[i].state == PIDFILE_MISSING && RetryDeadline(&entries[i]) < next) {
+			next = RetryDeadline(&entries[i]);
+		}
+	}
+
+	if (next != UINT64_MAX) {
+		next += 1;
+		its.it_value.tv_sec = next / 1000000ULL;
+		its.it_value.tv_nsec = (next % 1000000ULL) * 1000ULL;
+	}
+
+	timerfd_settime(deadlineFd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void SetState(struct pidentry *e, enum pidstate state)
+{
+	if (e->state == PIDFILE_RESOLVED && state != PIDFILE_RESOLVED) {
+		unresolved += 1;
+	} else if (e->state != PIDFILE_RESOLVED && state == PIDFILE_RESOLVED) {
+		unresolved -= 1;
+	}
+
+	bool rearm = (e->state == PIDFILE_MISSING) != (state == PIDFILE_MISSING);
+
+	if (state != PIDFILE_MISSING) {
+		e->missingSince = 0;
+	} else if (e->state != PIDFILE_MISSING) {
+		e->missingSince = ClockNow();
+	}
+
+	e->state = state;
+
+	if (rearm == true) {
+		ArmDeadline();
+	}
+
+	if (pidCheck != NULL && unresolved == 0) {
+		CheckPass(pidCheck, PIDFILERROR | UNKNOWNPIDFILERROR);
+	}
+}
+
+static void Fail(struct pidentry *e, unsigned int error)
+{
+	SetState(e, PIDFILE_FAILED);
+
+	if (pidCheck != NULL) {
+		CheckFail(pidCheck, error);
+	}
+}
+
+static void Forget(struct pidentry *e)
+{
+	if (e->pidfd < 0) {
+		return;
+	}
+
+	SchedulerRemoveSource(e->source);
+	close(e->pidfd);
+	e->source = NULL;
+	e->pidfd = -1;
+	e->pid = 0;
+}
+
+//A service that is restarted exits before it writes the pid file again, so
+//an exit is handled like a missing pid file and given retry-timeout for the
+//pid file to be replaced.
+static void Exited(int fd, uint32_t events, void *arg)
+{
+	struct pidentry *e = (struct pidentry *)arg;
+
+	Logmsg(LOG_WARNING, "process %i of pid file %s exited, waiting %.0fs for it to be replaced", e->pid,
+	       e->path, retryLimit);
+	Forget(e);
+	SetState(e, PIDFILE_MISSING);
+}
+
+static void Resolve(struct pidentry *e)
+{
+	char buf[64] = {0};
+	struct stat st = {0};
+
+	Forget(e);
+
+	int fd = open(e->path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		SetState(e, PIDFILE_MISSING);
+		return;
+	}
+
+	if (fstat(fd, &st) != 0 || S_ISREG(st.st_mode) == false) {
+		Logmsg(LOG_ERR, "invalid file type %s", e->path);
+		close(fd);
+		Fail(e, PIDFILERROR);
+		return;
+	}
+
+	ssize_t ret = pread(fd, buf, sizeof(buf) - 1, 0);
+	close(fd);
+
+	pid_t pid = ret > 0 ? (pid_t)strtol(buf, NULL, 10) : 0;
+
+	if (pid <= 0) {
+		Logmsg(LOG_ERR, "unable to read a pid from %s", e->path);
+		Fail(e, UNKNOWNPIDFILERROR);
+		return;
+	}
+
+	int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+
+	if (pidfd < 0) {
+		Logmsg(LOG_ERR, "process %i of pid file %s is not running: %s", pid, e->path, MyStrerror(errno));
+		Fail(e, PIDFILERROR);
+		return;
+	}
+
+	e->source = SchedulerAddSource(pidfd, EPOLLIN, Exited, e);
+
+	if (e->source == NULL) {
+		Logmsg(LOG_ERR, "unable to monitor process %i of pid file %s", pid, e->path);
+		close(pidfd);
+		Fail(e, PIDFILERROR);
+		return;
+	}
+
+	e->pidfd = pidfd;
+	e->pid = pid;
+	SetState(e, PIDFILE_RESOLVED);
+}
+
+static void PidFileChanged(int fd, uint32_t events, void *arg)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len = 0;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (char *ptr = buf; ptr < buf + len;) {
+			struct inotify_event *event = (struct inotify_event *)ptr;
+
+			ptr += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				for (size_t i = 0; i < numberOfEntries; i++) {
+					Resolve(&entries[i]);
+				}
+				continue;
+			}
+
+			if (event->mask & (IN_IGNORED | IN_DELETE_SELF)) {
+				for (size_t i = 0; i < numberOfEntries; i++) {
+					if (entries[i].wd == event->wd) {
+						Unwatch(&entries[i]);
+					}
+				}
+				continue;
+			}
+
+			if (event->len == 0) {
+				continue;
+			}
+
+			for (struct pidentry *e = buckets[Hash(event->wd, event->name)]; e != NULL; e = e->next) {
+				if (e->wd == event->wd && strcmp(e->name, event->name) == 0) {
+					Resolve(e);
+				}
+			}
+		}
+	}
+}
+
+//Returns false if pidfds or inotify are not available, the pid files are
+//then polled instead.
+bool PidMonitorInit(struct cfgoptions *s)
+{
+	int fd = (int)syscall(SYS_pidfd_open, getpid(), 0);
+
+	if (fd < 0) {
+		Logmsg(LOG_INFO, "pidfd_open unavailable, polling pid files: %s", MyStrerror(errno));
+		return false;
+	}
+
+	close(fd);
+
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (inotifyFd < 0) {
+		Logmsg(LOG_INFO, "inotify unavailable, polling pid files: %s", MyStrerror(errno));
+		return false;
+	}
+
+	size_t count = (size_t)config_setting_length(s->pidFiles);
+
+	retryLimit = s->retryLimit > 0.0 ? s->retryLimit : 0.0;
+
+	numberOfBuckets = 16;
+
+	while (numberOfBuckets < count * 2) {
+		numberOfBuckets *= 2;
+	}
+
+	entries = (struct pidentry *)calloc(count, sizeof(*entries));
+	buckets = (struct pidentry **)calloc(numberOfBuckets, sizeof(*buckets));
+
+	if (entries == NULL || buckets == NULL) {
+		goto error;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const char *path = config_setting_get_string_elem(s->pidFiles, (int)i);
+
+		if (path == NULL || (entries[i].path = strdup(path)) == NULL) {
+			goto error;
+		}
+
+		const char *slash = strrchr(entries[i].path, '/');
+
+		entries[i].name = slash != NULL ? slash + 1 : entries[i].path;
+		entries[i].pidfd = -1;
+		entries[i].state = PIDFILE_RESOLVED;
+		numberOfEntries += 1;
+
+		Watch(&entries[i]);
+	}
+
+	return true;
+error:
+	for (size_t i = 0; i < numberOfEntries; i++) {
+		free(entries[i].path);
+	}
+
+	free(entries);
+	free(buckets);
+	close(inotifyFd);
+	entries = NULL;
+	buckets = NULL;
+	numberOfEntries = 0;
+	inotifyFd = -1;
+
+	return false;
+}
+
+//Missing pid files are retried once more and reported if they have been
+//missing for longer than retry-timeout.
+static void ExpireMissing(uint64_t now)
+{
+	for (size_t i = 0; unresolved != 0 && i < numberOfEntries; i++) {
+		struct pidentry *e = &entries[i];
+
+		if (e->state != PIDFILE_MISSING || RetryDeadline(e) >= now) {
+			continue;
+		}
+
+		Resolve(e);
+
+		if (e->state == PIDFILE_MISSING) {
+			Logmsg(LOG_ERR, "cannot open %s: %s", e->path, MyStrerror(ENOENT));
+			Fail(e, PIDFILERROR);
+		}
+	}
+}
+
+static void DeadlineExpired(int fd, uint32_t events, void *arg)
+{
+	uint64_t count = 0;
+
+	read(fd, &count, sizeof(count));
+	ExpireMissing(ClockNow());
+}
+
+bool PidMonitorStart(struct check *c)
+{
+	pidCheck = c;
+
+	if (SchedulerAddSource(inotifyFd, EPOLLIN, PidFileChanged, NULL) == NULL) {
+		return false;
+	}
+
+	//Deadlines are in virtual time during a simulation, PidMonitorCheck
+	//expires them instead.
+	if (ClockIsVirtual() == false) {
+		deadlineFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	}
+
+	if (deadlineFd >= 0 && SchedulerAddSource(deadlineFd, EPOLLIN, DeadlineExpired, NULL) == NULL) {
+		close(deadlineFd);
+		deadlineFd = -1;
+	}
+
+	for (size_t i = 0; i < numberOfEntries; i++) {
+		Resolve(&entries[i]);
+	}
+
+	return true;
+}
+
+//Runs on the scheduler thread. Nothing to do while every pid file is
+//resolved. In virtual time this also stands in for the deadline timer.
+void PidMonitorCheck(struct cfgoptions *s, struct check *c)
+{
+	if (unresolved == 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < numberOfEntries; i++) {
+		struct pidentry *e = &entries[i];
+
+		//Without a watch on its directory a pid file is retried here until
+		//it is back.
+		if (e->wd < 0) {
+			Watch(e);
+			Resolve(e);
+		}
+	}
+
+	ExpireMissing(ClockNow());
+}
+
+//Opens path, waiting up to seconds for it to appear. The wait sleeps on an
+//inotify watch of the directory with a timerfd deadline and returns as soon
+//as the file is created. Falls back to retrying every millisecond if the
+//directory can't be watched, and in virtual time.
+int PidFileOpenWait(const char *path, double seconds)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd >= 0 || seconds <= 0.0) {
+		return fd;
+	}
+
+	int in = ClockIsVirtual() ? -1 : inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	int tfd = in < 0 ? -1 : timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	char *copy = strdup(path);
+	int wd = -1;
+
+	if (tfd >= 0 && copy != NULL) {
+		wd = inotify_add_watch(in, dirname(copy), IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR);
+	}
+
+	free(copy);
+
+	if (wd < 0) {
+		uint64_t startTime = ClockNow();
+
+		if (in >= 0) {
+			close(in);
+		}
+
+		if (tfd >= 0) {
+			close(tfd);
+		}
+
+		do {
+			ClockSleep(1000);
+			fd = open(path, O_RDONLY | O_CLOEXEC);
+		} while (fd < 0 && (double)(ClockNow() - startTime) / 1000000.0 <= seconds);
+
+		return fd;
+	}
+
+	struct itimerspec its = {0};
+
+	its.it_value.tv_sec = (time_t)seconds;
+	its.it_value.tv_nsec = (long)((seconds - (double)its.it_value.tv_sec) * 1000000000.0);
+	timerfd_settime(tfd, 0, &its, NULL);
+
+	//The file may have been created before the watch was in place.
+	while ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		struct pollfd fds[2] = {{in, POLLIN, 0}, {tfd, POLLIN, 0}};
+		char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+		if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			fd = open(path, O_RDONLY | O_CLOEXEC);
+			break;
+		}
+
+		while (read(in, buf, sizeof(buf)) > 0) ;
+	}
+
+	int err = errno;
+
+	close(in);
+	close(tfd);
+
+	errno = err;
+
+	return fd;
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef PIDMONITOR_H
+#define PIDMONITOR_H
+struct cfgoptions;
+struct check;
+bool PidMonitorInit(struct cfgoptions *);
+bool PidMonitorStart(struct check *);
+void PidMonitorCheck(struct cfgoptions *, struct check *);
+int PidFileOpenWait(const char *, double);
+#endif
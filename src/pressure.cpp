@@ -0,0 +1,298 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//Pressure stall information triggers. A trigger is written to a pressure
+//file and the scheduler polls the file until the kernel reports that tasks
+//stalled for longer than the threshold within the window, nothing runs in
+//between. Where triggers are not available, below a sysroot and in virtual
+//time the total stall time is read every time the owning check runs and its
+//rate compared against the threshold instead. A failure is cleared once a
+//whole window passed without the threshold being crossed. Everything here
+//runs on the scheduler thread.
+
+#include "watchdogd.hpp"
+#include "logutils.hpp"
+#include "scheduler.hpp"
+#include "configfile.hpp"
+#include "sysroot.hpp"
+#include "clock.hpp"
+#include "pressure.hpp"
+
+struct trigger {
+	char *path;
+	const char *kind;
+	uint64_t stall;
+	uint64_t window;
+	int fd;
+	struct source *source;
+	uint64_t firedAt;
+	uint64_t lastTotal;
+	uint64_t lastPoll;
+	struct check *check;
+	unsigned int error;
+	struct trigger *next;
+};
+
+static struct trigger *triggers = NULL;
+
+static void Fired(struct trigger *t)
+{
+	if (t->firedAt == 0 || ClockNow() - t->firedAt > t->window) {
+		Logmsg(LOG_ERR, "%s: %s stall time exceeded %.2fs in %.2fs", t->path, t->kind,
+		       (double)t->stall / 1000000.0, (double)t->window / 1000000.0);
+	}
+
+	t->firedAt = ClockNow();
+
+	CheckFail(t->check, t->error);
+}
+
+static void StopTrigger(struct trigger *t)
+{
+	SchedulerRemoveSource(t->source);
+	close(t->fd);
+	t->source = NULL;
+	t->fd = -1;
+}
+
+//A pressure file is always readable, a trigger reports EPOLLPRI when it
+//fires and EPOLLERR once the cgroup it belongs to is removed.
+static void TriggerEvent(int fd, uint32_t events, void *arg)
+{
+	struct trigger *t = (struct trigger *)arg;
+
+	if (events & EPOLLERR) {
+		Logmsg(LOG_ERR, "%s: pressure trigger removed", t->path);
+		StopTrigger(t);
+		return;
+	}
+
+	if (events & EPOLLPRI) {
+		Fired(t);
+	}
+}
+
+static bool ReadTotal(struct trigger *t, uint64_t *total)
+{
+	char line[256] = {'\0'};
+	bool found = false;
+	FILE *fp = fopen(t->path, "re");
+
+	if (fp == NULL) {
+		return false;
+	}
+
+	while (found == false && fgets(line, sizeof(line), fp) != NULL) {
+		const char *p = strstr(line, "total=");
+
+		if (strncmp(line, t->kind, strlen(t->kind)) != 0 || line[strlen(t->kind)] != ' ' || p == NULL) {
+			continue;
+		}
+
+		*total = strtoull(p + strlen("total="), NULL, 10);
+		found = true;
+	}
+
+	fclose(fp);
+
+	return found;
+}
+
+static bool OpenTrigger(struct trigger *t)
+{
+	char buf[128] = {'\0'};
+
+	if (SysrootIsSet() == true || ClockIsVirtual() == true) {
+		return false;
+	}
+
+	t->fd = open(t->path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+	if (t->fd < 0) {
+		return false;
+	}
+
+	int len = snprintf(buf, sizeof(buf), "%s %" PRIu64 " %" PRIu64, t->kind, t->stall, t->window);
+
+	if (write(t->fd, buf, (size_t)len + 1) < 0
+	    || (t->source = SchedulerAddSource(t->fd, EPOLLPRI, TriggerEvent, t)) == NULL) {
+		Logmsg(LOG_INFO, "%s: unable to set a pressure trigger, polling instead: %s", t->path, MyStrerror(errno));
+		close(t->fd);
+		t->fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+//Stall and window are in seconds, the window must lie between 0.5 and 10
+//seconds. Failures are reported to c as error. Returns false if the
+//pressure file can't be read, unless wait is set, then the limit is kept
+//until PressureRearm finds the file.
+bool PressureWatch(const char *path, const char *kind, double stall, double window, struct check *c,
+		   unsigned int error, bool wait)
+{
+	struct trigger *t = (struct trigger *)calloc(1, sizeof(*t));
+
+	if (t == NULL || (t->path = strdup(path)) == NULL) {
+		free(t);
+		return false;
+	}
+
+	t->kind = strcmp(kind, "full") == 0 ? "full" : "some";
+	t->stall = (uint64_t)(stall * 1000000.0 + 0.5);
+	t->window = (uint64_t)(window * 1000000.0 + 0.5);
+	t->fd = -1;
+	t->check = c;
+	t->error = error;
+
+	if (OpenTrigger(t) == false && ReadTotal(t, &t->lastTotal) == false && wait == false) {
+		Logmsg(LOG_ERR, "unable to read %s %s pressure", path, t->kind);
+		free(t->path);
+		free(t);
+		return false;
+	}
+
+	t->lastPoll = ClockNow();
+	t->next = triggers;
+	triggers = t;
+
+	return true;
+}
+
+//Sets the triggers again whose files start with prefix and are not set,
+//because the files did not exist or were removed, and takes a new baseline
+//for those that are polled. Called when the directory holding them was
+//created again.
+void PressureRearm(const char *prefix)
+{
+	for (struct trigger *t = triggers; t != NULL; t = t->next) {
+		if (t->fd >= 0 || strncmp(t->path, prefix, strlen(prefix)) != 0) {
+			continue;
+		}
+
+		if (OpenTrigger(t) == true) {
+			Logmsg(LOG_INFO, "%s: %s pressure trigger set", t->path, t->kind);
+		} else {
+			ReadTotal(t, &t->lastTotal);
+		}
+
+		t->lastPoll = ClockNow();
+	}
+}
+
+//Called by every check owning triggers when it runs.
+void PressurePoll(struct check *c)
+{
+	unsigned int all = 0;
+	unsigned int active = 0;
+
+	for (struct trigger *t = triggers; t != NULL; t = t->next) {
+		uint64_t total = 0;
+		uint64_t now = ClockNow();
+
+		if (t->check != c) {
+			continue;
+		}
+
+		if (t->fd < 0 && now > t->lastPoll && ReadTotal(t, &total) == true) {
+			if (total > t->lastTotal && (total - t->lastTotal) * t->window > t->stall * (now - t->lastPoll)) {
+				Fired(t);
+			}
+
+			t->lastTotal = total;
+			t->lastPoll = now;
+		}
+
+		all |= t->error;
+
+		if (t->firedAt != 0 && now - t->firedAt <= t->window) {
+			active |= t->error;
+		}
+	}
+
+	CheckPass(c, all & ~active);
+}
+
+//Adds the limits of a group holding one group per resource, e.g.
+//memory = { some = 0.15; full = 0.05; window = 1.0; }, the pressure file of
+//a resource is prefix followed by the resource name and suffix. name is the
+//configuration file entry for error messages, wait is passed on to
+//PressureWatch. Returns the number of limits added.
+size_t PressureWatchSetting(const config_setting_t *setting, const char *name, const char *prefix,
+			    const char *suffix, struct check *c, unsigned int error, bool wait)
+{
+	static const char *const resources[] = {"cpu", "memory", "io"};
+	static const char *const kinds[] = {"some", "full"};
+	size_t count = 0;
+
+	for (size_t i = 0; i < sizeof(resources) / sizeof(resources[0]); i++) {
+		config_setting_t *group = config_setting_get_member(setting, resources[i]);
+		char path[PATH_MAX] = {'\0'};
+		double window = 1.0;
+
+		if (group == NULL) {
+			continue;
+		}
+
+		if (ConfigSettingLookupNumber(group, "window", &window) == CONFIG_TRUE
+		    && (window < 0.5 || window > 10.0)) {
+			Logmsg(LOG_ERR, "illegal value for configuration file entry named \"%s.%s.window\","
+			       " using default value", name, resources[i]);
+			window = 1.0;
+		}
+
+		if (snprintf(path, sizeof(path), "%s%s%s", prefix, resources[i], suffix) >= (int)sizeof(path)) {
+			continue;
+		}
+
+		for (size_t j = 0; j < sizeof(kinds) / sizeof(kinds[0]); j++) {
+			double stall = 0.0;
+
+			if (ConfigSettingLookupNumber(group, kinds[j], &stall) == CONFIG_FALSE) {
+				continue;
+			}
+
+			if (stall <= 0.0 || stall > window) {
+				Logmsg(LOG_ERR, "illegal value for configuration file entry named \"%s.%s.%s\"",
+				       name, resources[i], kinds[j]);
+				continue;
+			}
+
+			if (PressureWatch(path, kinds[j], stall, window, c, error, wait) == true) {
+				count += 1;
+			}
+		}
+	}
+
+	return count;
+}
+
+bool PressureInit(struct cfgoptions *s, struct check *c)
+{
+	char prefix[PATH_MAX] = {'\0'};
+
+	if (SysrootPath(prefix, sizeof(prefix), "/proc/pressure/") == false) {
+		return false;
+	}
+
+	return PressureWatchSetting(s->pressure, "pressure", prefix, "", c, PRESSURETOOHIGH, false) > 0;
+}
+
+void PressureCheck(struct cfgoptions *s, struct check *c)
+{
+	PressurePoll(c);
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef PRESSURE_H
+#define PRESSURE_H
+#include <libconfig.h>
+struct cfgoptions;
+struct check;
+bool PressureWatch(const char *, const char *, double, double, struct check *, unsigned int, bool);
+void PressureRearm(const char *);
+void PressurePoll(struct check *);
+size_t PressureWatchSetting(const config_setting_t *, const char *, const char *, const char *, struct check *,
+			    unsigned int, bool);
+bool PressureInit(struct cfgoptions *, struct check *);
+void PressureCheck(struct cfgoptions *, struct check *);
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "watchdogd.hpp"
+#include "sub.hpp"
+#include "exe.hpp"
+#include "keepalive.hpp"
+#include "pretimeout.hpp"
+#include "logutils.hpp"
+
+struct pretimeoutwatch {
+	struct cfgoptions *config;
+	struct keepalive *keepalive;
+	uint64_t timeout;
+	uint64_t window;
+};
+
+static std::atomic_bool emergency = {false};
+
+bool InPretimeoutWindow(void)
+{
+	return emergency;
+}
+
+static void SleepUntil(uint64_t usec)
+{
+	struct timespec ts = {0};
+
+	ts.tv_sec = usec / 1000000ULL;
+	ts.tv_nsec = (usec % 1000000ULL) * 1000ULL;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) ;
+}
+
+static void CaptureDiagnostics(struct pretimeoutwatch *w, uint64_t age)
+{
+	struct histogramstats stats;
+	Watchdog *watchdog = w->keepalive->watchdog;
+
+	KeepaliveGetStats(w->keepalive, &stats);
+
+	Logmsg(LOG_EMERG, "entering watchdog pretimeout window: no keepalive for %" PRIu64 "ms, timeleft %lis",
+	       age / 1000, watchdog->GetTimeleft());
+	Logmsg(LOG_EMERG, "keepalive lateness p50 %" PRIu64 "us p99 %" PRIu64 "us max %" PRIu64 "us, %" PRIu64 " missed",
+	       stats.p50, stats.p99, stats.max, stats.missed);
+
+	LogFlush();
+
+	if (w->config->pretimeoutScript == NULL) {
+		return;
+	}
+
+	//The capture has to finish before the hard reset, so it only gets the
+	//whole seconds left of the pretimeout window, and is skipped when less
+	//than one is left.
+	uint64_t remaining = age < w->timeout ? w->timeout - age : 0;
+	int timeout = (int)(remaining / 1000000ULL);
+
+	if (timeout < 1) {
+		Logmsg(LOG_EMERG, "%" PRIu64 "ms left before the reset, not running pretimeout script %s",
+		       remaining / 1000, w->config->pretimeoutScript);
+		LogFlush();
+		return;
+	}
+
+	spawnattr_t attr = {
+		.workingDirectory = NULL, .repairFilePathname = NULL,
+		.execStart = NULL, .user = NULL, .group = NULL,
+		.timeout = timeout, .nice = 0, .umask = 0,
+		.noNewPrivileges = false, .hasUmask = false
+	};
+
+	int ret = SpawnAttr(&attr, w->config->pretimeoutScript, w->config->pretimeoutScript,
+			    "pretimeout", NULL);
+
+	Logmsg(LOG_EMERG, "pretimeout script %s returned %i", w->config->pretimeoutScript, ret);
+
+	LogFlush();
+}
+
+static void *PretimeoutThread(void *arg)
+{
+	struct pretimeoutwatch *w = (struct pretimeoutwatch *)arg;
+	struct keepalive *k = w->keepalive;
+
+	for (;;) {
+		uint64_t last = k->lastPing;
+
+		if (last == 0) {
+			last = KeepaliveNow();
+		}
+
+		if (emergency == false) {
+			SleepUntil(last + (w->timeout - w->window));
+		} else {
+			SleepUntil(KeepaliveNow() + 100000);
+		}
+
+		uint64_t current = k->lastPing;
+
+		if (current == 0 || current != last) {
+			if (emergency == true) {
+				emergency = false;
+				Logmsg(LOG_ALERT, "keepalive resumed, leaving pretimeout window");
+			}
+			continue;
+		}
+
+		if (emergency == false) {
+			emergency = true;
+			CaptureDiagnostics(w, KeepaliveNow() - current);
+		}
+	}
+
+	return NULL;
+}
+
+int PretimeoutInit(struct cfgoptions *s, struct keepalive *k)
+{
+	static struct pretimeoutwatch watch;
+
+	if (s->watchdogPretimeout <= 0) {
+		return 0;
+	}
+
+	int timeout = k->watchdog->GetRawTimeout();
+	int window = k->watchdog->GetPretimeout();
+
+	if (window <= 0) {
+		Logmsg(LOG_INFO, "no hardware pretimeout, using a %is software pretimeout window",
+		       s->watchdogPretimeout);
+		window = s->watchdogPretimeout;
+	}
+
+	if (timeout <= 0 || window >= timeout) {
+		Logmsg(LOG_ERR, "pretimeout %is must be less than the timeout %is", window, timeout);
+		return -1;
+	}
+
+	watch.config = s;
+	watch.keepalive = k;
+	watch.timeout = (uint64_t)timeout * 1000000ULL;
+	watch.window = (uint64_t)window * 1000000ULL;
+
+	//Keepalives may be up to the worst case latency apart, a window opening
+	//before that would be entered on every ping cycle.
+	uint64_t interval = k->adaptive == true ? k->maxInterval : (uint64_t)k->interval;
+	uint64_t latency = (uint64_t)KeepaliveWorstCaseLatency(s, (long)(interval / 1000ULL)) * 1000ULL;
+
+	if (latency >= watch.timeout) {
+		Logmsg(LOG_ERR, "keepalive latency of up to %" PRIu64 "ms leaves no pretimeout window in %is",
+		       latency / 1000, timeout);
+		return -1;
+	}
+
+	if (latency > watch.timeout - watch.window) {
+		watch.window = watch.timeout - latency;
+		Logmsg(LOG_WARNING, "keepalive latency of up to %" PRIu64 "ms, pretimeout window shortened from %is to %"
+		       PRIu64 "ms", latency / 1000, window, watch.window / 1000);
+	}
+
+	if (CreateDetachedThread(PretimeoutThread, &watch) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
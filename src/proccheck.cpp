@@ -0,0 +1,216 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//The processes check. Each entry of the processes list matches processes by
+//comm, executable, cmdline regular expression and cgroup and requires a
+//minimum number of them to be running. The entries are compiled once when
+//the configuration file is read and every run counts all of them in a
+//single walk of /proc, reading only the files the entries need. If every
+//entry matches on just a comm or just a cgroup and the process table is
+//kept up to date by the proc connector, /proc is not walked at all.
+
+#include "watchdogd.hpp"
+#include "logutils.hpp"
+#include "configfile.hpp"
+#include "scheduler.hpp"
+#include "procscan.hpp"
+#include "proctable.hpp"
+#include "proccheck.hpp"
+#include <regex.h>
+
+struct procrule {
+	const char *comm;
+	const char *exe;
+	const char *cgroup;
+	const char *pattern;
+	regex_t cmdline;
+	long min;
+	unsigned long count;
+};
+
+static struct procrule *rules = NULL;
+static size_t numberOfRules = 0;
+static unsigned int fields = 0;
+static bool fromTable = false;
+
+static const char *Label(struct procrule *r)
+{
+	if (r->comm != NULL) {
+		return r->comm;
+	}
+
+	if (r->exe != NULL) {
+		return r->exe;
+	}
+
+	if (r->pattern != NULL) {
+		return r->pattern;
+	}
+
+	return r->cgroup;
+}
+
+static bool ParseRule(const config_setting_t *entry, struct procrule *r)
+{
+	int min = 1;
+
+	if (config_setting_is_group(entry) == CONFIG_FALSE) {
+		fprintf(stderr, "watchdogd: %s:%i: illegal type for configuration file entry"
+			" \"processes\" expected list of groups\n",
+			LibconfigWraperConfigSettingSourceFile(entry), config_setting_source_line(entry));
+		return false;
+	}
+
+	config_setting_lookup_string(entry, "comm", &r->comm);
+	config_setting_lookup_string(entry, "exe", &r->exe);
+	config_setting_lookup_string(entry, "cgroup", &r->cgroup);
+	config_setting_lookup_string(entry, "cmdline", &r->pattern);
+
+	if (r->comm == NULL && r->exe == NULL && r->cgroup == NULL && r->pattern == NULL) {
+		fprintf(stderr, "watchdogd: %s:%i: entry of \"processes\" has none of comm, exe,"
+			" cmdline or cgroup\n",
+			LibconfigWraperConfigSettingSourceFile(entry), config_setting_source_line(entry));
+		return false;
+	}
+
+	if (r->pattern != NULL && regcomp(&r->cmdline, r->pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+		fprintf(stderr, "watchdogd: %s:%i: invalid regular expression \"%s\"\n",
+			LibconfigWraperConfigSettingSourceFile(entry), config_setting_source_line(entry),
+			r->pattern);
+		r->pattern = NULL;
+		return false;
+	}
+
+	if (config_setting_lookup_int(entry, "min", &min) == CONFIG_TRUE && min < 1) {
+		fprintf(stderr, "watchdogd: illegal value for configuration file entry named \"min\"\n");
+		fprintf(stderr, "watchdogd: using default value\n");
+		min = 1;
+	}
+
+	r->min = min;
+
+	return true;
+}
+
+bool ProcCheckInit(const config_setting_t *list)
+{
+	size_t count = (size_t)config_setting_length(list);
+
+	rules = (struct procrule *)calloc(count, sizeof(*rules));
+
+	if (rules == NULL) {
+		return false;
+	}
+
+	fromTable = true;
+
+	for (size_t i = 0; i < count; i++) {
+		struct procrule *r = &rules[i];
+
+		if (ParseRule(config_setting_get_elem(list, (unsigned int)i), r) == false) {
+			return false;
+		}
+
+		numberOfRules += 1;
+
+		fields |= r->cgroup != NULL ? PROCSCAN_CGROUP : 0;
+		fields |= r->exe != NULL ? PROCSCAN_EXE : 0;
+		fields |= r->pattern != NULL ? PROCSCAN_CMDLINE : 0;
+
+		if (r->exe != NULL || r->pattern != NULL || (r->comm != NULL && r->cgroup != NULL)) {
+			fromTable = false;
+		}
+	}
+
+	return true;
+}
+
+//Returns the scheduler flags of the check. Walking /proc may take a while
+//so it is left to the worker threads.
+unsigned int ProcCheckStart(void)
+{
+	if (fromTable == true && ProcTableInit() == true && ProcTableStart() == true
+	    && ProcTableIsLive() == true) {
+		return CHECK_MONITORED;
+	}
+
+	fromTable = false;
+
+	return CHECK_BLOCKING | CHECK_MONITORED;
+}
+
+static void Match(const struct procinfo *info, void *arg)
+{
+	if (info->state == 'Z') {
+		return;
+	}
+
+	for (size_t i = 0; i < numberOfRules; i++) {
+		struct procrule *r = &rules[i];
+
+		if (r->comm != NULL && strcmp(r->comm, info->comm) != 0) {
+			continue;
+		}
+
+		if (r->exe != NULL && (info->exe == NULL || strcmp(r->exe, info->exe) != 0)) {
+			continue;
+		}
+
+		if (r->cgroup != NULL && (info->cgroup == NULL || strcmp(r->cgroup, info->cgroup) != 0)) {
+			continue;
+		}
+
+		if (r->pattern != NULL && (info->cmdline == NULL || regexec(&r->cmdline, info->cmdline, 0, NULL, 0) != 0)) {
+			continue;
+		}
+
+		r->count += 1;
+	}
+}
+
+void ProcCheck(struct cfgoptions *s, struct check *c)
+{
+	bool failed = false;
+
+	for (size_t i = 0; i < numberOfRules; i++) {
+		rules[i].count = 0;
+	}
+
+	if (fromTable == true) {
+		for (size_t i = 0; i < numberOfRules; i++) {
+			struct procrule *r = &rules[i];
+
+			r->count = r->comm != NULL ? ProcTableCountComm(r->comm) : ProcTableCountCgroup(r->cgroup);
+		}
+	} else if (ProcScan(fields, Match, NULL) == false) {
+		return;
+	}
+
+	for (size_t i = 0; i < numberOfRules; i++) {
+		struct procrule *r = &rules[i];
+
+		if (r->count < (unsigned long)r->min) {
+			Logmsg(LOG_ERR, "%lu processes match %s, at least %ld required", r->count, Label(r), r->min);
+			failed = true;
+		}
+	}
+
+	if (failed == true) {
+		CheckFail(c, PROCESSERROR);
+	} else {
+		CheckPass(c, PROCESSERROR);
+	}
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//Walks /proc with getdents64 on a directory fd that stays open, every file
+//of a process is opened relative to it. Only the files the caller asks for
+//are read, stat always.
+
+#include "watchdogd.hpp"
+#include "logutils.hpp"
+#include "sysroot.hpp"
+#include "procscan.hpp"
+#include <sys/syscall.h>
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static int procFd = -1;
+static pthread_once_t openProc = PTHREAD_ONCE_INIT;
+static pthread_mutex_t scanLock = PTHREAD_MUTEX_INITIALIZER;
+static char dents[64 * 1024] __attribute__ ((aligned(__alignof__(struct linux_dirent64))));
+
+static void OpenProc(void)
+{
+	procFd = SysrootOpen("/proc", O_RDONLY | O_DIRECTORY);
+}
+
+static int ProcFd(void)
+{
+	pthread_once(&openProc, OpenProc);
+
+	return procFd;
+}
+
+static ssize_t ReadAt(pid_t pid, const char *file, char *buf, size_t len)
+{
+	char path[64] = {'\0'};
+
+	snprintf(path, sizeof(path), "%i/%s", pid, file);
+
+	int fd = openat(ProcFd(), path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	ssize_t ret = read(fd, buf, len - 1);
+	close(fd);
+
+	if (ret < 0) {
+		return -1;
+	}
+
+	buf[ret] = '\0';
+
+	return ret;
+}
+
+//The comm is the text between the first '(' and the last ')' as it may
+//contain either.
+bool ProcReadStat(pid_t pid, struct procinfo *info)
+{
+	char buf[512] = {'\0'};
+
+	if (ReadAt(pid, "stat", buf, sizeof(buf)) <= 0) {
+		return false;
+	}
+
+	char *start = strchr(buf, '(');
+	char *end = strrchr(buf, ')');
+
+	if (start == NULL || end == NULL || end < start || end[1] != ' ' || end[2] == '\0') {
+		return false;
+	}
+
+	size_t n = (size_t)(end - start - 1);
+
+	if (n >= sizeof(info->comm)) {
+		n = sizeof(info->comm) - 1;
+	}
+
+	memcpy(info->comm, start + 1, n);
+	info->comm[n] = '\0';
+	info->state = end[2];
+	info->pid = pid;
+
+	return true;
+}
+
+//Prefers the unified hierarchy, on a v1 only system the first hierarchy
+//listed is used.
+bool ProcReadCgroup(pid_t pid, char *cgroup, size_t len)
+{
+	char buf[PATH_MAX + 256] = {'\0'};
+	bool found = false;
+
+	if (ReadAt(pid, "cgroup", buf, sizeof(buf)) <= 0) {
+		return false;
+	}
+
+	for (char *line = buf, *next = NULL; line != NULL && *line != '\0'; line = next) {
+		next = strchr(line, '\n');
+
+		if (next != NULL) {
+			*next++ = '\0';
+		}
+
+		char *p = strchr(line, ':');
+
+		p = p != NULL ? strchr(p + 1, ':') : NULL;
+
+		if (p == NULL || (found == true && strncmp(line, "0::", 3) != 0)) {
+			continue;
+		}
+
+		strncpy(cgroup, p + 1, len - 1);
+		cgroup[len - 1] = '\0';
+		found = true;
+
+		if (strncmp(line, "0::", 3) == 0) {
+			break;
+		}
+	}
+
+	return found;
+}
+
+static bool ReadExe(pid_t pid, char *exe, size_t len)
+{
+	char path[64] = {'\0'};
+
+	snprintf(path, sizeof(path), "%i/exe", pid);
+
+	ssize_t ret = readlinkat(ProcFd(), path, exe, len - 1);
+
+	if (ret < 0) {
+		return false;
+	}
+
+	exe[ret] = '\0';
+
+	return true;
+}
+
+//The arguments are joined with spaces.
+static bool ReadCmdline(pid_t pid, char *cmdline, size_t len)
+{
+	ssize_t ret = ReadAt(pid, "cmdline", cmdline, len);
+
+	if (ret <= 0) {
+		return false;
+	}
+
+	while (ret > 0 && cmdline[ret - 1] == '\0') {
+		ret -= 1;
+	}
+
+	for (ssize_t i = 0; i < ret; i++) {
+		if (cmdline[i] == '\0') {
+			cmdline[i] = ' ';
+		}
+	}
+
+	return true;
+}
+
+//Calls found for every process that could be read, processes that exit
+//during the walk are skipped. Only one walk runs at a time.
+bool ProcScan(unsigned int fields, void (*found)(const struct procinfo *, void *), void *arg)
+{
+	char cgroup[PATH_MAX] = {'\0'};
+	char exe[PATH_MAX] = {'\0'};
+	char cmdline[4096] = {'\0'};
+	long len = 0;
+
+	if (ProcFd() < 0) {
+		Logmsg(LOG_ERR, "unable to open /proc: %s", MyStrerror(errno));
+		return false;
+	}
+
+	pthread_mutex_lock(&scanLock);
+
+	lseek(procFd, 0, SEEK_SET);
+
+	while ((len = syscall(SYS_getdents64, procFd, dents, sizeof(dents))) > 0) {
+		for (long off = 0; off < len;) {
+			struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + off);
+			struct procinfo info = {0};
+			char *end = NULL;
+
+			off += d->d_reclen;
+
+			if (d->d_name[0] < '1' || d->d_name[0] > '9') {
+				continue;
+			}
+
+			long pid = strtol(d->d_name, &end, 10);
+
+			if (*end != '\0' || ProcReadStat((pid_t)pid, &info) == false) {
+				continue;
+			}
+
+			if (fields & PROCSCAN_CGROUP && ProcReadCgroup(info.pid, cgroup, sizeof(cgroup)) == true) {
+				info.cgroup = cgroup;
+			}
+
+			if (fields & PROCSCAN_EXE && ReadExe(info.pid, exe, sizeof(exe)) == true) {
+				info.exe = exe;
+			}
+
+			if (fields & PROCSCAN_CMDLINE && ReadCmdline(info.pid, cmdline, sizeof(cmdline)) == true) {
+				info.cmdline = cmdline;
+			}
+
+			found(&info, arg);
+		}
+	}
+
+	if (len < 0) {
+		Logmsg(LOG_ERR, "unable to read /proc: %s", MyStrerror(errno));
+	}
+
+	pthread_mutex_unlock(&scanLock);
+
+	return len == 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef PROCSCAN_H
+#define PROCSCAN_H
+#include <sys/types.h>
+
+#define PROCSCAN_CGROUP 0x1
+#define PROCSCAN_EXE 0x2
+#define PROCSCAN_CMDLINE 0x4
+
+//Fields not requested, or that could not be read, are NULL.
+struct procinfo {
+	pid_t pid;
+	char state;
+	char comm[64];
+	const char *cgroup;
+	const char *exe;
+	const char *cmdline;
+};
+
+bool ProcScan(unsigned int, void (*)(const struct procinfo *, void *), void *);
+bool ProcReadStat(pid_t, struct procinfo *);
+bool ProcReadCgroup(pid_t, char *, size_t);
+#endif
@@ -0,0 +1,562 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//A table of the processes on the system keyed by pid, with the number of
+//processes per comm and per cgroup kept alongside, so process checks are
+//answered without walking /proc. It is kept up to date from the fork, exec,
+//comm and exit events of the kernel proc connector and /proc is only scanned
+//at start up and when events were lost. Where the connector is unavailable
+//the table is rebuilt from /proc whenever it is queried. A process moved to
+//another cgroup is only noticed when it next calls exec. Everything here
+//runs on the scheduler thread once ProcTableStart was called.
+
+#include "watchdogd.hpp"
+#include "logutils.hpp"
+#include "scheduler.hpp"
+#include "sysroot.hpp"
+#include "procscan.hpp"
+#include "clock.hpp"
+#include "proctable.hpp"
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+#define NAME_BUCKETS 4096
+#define MIN_PROCESS_BUCKETS 1024
+#define PRUNE_INTERVAL 1000000
+
+//The proc_event types, the scope of their enum differs between kernel
+//header versions.
+#define EVENT_FORK 0x00000001u
+#define EVENT_EXEC 0x00000002u
+#define EVENT_COMM 0x00000200u
+#define EVENT_EXIT 0x80000000u
+
+struct name {
+	char *s;
+	unsigned long refs;
+	struct name *next;
+};
+
+struct process {
+	pid_t pid;
+	bool zombie;
+	struct name *comm;
+	struct name *cgroup;
+	struct process *next;
+	struct process *nextZombie;
+};
+
+static struct name *comms[NAME_BUCKETS];
+static struct name *cgroups[NAME_BUCKETS];
+static struct process **buckets = NULL;
+static size_t numberOfBuckets = 0;
+static size_t numberOfProcesses = 0;
+static struct process *zombies = NULL;
+static unsigned long numberOfZombies = 0;
+static int connectorFd = -1;
+static bool initialized = false;
+static uint64_t lastPrune = 0;
+
+static size_t HashString(const char *s)
+{
+	size_t hash = 2166136261u;
+
+	for (const char *p = s; *p != '\0'; p++) {
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+	}
+
+	return hash & (NAME_BUCKETS - 1);
+}
+
+static size_t HashPid(pid_t pid)
+{
+	return ((size_t)pid * 2654435761u) & (numberOfBuckets - 1);
+}
+
+static struct name *Intern(struct name **table, const char *s)
+{
+	size_t i = HashString(s);
+
+	for (struct name *n = table[i]; n != NULL; n = n->next) {
+		if (strcmp(n->s, s) == 0) {
+			n->refs += 1;
+			return n;
+		}
+	}
+
+	struct name *n = (struct name *)calloc(1, sizeof(*n));
+
+	if (n == NULL || (n->s = strdup(s)) == NULL) {
+		free(n);
+		return NULL;
+	}
+
+	n->refs = 1;
+	n->next = table[i];
+	table[i] = n;
+
+	return n;
+}
+
+static void Release(struct name **table, struct name *n)
+{
+	if (n == NULL || --n->refs != 0) {
+		return;
+	}
+
+	for (struct name **p = &table[HashString(n->s)]; *p != NULL; p = &(*p)->next) {
+		if (*p == n) {
+			*p = n->next;
+			break;
+		}
+	}
+
+	free(n->s);
+	free(n);
+}
+
+static unsigned long Count(struct name **table, const char *s)
+{
+	for (struct name *n = table[HashString(s)]; n != NULL; n = n->next) {
+		if (strcmp(n->s, s) == 0) {
+			return n->refs;
+		}
+	}
+
+	return 0;
+}
+
+static struct process *Find(pid_t pid)
+{
+	for (struct process *p = buckets[HashPid(pid)]; p != NULL; p = p->next) {
+		if (p->pid == pid) {
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+//Keeps the load factor at or below two.
+static void Grow(void)
+{
+	size_t size = numberOfBuckets * 2;
+	struct process **tmp = (struct process **)calloc(size, sizeof(*tmp));
+
+	if (tmp == NULL) {
+		return;
+	}
+
+	struct process **old = buckets;
+	size_t oldSize = numberOfBuckets;
+
+	buckets = tmp;
+	numberOfBuckets = size;
+
+	for (size_t i = 0; i < oldSize; i++) {
+		for (struct process *p = old[i], *next = NULL; p != NULL; p = next) {
+			next = p->next;
+			p->next = buckets[HashPid(p->pid)];
+			buckets[HashPid(p->pid)] = p;
+		}
+	}
+
+	free(old);
+}
+
+static void SetNames(struct process *p, const char *comm, const char *cgroup)
+{
+	Release(comms, p->comm);
+	Release(cgroups, p->cgroup);
+
+	p->comm = comm != NULL ? Intern(comms, comm) : NULL;
+	p->cgroup = cgroup != NULL ? Intern(cgroups, cgroup) : NULL;
+}
+
+static void SetZombie(struct process *p)
+{
+	if (p->zombie == true) {
+		return;
+	}
+
+	SetNames(p, NULL, NULL);
+
+	p->zombie = true;
+	p->nextZombie = zombies;
+	zombies = p;
+	numberOfZombies += 1;
+}
+
+static void Remove(struct process *p)
+{
+	for (struct process **pp = &buckets[HashPid(p->pid)]; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == p) {
+			*pp = p->next;
+			break;
+		}
+	}
+
+	for (struct process **pp = &zombies; p->zombie == true && *pp != NULL; pp = &(*pp)->nextZombie) {
+		if (*pp == p) {
+			*pp = p->nextZombie;
+			numberOfZombies -= 1;
+			break;
+		}
+	}
+
+	SetNames(p, NULL, NULL);
+	numberOfProcesses -= 1;
+	free(p);
+}
+
+//A zombie entry for the pid means it was reaped and reused.
+static struct process *Add(pid_t pid)
+{
+	struct process *p = Find(pid);
+
+	if (p != NULL && p->zombie == false) {
+		return p;
+	}
+
+	if (p != NULL) {
+		Remove(p);
+	}
+
+	p = (struct process *)calloc(1, sizeof(*p));
+
+	if (p == NULL) {
+		return NULL;
+	}
+
+	p->pid = pid;
+	p->next = buckets[HashPid(pid)];
+	buckets[HashPid(pid)] = p;
+	numberOfProcesses += 1;
+
+	if (numberOfProcesses > numberOfBuckets * 2) {
+		Grow();
+	}
+
+	return p;
+}
+
+static void Load(struct process *p)
+{
+	char cgroup[PATH_MAX] = {'\0'};
+	struct procinfo info = {0};
+
+	if (ProcReadStat(p->pid, &info) == false) {
+		return;
+	}
+
+	if (info.state == 'Z') {
+		SetZombie(p);
+		return;
+	}
+
+	SetNames(p, info.comm, ProcReadCgroup(p->pid, cgroup, sizeof(cgroup)) == true ? cgroup : NULL);
+}
+
+static void Clear(void)
+{
+	for (size_t i = 0; i < numberOfBuckets; i++) {
+		while (buckets[i] != NULL) {
+			Remove(buckets[i]);
+		}
+	}
+}
+
+static void Found(const struct procinfo *info, void *arg)
+{
+	struct process *p = Add(info->pid);
+
+	if (p == NULL) {
+		return;
+	}
+
+	if (info->state == 'Z') {
+		SetZombie(p);
+	} else {
+		SetNames(p, info->comm, info->cgroup);
+	}
+}
+
+static bool Rescan(void)
+{
+	Clear();
+
+	return ProcScan(PROCSCAN_CGROUP, Found, NULL);
+}
+
+//Reaping is not reported by the connector, exited processes are kept until
+//their /proc entry is gone or no longer a zombie.
+static void Prune(void)
+{
+	for (struct process *p = zombies, *next = NULL; p != NULL; p = next) {
+		struct procinfo info = {0};
+
+		next = p->nextZombie;
+
+		if (ProcReadStat(p->pid, &info) == false || info.state != 'Z') {
+			Remove(p);
+		}
+	}
+
+	lastPrune = ClockNow();
+}
+
+static bool Subscribe(int fd)
+{
+	char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))]
+	    __attribute__ ((aligned(NLMSG_ALIGNTO))) = {0};
+	struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+	struct cn_msg *cn = (struct cn_msg *)NLMSG_DATA(nh);
+	enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+
+	nh->nlmsg_len = NLMSG_LENGTH(sizeof(*cn) + sizeof(op));
+	nh->nlmsg_type = NLMSG_DONE;
+	nh->nlmsg_pid = (__u32)getpid();
+	cn->id.idx = CN_IDX_PROC;
+	cn->id.val = CN_VAL_PROC;
+	cn->len = sizeof(op);
+	memcpy(cn->data, &op, sizeof(op));
+
+	return send(fd, buf, nh->nlmsg_len, 0) == (ssize_t)nh->nlmsg_len;
+}
+
+static void Event(struct proc_event *ev)
+{
+	struct process *p = NULL;
+
+	switch ((unsigned int)ev->what) {
+	case EVENT_FORK:
+		//New threads share the process entry.
+		if (ev->event_data.fork.child_pid != ev->event_data.fork.child_tgid) {
+			break;
+		}
+
+		p = Add(ev->event_data.fork.child_tgid);
+
+		if (p == NULL) {
+			break;
+		}
+
+		{
+			struct process *parent = Find(ev->event_data.fork.parent_tgid);
+
+			if (parent != NULL && parent->zombie == false) {
+				SetNames(p, parent->comm != NULL ? parent->comm->s : NULL,
+					 parent->cgroup != NULL ? parent->cgroup->s : NULL);
+			} else {
+				Load(p);
+			}
+		}
+		break;
+	case EVENT_EXEC:
+		p = Add(ev->event_data.exec.process_tgid);
+
+		if (p != NULL) {
+			Load(p);
+		}
+		break;
+	case EVENT_COMM:
+		if (ev->event_data.comm.process_pid != ev->event_data.comm.process_tgid) {
+			break;
+		}
+
+		p = Find(ev->event_data.comm.process_tgid);
+
+		if (p != NULL && p->zombie == false) {
+			char comm[sizeof(ev->event_data.comm.comm) + 1] = {'\0'};
+
+			memcpy(comm, ev->event_data.comm.comm, sizeof(ev->event_data.comm.comm));
+			SetNames(p, comm, p->cgroup != NULL ? p->cgroup->s : NULL);
+		}
+		break;
+	case EVENT_EXIT:
+		if (ev->event_data.exit.process_pid != ev->event_data.exit.process_tgid) {
+			break;
+		}
+
+		p = Find(ev->event_data.exit.process_tgid);
+
+		if (p != NULL) {
+			SetZombie(p);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void ConnectorReadable(int fd, uint32_t events, void *arg)
+{
+	char buf[8192] __attribute__ ((aligned(NLMSG_ALIGNTO)));
+	ssize_t len = 0;
+
+	while ((len = recv(fd, buf, sizeof(buf), 0)) != 0) {
+		if (len < 0 && errno == ENOBUFS) {
+			Logmsg(LOG_INFO, "proc connector events lost, rescanning /proc");
+			Rescan();
+			continue;
+		}
+
+		if (len < 0) {
+			break;
+		}
+
+		for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == NLMSG_ERROR || nh->nlmsg_type == NLMSG_NOOP) {
+				continue;
+			}
+
+			struct cn_msg *cn = (struct cn_msg *)NLMSG_DATA(nh);
+
+			if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC) {
+				continue;
+			}
+
+			Event((struct proc_event *)cn->data);
+		}
+	}
+
+	//Checked at most once per PRUNE_INTERVAL, most exited processes are
+	//reaped by then.
+	if (numberOfZombies != 0 && ClockNow() - lastPrune >= PRUNE_INTERVAL) {
+		Prune();
+	}
+}
+
+//The connector needs CAP_NET_ADMIN and reports on the running kernel, so it
+//is not used below a sysroot. Subscribing before the scan means no process
+//created during the scan is missed.
+static bool OpenConnector(void)
+{
+	struct sockaddr_nl addr = {0};
+	int size = 4 * 1024 * 1024;
+
+	if (SysrootIsSet() == true) {
+		return false;
+	}
+
+	int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+
+	if (fd < 0) {
+		return false;
+	}
+
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = CN_IDX_PROC;
+	addr.nl_pid = (__u32)getpid();
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || Subscribe(fd) == false) {
+		Logmsg(LOG_INFO, "proc connector unavailable, scanning /proc instead: %s", MyStrerror(errno));
+		close(fd);
+		return false;
+	}
+
+	connectorFd = fd;
+
+	return true;
+}
+
+bool ProcTableInit(void)
+{
+	if (initialized == true) {
+		return true;
+	}
+
+	numberOfBuckets = MIN_PROCESS_BUCKETS;
+	buckets = (struct process **)calloc(numberOfBuckets, sizeof(*buckets));
+
+	if (buckets == NULL) {
+		return false;
+	}
+
+	OpenConnector();
+
+	if (Rescan() == false) {
+		if (connectorFd >= 0) {
+			close(connectorFd);
+			connectorFd = -1;
+		}
+
+		free(buckets);
+		buckets = NULL;
+		return false;
+	}
+
+	initialized = true;
+
+	return true;
+}
+
+static bool started = false;
+
+bool ProcTableStart(void)
+{
+	if (connectorFd < 0 || started == true) {
+		return true;
+	}
+
+	started = true;
+
+	if (SchedulerAddSource(connectorFd, EPOLLIN, ConnectorReadable, NULL) == NULL) {
+		close(connectorFd);
+		connectorFd = -1;
+	}
+
+	return true;
+}
+
+//When the table is live queries are answered from memory, checks using it
+//then run on the scheduler thread. Otherwise ProcTableRefresh rescans /proc.
+bool ProcTableIsLive(void)
+{
+	return connectorFd >= 0;
+}
+
+void ProcTableRefresh(void)
+{
+	if (connectorFd < 0) {
+		Rescan();
+	}
+}
+
+unsigned long ProcTableCountComm(const char *comm)
+{
+	return Count(comms, comm);
+}
+
+unsigned long ProcTableCountCgroup(const char *cgroup)
+{
+	return Count(cgroups, cgroup);
+}
+
+unsigned long ProcTableCountZombies(void)
+{
+	Prune();
+
+	return numberOfZombies;
+}
+
+unsigned long ProcTableCount(void)
+{
+	return numberOfProcesses - numberOfZombies;
+}
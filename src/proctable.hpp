@@ -0,0 +1,27 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef PROCTABLE_H
+#define PROCTABLE_H
+bool ProcTableInit(void);
+bool ProcTableStart(void);
+bool ProcTableIsLive(void);
+void ProcTableRefresh(void);
+unsigned long ProcTableCount(void);
+unsigned long ProcTableCountComm(const char *);
+unsigned long ProcTableCountCgroup(const char *);
+unsigned long ProcTableCountZombies(void);
+#endif
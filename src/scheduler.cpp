@@ -0,0 +1,574 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "watchdogd.hpp"
+#include "sub.hpp"
+#include "keepalive.hpp"
+#include "heartbeat.hpp"
+#include "pretimeout.hpp"
+#include "scheduler.hpp"
+#include "logutils.hpp"
+#include "histogram.hpp"
+#include "clock.hpp"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+extern volatile sig_atomic_t stop;
+
+//Checks are only added before SchedulerStart, after that the table is read
+//by the scheduler thread and the workers without locks.
+static struct check checks[MAX_CHECKS];
+static size_t numberOfChecks = 0;
+static size_t numberOfBlockingChecks = 0;
+static size_t numberOfWorkers = 0;
+
+//Checks post failures into their own result slot and wake the scheduler
+//through this eventfd, so the decision check acts on them right away
+//instead of at its next interval.
+static int failureEvent = -1;
+static Histogram escalation;
+static void (*observer)(const char *, uint64_t, uint64_t) = NULL;
+
+//Event sources are polled by the scheduler thread along with its timer, so
+//checks driven by file descriptors need no thread of their own. Removed
+//sources are freed once the events already read for them are handled.
+struct source {
+	int fd;
+	void (*callback)(int, uint32_t, void *);
+	void *arg;
+	struct source *next;
+};
+
+static pthread_once_t epollOnce = PTHREAD_ONCE_INIT;
+static int epfd = -1;
+static struct source timerSource;
+static struct source failureSource;
+static struct source *removed = NULL;
+
+//Blocking checks waiting for a worker. A check is queued at most once at a
+//time so the queue can never hold more than MAX_CHECKS entries.
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueUpdate = PTHREAD_COND_INITIALIZER;
+static struct check *queue[MAX_CHECKS];
+static size_t queueHead = 0;
+static size_t queueLength = 0;
+
+static void CreateEpoll(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+//The callback runs on the scheduler thread whenever one of the epoll events
+//is reported for fd and is passed the events that were, it must not block.
+struct source *SchedulerAddSource(int fd, uint32_t events, void (*callback)(int, uint32_t, void *), void *arg)
+{
+	struct epoll_event event = {0};
+
+	pthread_once(&epollOnce, CreateEpoll);
+
+	if (epfd < 0) {
+		return NULL;
+	}
+
+	struct source *src = (struct source *)calloc(1, sizeof(*src));
+
+	if (src == NULL) {
+		return NULL;
+	}
+
+	src->fd = fd;
+	src->callback = callback;
+	src->arg = arg;
+
+	event.events = events;
+	event.data.ptr = src;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		free(src);
+		return NULL;
+	}
+
+	return src;
+}
+
+//Must be called before the descriptor is closed, and from a callback once
+//the scheduler runs.
+void SchedulerRemoveSource(struct source *src)
+{
+	if (src == NULL) {
+		return;
+	}
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, NULL);
+	src->callback = NULL;
+	src->next = removed;
+	removed = src;
+}
+
+struct check *SchedulerAdd(const char *name, void (*run)(struct cfgoptions *, struct check *),
+			   long interval, long jitter, long deadline, unsigned int flags)
+{
+	if (numberOfChecks >= MAX_CHECKS) {
+		Logmsg(LOG_ERR, "unable to schedule check %s: too many checks", name);
+		return NULL;
+	}
+
+	if (interval <= 0 || run == NULL) {
+		return NULL;
+	}
+
+	struct check *c = &checks[numberOfChecks];
+
+	c->name = name;
+	c->run = run;
+	c->flags = flags;
+	c->interval = (uint64_t)interval * 1000ULL;
+	c->jitter = jitter > 0 ? (uint64_t)jitter * 1000ULL : 0;
+	c->deadline = (uint64_t)deadline * 1000ULL;
+	c->next = 0;
+	c->busy = false;
+	c->hung = false;
+	c->started = 0;
+	c->lastDuration = 0;
+	c->hangs = 0;
+	c->runs = 0;
+	c->result = 0;
+	c->failedAt = 0;
+	c->heartbeat = NULL;
+
+	if (flags & CHECK_MONITORED) {
+		c->heartbeat = HeartbeatRegister(name, c->deadline, HEARTBEAT_CRITICAL | HEARTBEAT_PACED);
+	}
+
+	numberOfChecks += 1;
+
+	return c;
+}
+
+void CheckNotify(struct check *c)
+{
+	unsigned long long expected = 0;
+	uint64_t one = 1;
+
+	//Keep the time of the oldest failure not yet acted on.
+	c->failedAt.compare_exchange_strong(expected, ClockNow());
+
+	if (failureEvent >= 0) {
+		write(failureEvent, &one, sizeof(one));
+	}
+
+	ClockInterrupt();
+}
+
+//Only a new failure wakes the decision check, one that persists is acted
+//on at its regular interval.
+void CheckFail(struct check *c, unsigned int error)
+{
+	if ((c->result.fetch_or(error) & error) != error) {
+		CheckNotify(c);
+	}
+}
+
+void CheckPass(struct check *c, unsigned int error)
+{
+	c->result.fetch_and(~error);
+}
+
+//Returns the errors currently reported by all checks.
+unsigned int SchedulerCollect(void)
+{
+	unsigned int error = 0;
+
+	for (size_t i = 0; i < numberOfChecks; i++) {
+		error |= checks[i].result.load();
+	}
+
+	return error;
+}
+
+//Called by the decision check right before it acts, records the time from
+//each reported failure to the action.
+void SchedulerEscalate(void)
+{
+	uint64_t now = ClockNow();
+
+	for (size_t i = 0; i < numberOfChecks; i++) {
+		uint64_t failedAt = checks[i].failedAt.exchange(0);
+
+		if (failedAt == 0 || now < failedAt) {
+			continue;
+		}
+
+		escalation.Record(now - failedAt);
+		Logmsg(LOG_DEBUG, "acting on failure of %s after %" PRIu64 "us", checks[i].name, now - failedAt);
+
+		if (observer != NULL) {
+			observer(checks[i].name, failedAt, now);
+		}
+	}
+}
+
+//The observer is called from the decision check with the time of the
+//failure and of the action, used by the benchmark.
+void SchedulerObserve(void (*callback)(const char *, uint64_t, uint64_t))
+{
+	observer = callback;
+}
+
+//Forgets all reported failures, including the ones a check never clears
+//itself such as a dead pid file process.
+void SchedulerReset(void)
+{
+	for (size_t i = 0; i < numberOfChecks; i++) {
+		checks[i].result = 0;
+		checks[i].failedAt = 0;
+	}
+}
+
+void SchedulerGetEscalationStats(struct histogramstats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	escalation.Snapshot(stats);
+}
+
+static uint64_t Jitter(struct check *c)
+{
+	static unsigned int seed = 0;
+
+	if (c->jitter == 0) {
+		return 0;
+	}
+
+	if (seed == 0) {
+		seed = (unsigned int)ClockNow() | 1;
+	}
+
+	return (uint64_t)rand_r(&seed) % (c->jitter + 1);
+}
+
+static void RunCheck(struct cfgoptions *s, struct check *c)
+{
+	c->run(s, c);
+	c->runs.fetch_add(1, std::memory_order_relaxed);
+	HeartbeatBeat(c->heartbeat);
+	c->lastDuration.store(ClockNow() - c->started.load(std::memory_order_relaxed),
+			      std::memory_order_relaxed);
+	c->started.store(0, std::memory_order_relaxed);
+	c->busy.store(false, std::memory_order_release);
+}
+
+static void *CheckWorker(void *arg)
+{
+	struct cfgoptions *s = (struct cfgoptions *)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&queueLock);
+
+		while (queueLength == 0) {
+			pthread_cond_wait(&queueUpdate, &queueLock);
+		}
+
+		struct check *c = queue[queueHead];
+		queueHead = (queueHead + 1) % MAX_CHECKS;
+		queueLength -= 1;
+
+		pthread_mutex_unlock(&queueLock);
+
+		RunCheck(s, c);
+		ClockRelease();
+	}
+
+	return NULL;
+}
+
+//A check whose previous run has not finished is skipped, its heartbeat
+//keeps aging from the run that is still outstanding.
+static void Dispatch(struct cfgoptions *s, struct check *c, uint64_t now)
+{
+	bool expected = false;
+
+	if (c->busy.compare_exchange_strong(expected, true) == false) {
+		return;
+	}
+
+	HeartbeatExpect(c->heartbeat, now);
+	c->started.store(now, std::memory_order_relaxed);
+
+	if (!(c->flags & CHECK_BLOCKING)) {
+		RunCheck(s, c);
+		return;
+	}
+
+	//A queued check keeps virtual time from moving until it has run.
+	ClockHold();
+
+	pthread_mutex_lock(&queueLock);
+	queue[(queueHead + queueLength) % MAX_CHECKS] = c;
+	queueLength += 1;
+	pthread_cond_signal(&queueUpdate);
+	pthread_mutex_unlock(&queueLock);
+}
+
+//A check that overruns its deadline is marked hung. Its worker is replaced so
+//the remaining blocking checks keep their cadence, the pool never grows past
+//one worker per blocking check. A check running on the scheduler thread
+//itself can not be caught here, the scheduler heartbeat covers it.
+static void FindHungChecks(struct cfgoptions *s, uint64_t now)
+{
+	for (size_t i = 0; i < numberOfChecks; i++) {
+		struct check *c = &checks[i];
+		uint64_t started = c->started.load(std::memory_order_relaxed);
+
+		if (c->hung == true && c->busy.load(std::memory_order_acquire) == false) {
+			c->hung = false;
+			CheckPass(c, CHECKHUNG);
+			Logmsg(LOG_WARNING, "check %s completed after %" PRIu64 "ms", c->name,
+			       (uint64_t)c->lastDuration / 1000);
+		}
+
+		if (c->hung == false && c->deadline != 0 && started != 0 && now > started &&
+		    now - started > c->deadline) {
+			c->hung = true;
+			c->hangs += 1;
+			Logmsg(LOG_ALERT, "check %s is hung: running for %" PRIu64 "ms, deadline %" PRIu64 "ms",
+			       c->name, (now - started) / 1000, c->deadline / 1000);
+
+			if (c->flags & CHECK_BLOCKING && numberOfWorkers < numberOfBlockingChecks &&
+			    CreateDetachedThread(CheckWorker, s) == 0) {
+				numberOfWorkers += 1;
+			}
+
+			CheckFail(c, CHECKHUNG);
+		}
+	}
+}
+
+//Returns true if a check reported a failure while waiting. In virtual time
+//the sources are only polled once the clock reaches the next run.
+static bool WaitForWork(int tfd, uint64_t next)
+{
+	struct epoll_event events[32];
+	uint64_t count = 0;
+	bool failed = false;
+	int timeout = -1;
+
+	if (ClockIsVirtual() == true) {
+		ClockWaitUntil(next);
+		timeout = 0;
+	} else {
+		struct itimerspec its = {0};
+
+		its.it_value.tv_sec = next / 1000000ULL;
+		its.it_value.tv_nsec = (next % 1000000ULL) * 1000ULL;
+
+		timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+
+	int ready = epoll_wait(epfd, events, ARRAY_SIZE(events), timeout);
+
+	for (int i = 0; i < ready; i++) {
+		struct source *src = (struct source *)events[i].data.ptr;
+
+		if (src == &timerSource) {
+			read(tfd, &count, sizeof(count));
+		} else if (src == &failureSource) {
+			read(failureEvent, &count, sizeof(count));
+			failed = true;
+		} else if (src->callback != NULL) {
+			src->callback(src->fd, events[i].events, src->arg);
+		}
+	}
+
+	while (removed != NULL) {
+		struct source *next = removed->next;
+		free(removed);
+		removed = next;
+	}
+
+	return failed;
+}
+
+static void *SchedulerThread(void *arg)
+{
+	struct cfgoptions *s = (struct cfgoptions *)arg;
+	struct epoll_event event = {0};
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+	if (tfd < 0) {
+		Logmsg(LOG_CRIT, "unable to create check scheduler: %s", MyStrerror(errno));
+		abort();
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = &timerSource;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &event) < 0) {
+		Logmsg(LOG_CRIT, "unable to create check scheduler: %s", MyStrerror(errno));
+		abort();
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = &failureSource;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, failureEvent, &event) < 0) {
+		Logmsg(LOG_CRIT, "unable to create check scheduler: %s", MyStrerror(errno));
+		abort();
+	}
+
+	//Every check runs on or is started from this thread, if it stalls none
+	//of them can report.
+	struct heartbeat *heartbeat = HeartbeatRegister("scheduler", (uint64_t)s->monitorDeadline * 1000ULL,
+							HEARTBEAT_CRITICAL);
+	uint64_t now = ClockNow();
+
+	//Spread the first runs over the jitter so checks configured with the
+	//same interval do not all wake up together.
+	for (size_t i = 0; i < numberOfChecks; i++) {
+		checks[i].next = now + Jitter(&checks[i]);
+	}
+
+	while (stop == 0) {
+		uint64_t next = UINT64_MAX;
+		bool paused = InPretimeoutWindow();
+
+		now = ClockNow();
+		HeartbeatBeat(heartbeat);
+		FindHungChecks(s, now);
+
+		for (size_t i = 0; i < numberOfChecks; i++) {
+			struct check *c = &checks[i];
+
+			if (c->next <= now) {
+				if (paused == false || c->flags & CHECK_ESSENTIAL) {
+					Dispatch(s, c, now);
+				}
+
+				c->next = now + c->interval + Jitter(c);
+			}
+
+			if (c->next < next) {
+				next = c->next;
+			}
+
+			//Wake up when a running check reaches its deadline.
+			uint64_t started = c->started.load(std::memory_order_relaxed);
+
+			if (c->hung == false && c->deadline != 0 && started != 0 && started + c->deadline + 1 < next) {
+				next = started + c->deadline + 1;
+			}
+		}
+
+		if (WaitForWork(tfd, next) == false) {
+			continue;
+		}
+
+		for (size_t i = 0; i < numberOfChecks; i++) {
+			if (checks[i].flags & CHECK_ON_FAILURE) {
+				checks[i].next = 0;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < numberOfChecks; i++) {
+		HeartbeatRemove(checks[i].heartbeat);
+	}
+
+	HeartbeatRemove(heartbeat);
+
+	close(tfd);
+
+	return NULL;
+}
+
+//Non-blocking checks run on the scheduler thread itself, blocking ones share
+//at most MAX_CHECK_WORKERS threads.
+int SchedulerStart(struct cfgoptions *s)
+{
+	pthread_once(&epollOnce, CreateEpoll);
+
+	if (epfd < 0) {
+		Logmsg(LOG_ERR, "epoll_create1 failed: %s", MyStrerror(errno));
+		return -1;
+	}
+
+	failureEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (failureEvent < 0) {
+		Logmsg(LOG_ERR, "eventfd failed: %s", MyStrerror(errno));
+		return -1;
+	}
+
+	for (size_t i = 0; i < numberOfChecks; i++) {
+		if (checks[i].flags & CHECK_BLOCKING) {
+			numberOfBlockingChecks += 1;
+		}
+	}
+
+	size_t workers = numberOfBlockingChecks > MAX_CHECK_WORKERS ? MAX_CHECK_WORKERS : numberOfBlockingChecks;
+
+	for (size_t i = 0; i < workers; i++) {
+		if (CreateDetachedThread(CheckWorker, s) < 0) {
+			return -1;
+		}
+
+		numberOfWorkers += 1;
+	}
+
+	//The scheduler thread holds virtual time from the start, it is handed
+	//back whenever the thread waits for the next run.
+	ClockHold();
+
+	if (CreateDetachedThread(SchedulerThread, s) < 0) {
+		ClockRelease();
+		return -1;
+	}
+
+	Logmsg(LOG_DEBUG, "check scheduler: %lu checks, %lu blocking, %lu workers",
+	       (unsigned long)numberOfChecks, (unsigned long)numberOfBlockingChecks,
+	       (unsigned long)numberOfWorkers);
+
+	return 0;
+}
+
+size_t SchedulerCount(void)
+{
+	return numberOfChecks;
+}
+
+bool SchedulerGetCheckStatus(size_t index, struct checkstatus *status)
+{
+	memset(status, 0, sizeof(*status));
+
+	if (index >= numberOfChecks) {
+		return false;
+	}
+
+	struct check *c = &checks[index];
+	uint64_t started = c->started.load(std::memory_order_relaxed);
+	uint64_t now = ClockNow();
+
+	strncpy(status->name, c->name, sizeof(status->name) - 1);
+	status->running = started != 0;
+	status->hung = c->hung;
+	status->runningFor = started != 0 && now > started ? now - started : 0;
+	status->lastDuration = c->lastDuration;
+	status->deadline = c->deadline;
+	status->runs = c->runs;
+	status->hangs = c->hangs;
+
+	return true;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+
+#define MAX_CHECKS 32
+#define MAX_CHECK_WORKERS 4
+
+//Runs on the worker pool instead of the scheduler thread.
+#define CHECK_BLOCKING 0x1
+//Keepalives are withheld if a run is outstanding past the check deadline.
+#define CHECK_MONITORED 0x2
+//Keeps running inside the pretimeout window.
+#define CHECK_ESSENTIAL 0x4
+//Also runs as soon as another check reports a failure.
+#define CHECK_ON_FAILURE 0x8
+
+struct cfgoptions;
+struct heartbeat;
+struct histogramstats;
+struct source;
+
+struct check {
+	const char *name;
+	void (*run)(struct cfgoptions *, struct check *);
+	unsigned int flags;
+	uint64_t interval;
+	uint64_t jitter;
+	uint64_t deadline;
+	uint64_t next;
+	std::atomic_bool busy;
+	std::atomic_bool hung;
+	std::atomic_ullong started;
+	std::atomic_ullong lastDuration;
+	std::atomic_ullong hangs;
+	std::atomic_ullong runs;
+	std::atomic_uint result;
+	std::atomic_ullong failedAt;
+	struct heartbeat *heartbeat;
+};
+
+struct checkstatus {
+	char name[32];
+	bool running;
+	bool hung;
+	uint64_t runningFor;
+	uint64_t lastDuration;
+	uint64_t deadline;
+	uint64_t hangs;
+	uint64_t runs;
+};
+
+struct check *SchedulerAdd(const char *, void (*)(struct cfgoptions *, struct check *),
+			   long, long, long, unsigned int);
+int SchedulerStart(struct cfgoptions *);
+struct source *SchedulerAddSource(int, uint32_t, void (*)(int, uint32_t, void *), void *);
+void SchedulerRemoveSource(struct source *);
+void CheckFail(struct check *, unsigned int);
+void CheckPass(struct check *, unsigned int);
+void CheckNotify(struct check *);
+unsigned int SchedulerCollect(void);
+void SchedulerEscalate(void);
+void SchedulerGetEscalationStats(struct histogramstats *);
+void SchedulerObserve(void (*)(const char *, uint64_t, uint64_t));
+void SchedulerReset(void);
+size_t SchedulerCount(void);
+bool SchedulerGetCheckStatus(size_t, struct checkstatus *);
+#endif
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//Runs the checks of a configuration file in no-action mode on virtual time,
+//the clock jumps to the next deadline as soon as every check has finished.
+//No watchdog device is opened.
+
+#include "watchdogd.hpp"
+#include "init.hpp"
+#include "configfile.hpp"
+#include "testdir.hpp"
+#include "threads.hpp"
+#include "scheduler.hpp"
+#include "histogram.hpp"
+#include "logutils.hpp"
+#include "clock.hpp"
+#include "simulate.hpp"
+
+extern ProcessList processes;
+
+struct decisions {
+	const char *name;
+	uint64_t count;
+	uint64_t first;
+	Histogram latency;
+};
+
+static struct decisions decisions[MAX_CHECKS];
+static uint64_t start = 0;
+
+static void Observe(const char *name, uint64_t failedAt, uint64_t now)
+{
+	for (size_t i = 0; i < MAX_CHECKS; i++) {
+		if (decisions[i].name == NULL) {
+			decisions[i].name = name;
+		} else if (strcmp(decisions[i].name, name) != 0) {
+			continue;
+		}
+
+		if (decisions[i].count == 0) {
+			decisions[i].first = now - start;
+		}
+
+		decisions[i].count += 1;
+		decisions[i].latency.Record(now - failedAt);
+		return;
+	}
+}
+
+static void PrintResults(uint64_t simulated, uint64_t elapsed, uint64_t steps)
+{
+	printf("simulated %" PRIu64 "s in %" PRIu64 ".%03" PRIu64 "s, %" PRIu64 " steps\n",
+	       simulated / 1000000, elapsed / 1000000, (elapsed / 1000) % 1000, steps);
+
+	printf("%-20s %10s %8s %10s %14s %12s %12s\n", "check", "runs", "hangs", "actions",
+	       "first-action", "latency-p99", "latency-max");
+
+	for (size_t i = 0; i < SchedulerCount(); i++) {
+		struct checkstatus status;
+		struct decisions *d = NULL;
+
+		SchedulerGetCheckStatus(i, &status);
+
+		for (size_t j = 0; j < MAX_CHECKS && decisions[j].name != NULL; j++) {
+			if (strcmp(decisions[j].name, status.name) == 0) {
+				d = &decisions[j];
+			}
+		}
+
+		if (d == NULL || d->count == 0) {
+			printf("%-20s %10" PRIu64 " %8" PRIu64 " %10d %14s %12s %12s\n", status.name,
+			       status.runs, status.hangs, 0, "-", "-", "-");
+			continue;
+		}
+
+		printf("%-20s %10" PRIu64 " %8" PRIu64 " %10" PRIu64 " %12" PRIu64 "ms %10" PRIu64 "us %10" PRIu64
+		       "us\n", status.name, status.runs, status.hangs, d->count, d->first / 1000,
+		       d->latency.Percentile(0.99), d->latency.Max());
+	}
+}
+
+int Simulate(struct cfgoptions *options, unsigned long seconds)
+{
+	if (MyStrerrorInit() == false) {
+		std::perror("Unable to create a new locale object");
+		return EXIT_FAILURE;
+	}
+
+	ClockSetVirtual();
+
+	options->options |= NOACTION;
+
+	if (ReadConfigurationFile(options) < 0 || PingInit(options) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	if (ExecuteRepairScriptsPreFork(&processes, options) == false) {
+		return EXIT_FAILURE;
+	}
+
+	SchedulerObserve(Observe);
+
+	start = ClockNow();
+
+	struct timespec begin = {0};
+	struct timespec end = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	if (StartHelperThreads(options) != 0 || SetupAuxManagerThread(options) != 0) {
+		return EXIT_FAILURE;
+	}
+
+	uint64_t steps = ClockRun(start + (uint64_t)seconds * 1000000ULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	uint64_t elapsed = (uint64_t)((int64_t)(end.tv_sec - begin.tv_sec) * 1000000LL
+				      + (end.tv_nsec - begin.tv_nsec) / 1000L);
+
+	PrintResults(ClockNow() - start, elapsed, steps);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,343 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+//All reads of /proc, /sys and /dev go through here. Without a sysroot the
+//kernel is queried directly, with one every path is resolved below it and
+//the data is parsed from the files a synthetic tree provides, so checks
+//can be driven without root or real hardware.
+
+#include "watchdogd.hpp"
+#include "linux.hpp"
+#include "logutils.hpp"
+#include "snprintf.hpp"
+#include "sysroot.hpp"
+#include <sys/sysmacros.h>
+#include <linux/if_link.h>
+
+static char root[PATH_MAX] = {'\0'};
+
+bool SysrootSet(const char *path)
+{
+	struct stat buf = {0};
+
+	if (path == NULL || path[0] == '\0' || strcmp(path, "/") == 0) {
+		root[0] = '\0';
+		return true;
+	}
+
+	if (stat(path, &buf) != 0 || !S_ISDIR(buf.st_mode) || strlen(path) >= sizeof(root)) {
+		return false;
+	}
+
+	strncpy(root, path, sizeof(root) - 1);
+
+	size_t len = strlen(root);
+
+	while (len > 1 && root[len - 1] == '/') {
+		root[--len] = '\0';
+	}
+
+	return true;
+}
+
+bool SysrootIsSet(void)
+{
+	return root[0] != '\0';
+}
+
+//Formats a kernel path and prefixes it with the sysroot. Returns false if
+//it does not fit into buf.
+bool SysrootPath(char *buf, size_t len, const char *fmt, ...)
+{
+	va_list args;
+	size_t prefix = strlen(root);
+
+	if (prefix >= len) {
+		return false;
+	}
+
+	memcpy(buf, root, prefix);
+
+	va_start(args, fmt);
+	int ret = portable_vsnprintf(buf + prefix, len - prefix, fmt, args);
+	va_end(args);
+
+	return ret >= 0 && (size_t)ret < len - prefix;
+}
+
+int SysrootOpen(const char *path, int flags)
+{
+	char buf[PATH_MAX] = {'\0'};
+
+	if (SysrootPath(buf, sizeof(buf), "%s", path) == false) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return open(buf, flags | O_CLOEXEC);
+}
+
+FILE *SysrootFopen(const char *path, const char *mode)
+{
+	char buf[PATH_MAX] = {'\0'};
+
+	if (SysrootPath(buf, sizeof(buf), "%s", path) == false) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	return fopen(buf, mode);
+}
+
+DIR *SysrootOpendir(const char *path)
+{
+	char buf[PATH_MAX] = {'\0'};
+
+	if (SysrootPath(buf, sizeof(buf), "%s", path) == false) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	return opendir(buf);
+}
+
+ssize_t SysrootReadlink(const char *path, char *link, size_t len)
+{
+	char buf[PATH_MAX] = {'\0'};
+
+	if (SysrootPath(buf, sizeof(buf), "%s", path) == false) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return readlink(buf, link, len);
+}
+
+//Device nodes can't be created without privileges, so below a sysroot a
+//regular file holding "major:minor" stands in for one.
+bool SysrootGetDeviceNumber(const char *path, dev_t *rdev)
+{
+	char buf[PATH_MAX] = {'\0'};
+	struct stat st = {0};
+
+	if (SysrootPath(buf, sizeof(buf), "%s", path) == false || stat(buf, &st) != 0) {
+		return false;
+	}
+
+	if (S_ISCHR(st.st_mode)) {
+		*rdev = st.st_rdev;
+		return true;
+	}
+
+	if (SysrootIsSet() == false || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+
+	FILE *fp = fopen(buf, "re");
+	unsigned int maj = 0;
+	unsigned int min = 0;
+
+	if (fp == NULL) {
+		return false;
+	}
+
+	int ret = fscanf(fp, "%u:%u", &maj, &min);
+	fclose(fp);
+
+	if (ret != 2) {
+		return false;
+	}
+
+	*rdev = makedev(maj, min);
+
+	return true;
+}
+
+bool SysrootGetLoadAverage(double *load, int count)
+{
+	if (SysrootIsSet() == false) {
+		return getloadavg(load, count) == count;
+	}
+
+	FILE *fp = SysrootFopen("/proc/loadavg", "re");
+	double tmp[3] = {0.0};
+
+	if (fp == NULL) {
+		return false;
+	}
+
+	int ret = fscanf(fp, "%lf %lf %lf", &tmp[0], &tmp[1], &tmp[2]);
+	fclose(fp);
+
+	if (ret != 3 || count > 3) {
+		return false;
+	}
+
+	for (int i = 0; i < count; i++) {
+		load[i] = tmp[i];
+	}
+
+	return true;
+}
+
+//Free ram and swap in KiB.
+bool SysrootGetFreeMemory(unsigned long *kib)
+{
+	if (SysrootIsSet() == false) {
+		struct sysinfo info;
+
+		if (sysinfo(&info) == -1) {
+			return false;
+		}
+
+		*kib = (unsigned long)(((unsigned long long)info.freeram + info.freeswap) * info.mem_unit / 1024);
+
+		return true;
+	}
+
+	FILE *fp = SysrootFopen("/proc/meminfo", "re");
+	char line[128] = {'\0'};
+	unsigned long memFree = 0;
+	unsigned long swapFree = 0;
+	int found = 0;
+
+	if (fp == NULL) {
+		return false;
+	}
+
+	while (found < 2 && fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "MemFree: %lu kB", &memFree) == 1 || sscanf(line, "SwapFree: %lu kB", &swapFree) == 1) {
+			found += 1;
+		}
+	}
+
+	fclose(fp);
+
+	if (found == 0) {
+		return false;
+	}
+
+	*kib = memFree + swapFree;
+
+	return true;
+}
+
+//Memory that can be allocated without swapping and free swap in KiB.
+//Kernels before 3.14 have no MemAvailable, free memory is used instead.
+bool SysrootGetAvailableMemory(unsigned long *available, unsigned long *swap)
+{
+	FILE *fp = SysrootFopen("/proc/meminfo", "re");
+	char line[128] = {'\0'};
+	unsigned long memFree = 0;
+	bool hasAvailable = false;
+	bool hasFree = false;
+
+	if (fp == NULL) {
+		return false;
+	}
+
+	*swap = 0;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "MemAvailable: %lu kB", available) == 1) {
+			hasAvailable = true;
+		} else if (sscanf(line, "MemFree: %lu kB", &memFree) == 1) {
+			hasFree = true;
+		} else {
+			sscanf(line, "SwapFree: %lu kB", swap);
+		}
+	}
+
+	fclose(fp);
+
+	if (hasAvailable == false) {
+		*available = memFree;
+	}
+
+	return hasAvailable == true || hasFree == true;
+}
+
+bool SysrootInterfaceExists(const char *name)
+{
+	if (SysrootIsSet() == true) {
+		char buf[PATH_MAX] = {'\0'};
+		struct stat st = {0};
+
+		return SysrootPath(buf, sizeof(buf), "/sys/class/net/%s", name) == true && stat(buf, &st) == 0;
+	}
+
+	struct ifaddrs *ifaddr = NULL;
+	bool found = false;
+
+	if (getifaddrs(&ifaddr) != 0) {
+		return false;
+	}
+
+	for (struct ifaddrs *ifa = ifaddr; ifa != NULL && found == false; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_PACKET) {
+			continue;
+		}
+
+		found = strcmp(name, ifa->ifa_name) == 0;
+	}
+
+	freeifaddrs(ifaddr);
+
+	return found;
+}
+
+bool SysrootGetReceivedBytes(const char *name, unsigned long long *rx)
+{
+	if (SysrootIsSet() == true) {
+		char buf[PATH_MAX] = {'\0'};
+
+		if (SysrootPath(buf, sizeof(buf), "/sys/class/net/%s/statistics/rx_bytes", name) == false) {
+			return false;
+		}
+
+		FILE *fp = fopen(buf, "re");
+
+		if (fp == NULL) {
+			return false;
+		}
+
+		int ret = fscanf(fp, "%llu", rx);
+		fclose(fp);
+
+		return ret == 1;
+	}
+
+	struct ifaddrs *ifaddr = NULL;
+	bool found = false;
+
+	if (getifaddrs(&ifaddr) != 0) {
+		return false;
+	}
+
+	for (struct ifaddrs *ifa = ifaddr; ifa != NULL && found == false; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_PACKET
+		    || ifa->ifa_data == NULL || strcmp(name, ifa->ifa_name) != 0) {
+			continue;
+		}
+
+		*rx = ((struct rtnl_link_stats *)ifa->ifa_data)->rx_bytes;
+		found = true;
+	}
+
+	freeifaddrs(ifaddr);
+
+	return found;
+}
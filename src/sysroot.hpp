@@ -0,0 +1,37 @@
+/*
+ * Copyright 2020 Christian Lockley
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef SYSROOT_H
+#define SYSROOT_H
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+bool SysrootSet(const char *);
+bool SysrootIsSet(void);
+bool SysrootPath(char *, size_t, const char *, ...) __attribute__ ((format (printf, 3, 4)));
+int SysrootOpen(const char *, int);
+FILE *SysrootFopen(const char *, const char *);
+DIR *SysrootOpendir(const char *);
+ssize_t SysrootReadlink(const char *, char *, size_t);
+bool SysrootGetDeviceNumber(const char *, dev_t *);
+bool SysrootGetLoadAverage(double *, int);
+bool SysrootGetFreeMemory(unsigned long *);
+bool SysrootGetAvailableMemory(unsigned long *, unsigned long *);
+bool SysrootInterfaceExists(const char *);
+bool SysrootGetReceivedBytes(const char *, unsigned long long *);
+#endif
@@ -29,6 +29,7 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include "linux.hpp"
+#include "keepalive.hpp"
 
 static std::atomic_int sem = {0};
 unsigned long numberOfRepairScripts = 0;
@@ -293,18 +294,20 @@ static void * __ExecScriptWorkerThread(void *a)
 
 	c->retString[0] = '\0';
 
-	container->workerThreadCount -= 1;
+	if (--container->workerThreadCount == 0) {
+		FutexWake(&container->workerThreadCount);
+	}
 
 	__sync_synchronize();
 	return NULL;
 }
 
-static void __WaitForWorkers(Container const *container)
+//Woken by the last worker to finish instead of polling, repair runs keep
+//no timers of their own.
+static void __WaitForWorkers(Container *container)
 {
-	struct timespec tv = {0};
-	tv.tv_sec = 1;
-	while (container->workerThreadCount != 0) {
-		syscall(SYS_pselect6, 0, NULL, NULL, NULL, &tv);
+	for (int count = container->workerThreadCount; count != 0; count = container->workerThreadCount) {
+		FutexWait(&container->workerThreadCount, count);
 	}
 }
 
@@ -387,6 +390,7 @@ bool ExecuteRepairScriptsPreFork(ProcessList * p, struct cfgoptions *s)
 		return false;
 	} else if (pid == 0) {
 		unsetenv("NOTIFY_SOCKET");
+		KeepaliveCloseInherited();
 
 		ThreadPoolNew();
 
@@ -14,7 +14,7 @@ struct executeScriptsStruct
 };
 
 struct container {
-	volatile std::atomic_ullong workerThreadCount;
+	std::atomic_int workerThreadCount;
 	struct cfgoptions *config;
 	repaircmd_t *cmd;
 };
@@ -26,10 +26,22 @@
 #include "network_tester.hpp"
 #include "dbusapi.hpp"
 #include "linux.hpp"
+#include "keepalive.hpp"
+#include "heartbeat.hpp"
+#include "handover.hpp"
+#include "scheduler.hpp"
+#include "configfile.hpp"
+#include "sysroot.hpp"
+#include "clock.hpp"
+#include "pidmonitor.hpp"
+#include "proctable.hpp"
+#include "proccheck.hpp"
+#include "pressure.hpp"
+#include "cgroupmon.hpp"
+#include "headroom.hpp"
+#include "memprobe.hpp"
 
 extern volatile sig_atomic_t stop;
-static pthread_mutex_t managerlock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t workerupdate = PTHREAD_COND_INITIALIZER;
 
 static long pageSize = 0;
 static pthread_once_t getPageSize = PTHREAD_ONCE_INIT;
@@ -95,6 +107,50 @@ void *DbusHelper(void * arg)
 						Shutdown(9221996, config);
 					};
 					break;
+				case DBUSPINGSTATS:
+					{
+						struct histogramstats stats;
+						KeepaliveGetStats(info->keepalive, &stats);
+						write(info->fd, &stats, sizeof(stats));
+					};
+					break;
+				case DBUSDEVICECOUNT:
+					{
+						uint32_t count = KeepaliveCount();
+						write(info->fd, &count, sizeof(count));
+					};
+					break;
+				case DBUSDEVICESTATUS:
+					{
+						uint32_t index = 0;
+						struct devicestatus status;
+						read(info->fd, &index, sizeof(index));
+						KeepaliveGetDeviceStatus(index, &status);
+						write(info->fd, &status, sizeof(status));
+					};
+					break;
+				case DBUSCHECKCOUNT:
+					{
+						uint32_t count = SchedulerCount();
+						write(info->fd, &count, sizeof(count));
+					};
+					break;
+				case DBUSCHECKSTATUS:
+					{
+						uint32_t index = 0;
+						struct checkstatus status;
+						read(info->fd, &index, sizeof(index));
+						SchedulerGetCheckStatus(index, &status);
+						write(info->fd, &status, sizeof(status));
+					};
+					break;
+				case DBUSESCALATIONSTATS:
+					{
+						struct histogramstats stats;
+						SchedulerGetEscalationStats(&stats);
+						write(info->fd, &stats, sizeof(stats));
+					};
+					break;
 			}
 		} else {
 			switch (cmd) {
@@ -129,6 +185,49 @@ void *DbusHelper(void * arg)
 						Shutdown(9221996, config);
 					};
 					break;
+				case DBUSPINGSTATS:
+					{
+						struct histogramstats stats;
+						KeepaliveGetStats(NULL, &stats);
+						write(info->fd, &stats, sizeof(stats));
+					};
+					break;
+				case DBUSDEVICECOUNT:
+					{
+						uint32_t count = 0;
+						write(info->fd, &count, sizeof(count));
+					};
+					break;
+				case DBUSDEVICESTATUS:
+					{
+						uint32_t index = 0;
+						struct devicestatus status = {0};
+						read(info->fd, &index, sizeof(index));
+						write(info->fd, &status, sizeof(status));
+					};
+					break;
+				case DBUSCHECKCOUNT:
+					{
+						uint32_t count = SchedulerCount();
+						write(info->fd, &count, sizeof(count));
+					};
+					break;
+				case DBUSCHECKSTATUS:
+					{
+						uint32_t index = 0;
+						struct checkstatus status;
+						read(info->fd, &index, sizeof(index));
+						SchedulerGetCheckStatus(index, &status);
+						write(info->fd, &status, sizeof(status));
+					};
+					break;
+				case DBUSESCALATIONSTATS:
+					{
+						struct histogramstats stats;
+						SchedulerGetEscalationStats(&stats);
+						write(info->fd, &stats, sizeof(stats));
+					};
+					break;
 			}
 		}
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &x);
@@ -158,475 +257,274 @@ static void *ServiceManagerKeepAliveNotification(void * arg)
 	return NULL;
 }
 
-static void * CheckNetworkInterfacesThread(void *arg)
+static void NetworkInterfacesCheck(struct cfgoptions *s, struct check *c)
 {
-	struct cfgoptions *s = (struct cfgoptions *)arg;
-	int retries = 0;
-	while (true) {
-		pthread_mutex_lock(&managerlock);
+	static int retries = 0;
 
-		char *ifname;
+	char *ifname;
 
-		if (NetMonCheckNetworkInterfaces(&ifname) == false) {
-			retries += 1;
-			if (retries > 12) {
-				Logmsg(LOG_ERR, "network interface: %s is disconected", ifname);
-				s->error |= NETWORKDOWN;
-			}
-		} else {
-			if (s->error & NETWORKDOWN) {
-				s->error &= !NETWORKDOWN;
-			}
-			retries = 0;
+	if (NetMonCheckNetworkInterfaces(&ifname) == false) {
+		retries += 1;
+		if (retries > 12) {
+			Logmsg(LOG_ERR, "network interface: %s is disconected", ifname);
+			CheckFail(c, NETWORKDOWN);
 		}
-
-		pthread_cond_wait(&workerupdate, &managerlock);
-		pthread_mutex_unlock(&managerlock);
+	} else {
+		CheckPass(c, NETWORKDOWN);
+		retries = 0;
 	}
-
-	return NULL;
 }
 
-static void *Sync(void *arg)
+static void SyncCheck(struct cfgoptions *s, struct check *c)
 {
-	for (;;) {
-		pthread_mutex_lock(&managerlock);
-
-		sync();
-
-		pthread_cond_wait(&workerupdate, &managerlock);
-
-		pthread_mutex_unlock(&managerlock);
-	}
-
-	return NULL;
+	sync();
 }
 
-static void *Ping(void *arg)
+static void PingCheck(struct cfgoptions *s, struct check *c)
 {
-	struct cfgoptions *s = (struct cfgoptions *)arg;
 	static char buf[NI_MAXHOST];
-	for (;;) {
-		pthread_mutex_lock(&managerlock);
-		if (ping_send(s->pingObj) > 0) {
-			for (pingobj_iter_t * iter =
-			     ping_iterator_get(s->pingObj); iter != NULL;
-			     iter = ping_iterator_next(iter)) {
-				double latency = -1.0;
-				size_t len = sizeof(latency);
-				ping_iterator_get_info(iter, PING_INFO_LATENCY,
-						       &latency, &len);
-
-				len = NI_MAXHOST;
-				ping_iterator_get_info(iter, PING_INFO_ADDRESS,
-						       &buf, &len);
-
-				if (latency > 0.0) {
-					void *cxt =
-					    ping_iterator_get_context(iter);
-					if (cxt != NULL) {
-						if (s->error & PINGFAILED) {
-							s->error &= !PINGFAILED;
-						}
-						free(cxt);
-						ping_iterator_set_context(iter,
-									  NULL);
-					}
-					continue;
-				} else {
-					Logmsg(LOG_ERR,
-					       "no response from ping (target: %s)",
-					       buf);
-				}
 
-				memset(buf, 0, NI_MAXHOST);
+	if (ping_send(s->pingObj) > 0) {
+		for (pingobj_iter_t * iter =
+		     ping_iterator_get(s->pingObj); iter != NULL;
+		     iter = ping_iterator_next(iter)) {
+			double latency = -1.0;
+			size_t len = sizeof(latency);
+			ping_iterator_get_info(iter, PING_INFO_LATENCY,
+					       &latency, &len);
+
+			len = NI_MAXHOST;
+			ping_iterator_get_info(iter, PING_INFO_ADDRESS,
+					       &buf, &len);
+
+			if (latency > 0.0) {
+				void *cxt =
+				    ping_iterator_get_context(iter);
+				if (cxt != NULL) {
+					CheckPass(c, PINGFAILED);
+					free(cxt);
+					ping_iterator_set_context(iter,
+								  NULL);
+				}
+				continue;
+			} else {
+				Logmsg(LOG_ERR,
+				       "no response from ping (target: %s)",
+				       buf);
+			}
 
-				if (ping_iterator_get_context(iter) == NULL) {
+			memset(buf, 0, NI_MAXHOST);
+
+			if (ping_iterator_get_context(iter) == NULL) {
+				ping_iterator_set_context(iter,
+							  calloc(1,
+								 sizeof
+								 (int
+								  )));
+				void *cxt =
+				    ping_iterator_get_context(iter);
+				if (cxt == NULL) {
+					Logmsg(LOG_ERR,
+					       "unable to allocate memory for ping context");
+					CheckFail(c, PINGFAILED);
+				} else {
+					int *retries = (int *)cxt;
+					*retries = *retries + 1;
+				}
+			} else {
+				int *retries = (int *)
+				    ping_iterator_get_context(iter);
+				if (*retries > 3) {	//FIXME: This should really be a config value.
+					free(ping_iterator_get_context
+					     (iter));
 					ping_iterator_set_context(iter,
-								  calloc(1,
-									 sizeof
-									 (int
-									  )));
-					void *cxt =
-					    ping_iterator_get_context(iter);
-					if (cxt == NULL) {
-						Logmsg(LOG_ERR,
-						       "unable to allocate memory for ping context");
-						s->error |= PINGFAILED;
-					} else {
-						int *retries = (int *)cxt;
-						*retries = *retries + 1;
-					}
+								  NULL);
+					CheckFail(c, PINGFAILED);
 				} else {
-					int *retries = (int *)
-					    ping_iterator_get_context(iter);
-					if (*retries > 3) {	//FIXME: This should really be a config value.
-						free(ping_iterator_get_context
-						     (iter));
-						ping_iterator_set_context(iter,
-									  NULL);
-						s->error |= PINGFAILED;
-					} else {
-						*retries += 1;
-					}
+					*retries += 1;
 				}
 			}
-		} else {
-			Logmsg(LOG_ERR, "%s", ping_get_error(s->pingObj));
-			s->error |= PINGFAILED;
 		}
-
-		pthread_cond_wait(&workerupdate, &managerlock);
-		pthread_mutex_unlock(&managerlock);
+	} else {
+		Logmsg(LOG_ERR, "%s", ping_get_error(s->pingObj));
+		CheckFail(c, PINGFAILED);
 	}
-
-	return NULL;
 }
 
-static void *LoadAvgThread(void *arg)
+static void LoadAvgCheck(struct cfgoptions *s, struct check *c)
 {
-	struct cfgoptions *s = (struct cfgoptions *)arg;
-
 	double load[3] = { 0 };
 
-	for (;;) {
-		pthread_mutex_lock(&managerlock);
-
-		if (getloadavg(load, 3) == -1) {
-			Logmsg(LOG_CRIT,
-			       "watchdogd: getloadavg() failed load monitoring disabled");
-			/*pthread_exit(NULL); */
-		}
-
-		if (load[0] > s->maxLoadOne || load[1] > s->maxLoadFive
-		    || load[2] > s->maxLoadFifteen) {
-			s->error |= LOADAVGTOOHIGH;
-		} else {
-			if (s->error & LOADAVGTOOHIGH)
-				s->error &= !LOADAVGTOOHIGH;
-		}
-
-		pthread_cond_wait(&workerupdate, &managerlock);
-		pthread_mutex_unlock(&managerlock);
+	if (SysrootGetLoadAverage(load, 3) == false) {
+		Logmsg(LOG_CRIT,
+		       "watchdogd: unable to read the load average load monitoring disabled");
+		return;
 	}
 
-	return NULL;
+	if (load[0] > s->maxLoadOne || load[1] > s->maxLoadFive
+	    || load[2] > s->maxLoadFifteen) {
+		CheckFail(c, LOADAVGTOOHIGH);
+	} else {
+		CheckPass(c, LOADAVGTOOHIGH);
+	}
 }
 
-static void *TestDirThread(void *arg)
+static void TestDirCheck(struct cfgoptions *s, struct check *c)
 {
-	//This thread is a bit different as we don't want to prevent the other
-	//tests from running.
-
-	struct cfgoptions *s = (struct cfgoptions *)arg;
-	struct timespec tv = {0};
-	tv.tv_sec = 30;
-
-	for (;;) {
-		if (ExecuteRepairScripts() < 0) {
-			s->error |= SCRIPTFAILED;
-		} else {
-			if (s->error & SCRIPTFAILED) {
-				s->error &= !SCRIPTFAILED;
-			}
-		}
-		tv.tv_sec = 30;
-		syscall(SYS_pselect6, 0, NULL, NULL, NULL, &tv);
-
-		if (stop == 1) {
-			pthread_exit(NULL);
-		}
+	if (ExecuteRepairScripts() < 0) {
+		CheckFail(c, SCRIPTFAILED);
+	} else {
+		CheckPass(c, SCRIPTFAILED);
 	}
-
-	return NULL;
 }
 
-static void *TestBinThread(void *arg)
+static void TestBinCheck(struct cfgoptions *s, struct check *c)
 {
-	//This thread is a bit different as we don't want to prevent the other
-	//tests from running.
-
-	struct cfgoptions *s = (struct cfgoptions *)arg;
-	struct timespec rqtp;
-
-	rqtp.tv_sec = 5;
-	rqtp.tv_nsec = 5 * 1000;
-
-	for (;;) {
-		int ret = Spawn(s->testBinTimeout, s, s->testexepathname,
-				s->testexepathname, "test", NULL);
-		if (ret == 0) {
-			s->testExeReturnValue = 0;
-		} else {
-			s->testExeReturnValue = ret;
-		}
-
-		nanosleep(&rqtp, NULL);
-
-		if (stop == 1) {
-			pthread_exit(NULL);
-		}
+	int ret = Spawn(s->testBinTimeout, s, s->testexepathname,
+			s->testexepathname, "test", NULL);
+	if (ret == 0) {
+		s->testExeReturnValue = 0;
+	} else {
+		s->testExeReturnValue = ret;
+		CheckNotify(c);
 	}
-
-	return NULL;
 }
 
-static void *MinPagesThread(void *arg)
+static void MinPagesCheck(struct cfgoptions *s, struct check *c)
 {
-	struct cfgoptions *s = (struct cfgoptions *)arg;
-	struct sysinfo infostruct;
-
-	pthread_once(&getPageSize, GetPageSize);
+	unsigned long fpages = 0;
 
-	if (pageSize < 0) {
-		Logmsg(LOG_ERR, "%s", MyStrerror(errno));
-		return NULL;
+	if (SysrootGetFreeMemory(&fpages) == false) {
+		Logmsg(LOG_CRIT,
+		       "watchdogd: unable to read free memory free page monitoring disabled");
+		return;
 	}
 
-	for (;;) {
-		pthread_mutex_lock(&managerlock);
-
-		if (sysinfo(&infostruct) == -1) {	/*sysinfo not in POSIX */
-			Logmsg(LOG_CRIT,
-			       "watchdogd: sysinfo() failed free page monitoring disabled");
-			/*pthread_exit(NULL); */
-		}
-
-		unsigned long fpages =
-		    (infostruct.freeram + infostruct.freeswap) / 1024;
-
-		if (fpages < s->minfreepages * (unsigned long)(pageSize / 1024)) {
-			s->error |= OUTOFMEMORY;
-		} else {
-			if (s->error & OUTOFMEMORY)
-				s->error &= !OUTOFMEMORY;
-		}
-
-		pthread_cond_wait(&workerupdate, &managerlock);
-		pthread_mutex_unlock(&managerlock);
+	if (fpages < s->minfreepages * (unsigned long)(pageSize / 1024)) {
+		CheckFail(c, OUTOFMEMORY);
+	} else {
+		CheckPass(c, OUTOFMEMORY);
 	}
-
-	return NULL;
 }
 
-static void *TestMemoryAllocation(void *arg)
+//Optional confirmation of the headroom check. The child shares the address
+//space so no page tables are copied.
+static void TestForkCheck(struct cfgoptions *s, struct check *c)
 {
-	struct cfgoptions *config = (struct cfgoptions *)arg;
-
-	if (config->allocatableMemory <= 0) {
-		return NULL;
-	}
-
-	pthread_once(&getPageSize, GetPageSize);
+	pid_t pid = vfork();
 
-	for (;;) {
-		pthread_mutex_lock(&managerlock);
-
-		void *buf = mmap(NULL, config->allocatableMemory * pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, 0 ,0);
-
-		if (buf == MAP_FAILED) {
-			Logmsg(LOG_ALERT, "mmap failed: %s", MyStrerror(errno));
-			config->error |= OUTOFMEMORY;
+	if (pid == 0) {
+		_Exit(EXIT_SUCCESS);
+	} else if (pid < 0) {
+		if (errno == EAGAIN) {
+			CheckFail(c, FORKFAILED);
 		}
-
-		memset(buf, 0, (config->allocatableMemory * pageSize));
-
-		if (munmap(buf, config->allocatableMemory * pageSize) != 0) {
-			Logmsg(LOG_CRIT, "munmap failed: %s", MyStrerror(errno));
-			assert(false);
+	} else {
+		if (waitpid(pid, NULL, 0) != pid) {
+			Logmsg(LOG_ERR, "watchdogd: %s",
+			       MyStrerror(errno));
+			Logmsg(LOG_ERR, "watchdogd: waitpid failed");
 		}
-
-		pthread_cond_wait(&workerupdate, &managerlock);
-		pthread_mutex_unlock(&managerlock);
 	}
-
-	return NULL;
 }
 
-static void *TestFork(void *arg)
+static void PidfileCheck(struct cfgoptions *s, struct check *c)
 {
-	assert(arg != NULL);
-
-	struct cfgoptions *s = (struct cfgoptions *)arg;
-	pid_t pid = 0;
-
-	for (;;) {
-		pid = fork();
-
-		if (pid == 0) {
-			_Exit(EXIT_SUCCESS);
-		} else if (pid < 0) {
-			if (errno == EAGAIN) {
-				s->error |= FORKFAILED;
-			}
-		} else {
-			if (waitpid(pid, NULL, 0) != pid) {
-				Logmsg(LOG_ERR, "watchdogd: %s",
-				       MyStrerror(errno));
-				Logmsg(LOG_ERR, "watchdogd: waitpid failed");
-			}
+	for (int cnt = 0; cnt < config_setting_length(s->pidFiles);
+	     cnt++) {
+		const char *pidFilePathName = NULL;
+		pidFilePathName =
+		    config_setting_get_string_elem(s->pidFiles, cnt);
+
+		if (pidFilePathName == NULL) {
+			CheckFail(c, UNKNOWNPIDFILERROR);
+			break;
 		}
-		sleep(60);
-	}
-
-	return NULL;
-}
 
-static void *TestPidfileThread(void *arg)
-{
-	assert(arg != NULL);
+		int fd = PidFileOpenWait(pidFilePathName, s->retryLimit);
 
-	struct cfgoptions *s = (struct cfgoptions *)arg;
-
-	for (;;) {
-		pthread_mutex_lock(&managerlock);
-
-		for (int cnt = 0; cnt < config_setting_length(s->pidFiles);
-		     cnt++) {
-			const char *pidFilePathName = NULL;
-			pidFilePathName =
-			    config_setting_get_string_elem(s->pidFiles, cnt);
-
-			if (pidFilePathName == NULL) {
-				s->error |= UNKNOWNPIDFILERROR;
-				break;
-			}
-
-			int fd = 0;
-
-			time_t startTime = 0;
-
-			if (time(&startTime) == (time_t) (-1)) {
-				s->error |= UNKNOWNPIDFILERROR;
-				break;
-			}
-
-			time_t currentTime = 0;
-
-			do {
-				struct timespec rqtp;
-				rqtp.tv_sec = 0;
-				rqtp.tv_nsec = 250;
-
-				if (time(&currentTime) == (time_t) (-1)) {
-					currentTime = 0;
-					break;
-				}
-
-				fd = open(pidFilePathName,
-					  O_RDONLY | O_CLOEXEC);
-				if (fd >= 0) {
-					break;
-				}
+		if (fd < 0) {
+			Logmsg(LOG_ERR, "cannot open %s: %s",
+			       pidFilePathName, MyStrerror(errno));
+			CheckFail(c, PIDFILERROR);
+			break;
+		}
 
-				nanosleep(&rqtp, NULL);
-			} while (difftime(currentTime, startTime) <=
-				 s->retryLimit);
+		struct stat buffer;
 
-			if (fd < 0) {
-				Logmsg(LOG_ERR, "cannot open %s: %s",
-				       pidFilePathName, MyStrerror(errno));
-				s->error |= PIDFILERROR;
+		if (fstat(fd, &buffer) != 0) {
+			Logmsg(LOG_ERR, "%s: %s", pidFilePathName,
+			       MyStrerror(errno));
+			if (s->options & SOFTBOOT) {
+				close(fd);
+				CheckFail(c, PIDFILERROR);
 				break;
-			}
-
-			struct stat buffer;
-
-			if (fstat(fd, &buffer) != 0) {
-				Logmsg(LOG_ERR, "%s: %s", pidFilePathName,
-				       MyStrerror(errno));
-				if (s->options & SOFTBOOT) {
-					close(fd);
-					s->error |= PIDFILERROR;
-					break;
-				} else {
-					close(fd);
-					continue;
-				}
 			} else {
-				if (S_ISBLK(buffer.st_mode) == true
-				    || S_ISCHR(buffer.st_mode) == true
-				    || S_ISDIR(buffer.st_mode) == true
-				    || S_ISFIFO(buffer.st_mode) == true
-				    || S_ISSOCK(buffer.st_mode) == true
-				    || S_ISREG(buffer.st_mode) == false) {
-					Logmsg(LOG_ERR,
-					       "invalid file type %s",
-					       pidFilePathName);
-					close(fd);
-					s->error |= PIDFILERROR;
-					break;
-				}
+				close(fd);
+				continue;
 			}
-
-			char buf[64] = { 0 };
-			if (pread(fd, buf, sizeof(buf), 0) == -1) {
-				Logmsg(LOG_ERR, "unable to read pidfile %s: %s",
-				       pidFilePathName, MyStrerror(errno));
+		} else {
+			if (S_ISBLK(buffer.st_mode) == true
+			    || S_ISCHR(buffer.st_mode) == true
+			    || S_ISDIR(buffer.st_mode) == true
+			    || S_ISFIFO(buffer.st_mode) == true
+			    || S_ISSOCK(buffer.st_mode) == true
+			    || S_ISREG(buffer.st_mode) == false) {
+				Logmsg(LOG_ERR,
+				       "invalid file type %s",
+				       pidFilePathName);
 				close(fd);
-				s->error |= PIDFILERROR;
+				CheckFail(c, PIDFILERROR);
 				break;
 			}
+		}
 
+		char buf[64] = { 0 };
+		if (pread(fd, buf, sizeof(buf), 0) == -1) {
+			Logmsg(LOG_ERR, "unable to read pidfile %s: %s",
+			       pidFilePathName, MyStrerror(errno));
 			close(fd);
+			CheckFail(c, PIDFILERROR);
+			break;
+		}
+
+		close(fd);
 
-			errno = 0;
+		errno = 0;
 
-			pid_t pid = (pid_t) strtol(buf, (char **)NULL, 10);
+		pid_t pid = (pid_t) strtol(buf, (char **)NULL, 10);
 
-			if (pid == 0) {
-				Logmsg(LOG_ERR, "strtol failed: %s",
-				       MyStrerror(errno));
-				s->error |= UNKNOWNPIDFILERROR;
+		if (pid == 0) {
+			Logmsg(LOG_ERR, "strtol failed: %s",
+			       MyStrerror(errno));
+			CheckFail(c, UNKNOWNPIDFILERROR);
+			break;
+		}
+
+		if (kill(pid, 0) == -1) {
+			Logmsg(LOG_ERR,
+			       "unable to send null signal to pid %i: %s: %s",
+			       pid, pidFilePathName, MyStrerror(errno));
+			if (errno == ESRCH) {
+				CheckFail(c, PIDFILERROR);
 				break;
 			}
 
-			if (kill(pid, 0) == -1) {
-				Logmsg(LOG_ERR,
-				       "unable to send null signal to pid %i: %s: %s",
-				       pid, pidFilePathName, MyStrerror(errno));
-				if (errno == ESRCH) {
-					s->error |= PIDFILERROR;
-					break;
-				}
-
-				if (s->options & SOFTBOOT) {
-					s->error |= PIDFILERROR;
-					break;
-				}
+			if (s->options & SOFTBOOT) {
+				CheckFail(c, PIDFILERROR);
+				break;
 			}
 		}
-
-		pthread_cond_wait(&workerupdate, &managerlock);
-		pthread_mutex_unlock(&managerlock);
 	}
-
-	return NULL;
 }
 
-void *IdentityThread(void *arg)
+static int identitySocket = -1;
+
+static void *IdentityThread(void *arg)
 {
 
 	struct identinfo *i = (struct identinfo*)arg;
-	struct sockaddr_un address = {0};
-	address.sun_family = AF_UNIX;
-	strncpy(address.sun_path, "\0watchdogd.wdt.identity", sizeof(address.sun_path)-1);
-	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
-
-	if (fd < 0) {
-
-		return NULL;
-	}
-
-	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
-		close(fd);
-		return NULL;
-	}
-
-	if (listen(fd, 2) == -1) {
-		close(fd);
-		return NULL;
-	}
+	int fd = identitySocket;
 
 	while (true) {
 		int conection = accept(fd, NULL, NULL);
@@ -649,274 +547,364 @@ void *IdentityThread(void *arg)
 	return NULL;
 }
 
-static void *ManagerThread(void *arg)
+static void ZombieCheck(struct cfgoptions *s, struct check *c)
 {
-	/*This thread gets data from the non main threads and
-	   calls a function to take care of the problem */
+	ProcTableRefresh();
 
-	cfgoptions *s = (cfgoptions *)arg;
-	struct timespec rqtp;
+	unsigned long zombies = ProcTableCountZombies();
 
-	rqtp.tv_sec = 5;
-	rqtp.tv_nsec = 5 * 1000;
+	if (zombies > (unsigned long)s->maxZombies) {
+		Logmsg(LOG_ERR, "%lu zombie processes, at most %i allowed", zombies, s->maxZombies);
+		CheckFail(c, PROCESSERROR);
+	} else {
+		CheckPass(c, PROCESSERROR);
+	}
+}
+
+//Acts on the results of the other checks. It is essential so it keeps
+//running inside the pretimeout window, and runs as soon as a check reports
+//a failure.
+static void ManagerCheck(struct cfgoptions *s, struct check *c)
+{
+	s->error = SchedulerCollect();
+
+	if (s->error != 0 || s->testExeReturnValue != 0) {
+		SchedulerEscalate();
+	}
 
-	for (;;) {
-		pthread_mutex_lock(&managerlock);
-		pthread_cond_broadcast(&workerupdate);
 #if 0
-		if (s->temptoohigh == 1) {
-			/*Shutdown(true) */ ;
-		}
+	if (s->temptoohigh == 1) {
+		/*Shutdown(true) */ ;
+	}
 #endif
-		if (s->error & LOADAVGTOOHIGH) {
+	if (s->error & LOADAVGTOOHIGH) {
+		Logmsg(LOG_ERR,
+		       "polled load average exceed configured load average limit");
+		if (Shutdown(WESYSOVERLOAD, s) < 0) {
 			Logmsg(LOG_ERR,
-			       "polled load average exceed configured load average limit");
-			if (Shutdown(WESYSOVERLOAD, s) < 0) {
-				Logmsg(LOG_ERR,
-				       "watchdogd: Unable to shutdown system");
-				exit(EXIT_FAILURE);
-			}
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		if (s->error & OUTOFMEMORY) {
+	if (s->error & OUTOFMEMORY) {
+		Logmsg(LOG_ERR,
+		       "less than configured free pages available");
+		if (Shutdown(WEOTHER, s) < 0) {
 			Logmsg(LOG_ERR,
-			       "less than configured free pages available");
-			if (Shutdown(WEOTHER, s) < 0) {
-				Logmsg(LOG_ERR,
-				       "watchdogd: Unable to shutdown system");
-				exit(EXIT_FAILURE);
-			}
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		if (s->error & FORKFAILED) {
+	if (s->error & FORKFAILED) {
+		Logmsg(LOG_ERR,
+		       "process table test failed");
+		if (Shutdown(WEOTHER, s) < 0) {
 			Logmsg(LOG_ERR,
-			       "process table test failed because fork failed");
-			if (Shutdown(WEOTHER, s) < 0) {
-				Logmsg(LOG_ERR,
-				       "watchdogd: Unable to shutdown system");
-				exit(EXIT_FAILURE);
-			}
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		if (s->error & SCRIPTFAILED) {
-			Logmsg(LOG_ERR, "repair script failed");
-			if (Shutdown(WESCRIPT, s)
-			    < 0) {
-				Logmsg(LOG_ERR,
-				       "watchdogd: Unable to shutdown system");
-				exit(EXIT_FAILURE);
-			}
+	if (s->error & SCRIPTFAILED) {
+		Logmsg(LOG_ERR, "repair script failed");
+		if (Shutdown(WESCRIPT, s)
+		    < 0) {
+			Logmsg(LOG_ERR,
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		if (s->error & PIDFILERROR || s->error & UNKNOWNPIDFILERROR) {
-			Logmsg(LOG_ERR, "pid file test failed");
-			if (Shutdown(WEPIDFILE, s)
-			    < 0) {
-				Logmsg(LOG_ERR,
-				       "watchdogd: Unable to shutdown system");
-				exit(EXIT_FAILURE);
-			}
+	if (s->error & PIDFILERROR || s->error & UNKNOWNPIDFILERROR) {
+		Logmsg(LOG_ERR, "pid file test failed");
+		if (Shutdown(WEPIDFILE, s)
+		    < 0) {
+			Logmsg(LOG_ERR,
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		if (s->testExeReturnValue > 0 || s->testExeReturnValue < 0) {
-			Logmsg(LOG_ERR, "check executable failed");
-			if (Shutdown(s->testExeReturnValue, s) < 0) {
-				Logmsg(LOG_ERR,
-				       "watchdogd: Unable to shutdown system");
-				exit(EXIT_FAILURE);
-			}
+	if (s->testExeReturnValue > 0 || s->testExeReturnValue < 0) {
+		Logmsg(LOG_ERR, "check executable failed");
+		if (Shutdown(s->testExeReturnValue, s) < 0) {
+			Logmsg(LOG_ERR,
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		if (s->error & PINGFAILED) {
-			Logmsg(LOG_ERR, "ping test failed... rebooting system");
-			if (Shutdown(PINGFAILED, s) < 0) {
-				Logmsg(LOG_ERR,
-				       "watchdogd: Unable to shutdown system");
-				exit(EXIT_FAILURE);
-			}
+	if (s->error & PINGFAILED) {
+		Logmsg(LOG_ERR, "ping test failed... rebooting system");
+		if (Shutdown(PINGFAILED, s) < 0) {
+			Logmsg(LOG_ERR,
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		if (s->error & NETWORKDOWN) {
-			Logmsg(LOG_ERR, "network down... rebooting system");
-			if (Shutdown(PINGFAILED, s) < 0) {
-				Logmsg(LOG_ERR,
-				       "watchdogd: Unable to shutdown system");
-				exit(EXIT_FAILURE);
-			}
+	if (s->error & NETWORKDOWN) {
+		Logmsg(LOG_ERR, "network down... rebooting system");
+		if (Shutdown(PINGFAILED, s) < 0) {
+			Logmsg(LOG_ERR,
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		pthread_mutex_unlock(&managerlock);
-		nanosleep(&rqtp, NULL);
+	if (s->error & PRESSURETOOHIGH) {
+		Logmsg(LOG_ERR, "pressure stall time exceeded configured limit");
+		if (Shutdown(WESYSOVERLOAD, s) < 0) {
+			Logmsg(LOG_ERR,
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-		if (stop == 1) {
-			break;
+	if (s->error & CGROUPERROR) {
+		Logmsg(LOG_ERR, "cgroup check failed");
+		if (Shutdown(WEOTHER, s) < 0) {
+			Logmsg(LOG_ERR,
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
 		}
 	}
 
-	return NULL;
+	if (s->error & PROCESSERROR) {
+		Logmsg(LOG_ERR, "process check failed");
+		if (Shutdown(WEOTHER, s) < 0) {
+			Logmsg(LOG_ERR,
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (s->error & CHECKHUNG) {
+		Logmsg(LOG_ERR, "system check hung... rebooting system");
+		if (Shutdown(WECHECKHUNG, s) < 0) {
+			Logmsg(LOG_ERR,
+			       "watchdogd: Unable to shutdown system");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+//Defaults can be overridden per check in the checks group of the
+//configuration file. A check that may legitimately run for up to limit
+//milliseconds gets monitor-deadline on top of that as its deadline, and
+//is never given a shorter one.
+static struct check *AddTimedCheck(struct cfgoptions *s, const char *name,
+				   void (*run)(struct cfgoptions *, struct check *), long interval,
+				   unsigned int flags, long limit)
+{
+	long jitter = 0;
+	long deadline = s->monitorDeadline + limit;
+
+	LookupCheckSettings(s, name, &interval, &jitter, &deadline);
+
+	if (deadline <= limit) {
+		Logmsg(LOG_WARNING, "deadline of check %s must be longer than its timeout of %lims, using %lims",
+		       name, limit, s->monitorDeadline + limit);
+		deadline = s->monitorDeadline + limit;
+	}
+
+	return SchedulerAdd(name, run, interval, jitter, deadline, flags);
+}
+
+static struct check *AddCheck(struct cfgoptions *s, const char *name,
+			      void (*run)(struct cfgoptions *, struct check *), long interval, unsigned int flags)
+{
+	return AddTimedCheck(s, name, run, interval, flags, 0);
 }
 
 int StartHelperThreads(struct cfgoptions *options)
 {
+	extern struct repairscriptTranctions *rst;
 
 	if (StartServiceManagerKeepAliveNotification(NULL) < 0) {
 		return -1;
 	}
 
-	if (SetupTestFork(options) < 0) {
+	if (options->maxProcessTable > 0 && AddCheck(options, "process-table", HeadroomCheck, options->checkInterval,
+						     CHECK_MONITORED) == NULL) {
+		return -1;
+	}
+
+	if (options->options & FORKTEST && AddCheck(options, "fork", TestForkCheck, 3600000, CHECK_BLOCKING) == NULL) {
 		return -1;
 	}
 
-	if (SetupExeDir(options) < 0) {
+	//Scripts are tested and then repaired, each may take repair-timeout.
+	if (rst != NULL && AddTimedCheck(options, "repair-scripts", TestDirCheck, 30000, CHECK_BLOCKING,
+					 options->repairBinTimeout * 2000L) == NULL) {
 		return -1;
 	}
 
 	if (options->testexepathname != NULL) {
-		if (SetupTestBinThread(options) < 0) {
+		if (AddTimedCheck(options, "test-binary", TestBinCheck, 5000, CHECK_BLOCKING,
+				  options->testBinTimeout * 1000L) == NULL) {
 			return -1;
 		}
 	}
 
 	if (options->maxLoadOne > 0) {
-		if (SetupLoadAvgThread(options) < 0) {
+		if (AddCheck(options, "load-average", LoadAvgCheck, options->checkInterval, CHECK_MONITORED) == NULL) {
+			return -1;
+		}
+	}
+
+	//Triggers fire on the scheduler thread, the check only clears failures
+	//and polls where triggers are not available.
+	if (options->pressure != NULL) {
+		struct check *c = AddCheck(options, "pressure", PressureCheck, options->checkInterval, CHECK_MONITORED);
+
+		if (c == NULL) {
+			return -1;
+		}
+
+		if (PressureInit(options, c) == false) {
+			Logmsg(LOG_ERR, "pressure stall information unavailable, pressure monitoring disabled");
+		}
+	}
+
+	if (options->cgroups != NULL) {
+		struct check *c = AddCheck(options, "cgroups", CgroupMonitorCheck, options->checkInterval, CHECK_MONITORED);
+
+		if (c == NULL) {
 			return -1;
 		}
+
+		if (CgroupMonitorInit(options, c) == false) {
+			Logmsg(LOG_ERR, "cgroup monitoring disabled");
+		}
 	}
 
 	if (options->options & SYNC) {
-		if (SetupSyncThread(options) < 0) {
+		if (AddCheck(options, "sync", SyncCheck, options->checkInterval,
+			     CHECK_BLOCKING | CHECK_MONITORED) == NULL) {
 			return -1;
 		}
 	}
 
 	if (options->minfreepages != 0) {
-		if (SetupMinPagesThread(options) < 0) {
+		pthread_once(&getPageSize, GetPageSize);
+
+		if (pageSize < 0) {
+			Logmsg(LOG_ERR, "%s", MyStrerror(errno));
+		} else if (AddCheck(options, "free-pages", MinPagesCheck, options->checkInterval, CHECK_MONITORED) == NULL) {
 			return -1;
 		}
 	}
 
-	if (options->options & ENABLEPIDCHECKER) {
-		if (StartPidFileTestThread(options) < 0) {
+	//With pidfds the check only retries missing pid files, it runs on the
+	//scheduler thread along with the pidfd and inotify callbacks.
+	if (options->options & ENABLEPIDCHECKER && PidMonitorInit(options) == true) {
+		struct check *c = AddCheck(options, "pid-files", PidMonitorCheck, options->checkInterval,
+					   CHECK_MONITORED);
+
+		if (c == NULL || PidMonitorStart(c) == false) {
 			return -1;
 		}
-	}
+	} else if (options->options & ENABLEPIDCHECKER) {
+		long limit = (long)(options->retryLimit * 1000.0) * config_setting_length(options->pidFiles);
 
-	if (options->options & ENABLEPING && StartPingThread(options) < 0) {
-		return -1;
+		if (AddTimedCheck(options, "pid-files", PidfileCheck, options->checkInterval,
+				  CHECK_BLOCKING | CHECK_MONITORED, limit) == NULL) {
+			return -1;
+		}
 	}
 
-	if (SetupTestMemoryAllocationThread(options) < 0) {
+	if (options->options & ENABLEPING && AddCheck(options, "ping", PingCheck, options->checkInterval,
+							CHECK_BLOCKING | CHECK_MONITORED) == NULL) {
 		return -1;
 	}
 
-	if (options->networkInterfaces != NULL) {
-		StartCheckNetworkInterfacesThread(options);
+	//Page faults may wait for reclaim, the probe is left to the worker threads.
+	if (options->allocatableMemory > 0 && AddCheck(options, "memory-allocation", MemoryProbeCheck,
+						       options->checkInterval, CHECK_BLOCKING | CHECK_MONITORED) == NULL) {
+		return -1;
 	}
 
-	return 0;
-}
-
-int SetupTestFork(void *arg)
-{
-	if (CreateDetachedThread(TestFork, arg) < 0)
+	if (options->networkInterfaces != NULL && AddCheck(options, "network-interfaces", NetworkInterfacesCheck,
+							   options->checkInterval, CHECK_MONITORED) == NULL) {
 		return -1;
+	}
 
-	return 0;
-}
-
-int SetupExeDir(void *arg)
-{
-	extern struct repairscriptTranctions *rst;
-	if (rst == NULL)
-		return 0;
-	if (CreateDetachedThread(TestDirThread, arg) < 0)
+	if (options->processes != NULL && AddCheck(options, "processes", ProcCheck, options->checkInterval,
+						   ProcCheckStart()) == NULL) {
 		return -1;
+	}
 
-	return 0;
-}
-
-int SetupMinPagesThread(void *arg)
-{
-	struct cfgoptions *s = (struct cfgoptions *)arg;
-
-	assert(arg != NULL);
-
-	if (s->minfreepages == 0)
-		return 0;
+	//Answered from memory while the proc connector keeps the table up to
+	//date, otherwise /proc is scanned off the scheduler thread.
+	if (options->maxZombies >= 0 && ProcTableInit() == true) {
+		unsigned int flags = ProcTableIsLive() ? CHECK_MONITORED : CHECK_BLOCKING | CHECK_MONITORED;
 
-	if (CreateDetachedThread(MinPagesThread, arg) < 0)
-		return -1;
+		if (AddCheck(options, "zombies", ZombieCheck, options->checkInterval, flags) == NULL
+		    || ProcTableStart() == false) {
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
-int SetupLoadAvgThread(void *arg)
+//The listening socket is created, or taken over from the previous instance,
+//before the thread starts so that it is never closed as unused.
+int StartIdentityThread(struct identinfo *i)
 {
-	assert(arg != NULL);
-
-	if (CreateDetachedThread(LoadAvgThread, arg) < 0)
-		return -1;
+	struct sockaddr_un address = {0};
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, "\0watchdogd.wdt.identity", sizeof(address.sun_path)-1);
+	int fd = HandoverTake("identity");
 
-	return 0;
-}
+	if (fd < 0) {
+		fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
 
-int SetupTestBinThread(void *arg)
-{
-	assert(arg != NULL);
+		if (fd < 0) {
+			return -1;
+		}
 
-	if (CreateDetachedThread(TestBinThread, arg) < 0)
-		return -1;
+		if (bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+			close(fd);
+			return -1;
+		}
 
-	return 0;
-}
+		if (listen(fd, 2) == -1) {
+			close(fd);
+			return -1;
+		}
+	}
 
-int SetupTestMemoryAllocationThread(void *arg)
-{
-	assert(arg != NULL);
+	HandoverOffer(fd, "identity");
+	identitySocket = fd;
 
-	if (CreateDetachedThread(TestMemoryAllocation, arg) < 0) {
+	if (CreateDetachedThread(IdentityThread, i) < 0) {
+		HandoverWithdraw(fd);
+		close(fd);
 		return -1;
 	}
 
 	return 0;
 }
 
+//Adds the check acting on the results of all others and starts the
+//scheduler. Called once every other check has been added.
 int SetupAuxManagerThread(void *arg)
 {
-	assert(arg != NULL);
-
-	if (CreateDetachedThread(ManagerThread, arg) < 0)
-		return -1;
-
-	return 0;
-}
-
-int SetupSyncThread(void *arg)
-{
-	assert(arg != NULL);
-
-	if (CreateDetachedThread(Sync, arg) < 0)
-		return -1;
-
-	return 0;
-}
+	struct cfgoptions *s = (struct cfgoptions *)arg;
 
-int StartPidFileTestThread(void *arg)
-{
 	assert(arg != NULL);
 
-	if (CreateDetachedThread(TestPidfileThread, arg) < 0)
+	if (SchedulerAdd("manager", ManagerCheck, s->checkInterval, 0, 0, CHECK_ESSENTIAL | CHECK_ON_FAILURE) == NULL) {
 		return -1;
+	}
 
-	return 0;
-}
-
-int StartPingThread(void *arg)
-{
-	assert(arg != NULL);
-
-	if (CreateDetachedThread(Ping, arg) < 0)
+	if (SchedulerStart(s) < 0) {
 		return -1;
+	}
 
 	return 0;
 }
@@ -949,13 +937,3 @@ int StartServiceManagerKeepAliveNotification(void *arg)
 
 	return 0;
 }
-
-int StartCheckNetworkInterfacesThread(void *arg)
-{
-	assert(arg != NULL);
-
-	if (CreateDetachedThread(CheckNetworkInterfacesThread, arg) < 0)
-		return -1;
-
-	return 0;
-}
@@ -17,18 +17,32 @@
 #include "linux.hpp"
 #include "watchdog.hpp"
 #include "logutils.hpp"
+#include "backend.hpp"
+#include "handover.hpp"
+#include "sysroot.hpp"
+#include <libgen.h>
+
+int Watchdog::Ioctl(unsigned long request, void *arg)
+{
+	if (backend == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+
+	return backend->Ioctl(request, arg);
+}
 
 int Watchdog::Ping()
 {
 	int tmp = 0;
 
-	if (ioctl(fd, WDIOC_KEEPALIVE, &tmp) == 0) {
+	if (Ioctl(WDIOC_KEEPALIVE, &tmp) == 0) {
 		return 0;
 	}
 
-	ioctl(fd, WDIOC_SETTIMEOUT, &timeout);
+	Ioctl(WDIOC_SETTIMEOUT, &timeout);
 
-	if (ioctl(fd, WDIOC_KEEPALIVE, &tmp) == 0) {
+	if (Ioctl(WDIOC_KEEPALIVE, &tmp) == 0) {
 		return 0;
 	}
 
@@ -39,72 +53,123 @@ int Watchdog::Ping()
 
 int Watchdog::Close()
 {
-	if (fd == -1) {
+	if (backend == NULL) {
 		return 0;
 	}
 
-	if (write(fd, "V", strlen("V")) < 0) {
+	int ret = 0;
+
+	HandoverWithdraw(backend->GetFd());
+
+	if (backend->Write("V", strlen("V")) < 0) {
 		Logmsg(LOG_CRIT, "write to watchdog device failed: %s",
 		       MyStrerror(errno));
-		close(fd);
 		Logmsg(LOG_CRIT, "unable to close watchdog device");
-		return -1;
-	} else {
-		close(fd);
+		ret = -1;
 	}
 
-	return 0;
+	backend->Close();
+	delete backend;
+	backend = NULL;
+
+	return ret;
 }
 
-bool Watchdog::CanMagicClose()
+//Everything that does not change while the device is open is read once so
+//later queries need no ioctl or sysfs access.
+void Watchdog::ProbeCapabilities()
 {
 	struct watchdog_info watchDogInfo = {0};
+	char buf[128] = {'\0'};
+	dev dev = {0};
+
+	memset(&caps, 0, sizeof(caps));
+	caps.nowayout = -1;
 
-	if (ioctl(fd, WDIOC_GETSUPPORT, &watchDogInfo) < 0) {
+	if (Ioctl(WDIOC_GETSUPPORT, &watchDogInfo) < 0) {
 		Logmsg(LOG_ERR, "%s", MyStrerror(errno));
+	} else {
+		memcpy(caps.identity, watchDogInfo.identity, sizeof(caps.identity));
+		caps.identity[sizeof(caps.identity) - 1] = '\0';
+		caps.options = watchDogInfo.options;
+		caps.firmwareVersion = watchDogInfo.firmware_version;
+		caps.haveInfo = true;
+	}
+
+	Ioctl(WDIOC_GETTIMEOUT, &caps.timeout);
+
+	if (caps.options & WDIOF_PRETIMEOUT) {
+		Ioctl(WDIOC_GETPRETIMEOUT, &caps.pretimeout);
+	}
+
+	Ioctl(WDIOC_GETBOOTSTATUS, &caps.bootstatus);
+
+	if (GetDeviceMajorMinor(&dev, (char*)path) == true) {
+		caps.major = dev.major;
+		caps.minor = dev.minor;
+		caps.haveNode = true;
+	}
+
+	if (GetSysfsAttributePath("nowayout", buf, sizeof(buf)) == true) {
+		FILE *fp = fopen(buf, "re");
+
+		if (fp != NULL) {
+			caps.nowayout = fgetc(fp) == '1' ? 1 : 0;
+			fclose(fp);
+		}
+	}
+
+	if (caps.nowayout == -1 && caps.haveNode == true) {
+		caps.nowayout = ConfigWatchdogNowayoutIsSet((char*)path);
+	}
+}
+
+bool Watchdog::CanMagicClose()
+{
+	if (caps.haveInfo == false) {
 		return false;
 	}
-	if (strcmp((const char*)GetIdentity(),"iamt_wdt") == 0) {
+	if (strcmp(caps.identity, "iamt_wdt") == 0) {
 		return true; //iamt_wdt is broken
 	}
-	return (WDIOF_MAGICCLOSE & watchDogInfo.options);
+	return (WDIOF_MAGICCLOSE & caps.options);
 }
 
 bool Watchdog::PrintWdtInfo()
 {
-	struct watchdog_info watchDogInfo;
+	if (caps.haveInfo == false) {
+		return false;
+	}
 
-	if (ioctl(fd, WDIOC_GETSUPPORT, &watchDogInfo) < 0) {
-		Logmsg(LOG_ERR, "%s", MyStrerror(errno));
+	if (strcasecmp(caps.identity, "software watchdog") != 0) {
+		Logmsg(LOG_DEBUG, "Hardware watchdog '%s', version %u",
+		       caps.identity, caps.firmwareVersion);
 	} else {
-		if (strcasecmp((const char*)watchDogInfo.identity, "software watchdog") != 0) {
-			Logmsg(LOG_DEBUG, "Hardware watchdog '%s', version %u",
-			       watchDogInfo.identity, watchDogInfo.firmware_version);
-		} else {
-			Logmsg(LOG_DEBUG, "%s, version %u",
-			       watchDogInfo.identity, watchDogInfo.firmware_version);
+		Logmsg(LOG_DEBUG, "%s, version %u",
+		       caps.identity, caps.firmwareVersion);
+	}
+
+	Logmsg(LOG_DEBUG, "Device: %s Major: %li Minor: %li nowayout: %s", path, caps.major, caps.minor,
+	       caps.nowayout == 1 ? "yes" : caps.nowayout == 0 ? "no" : "unknown");
+
+	if (caps.options & WDIOF_PRETIMEOUT) {
+		char governor[64] = {'\0'};
+		if (GetPretimeoutGovernor(governor, sizeof(governor)) == false) {
+			strcpy(governor, "unknown");
 		}
-		dev dev;
-		GetDeviceMajorMinor(&dev, (char*)path);
-		Logmsg(LOG_DEBUG, "Device: %s Major: %li Minor: %li", path, dev.major, dev.minor);
-		return true;
+		Logmsg(LOG_DEBUG, "Pretimeout: %is governor: %s", GetPretimeout(), governor);
 	}
 
-	return false;
+	return true;
 }
 
 unsigned char * Watchdog::GetIdentity()
 {
-	static struct watchdog_info watchDogInfo;
-
-	this->Ping();
-
-	if (ioctl(fd, WDIOC_GETSUPPORT, &watchDogInfo) < 0) {
-		Logmsg(LOG_ERR, "%s", MyStrerror(errno));
+	if (caps.haveInfo == false) {
 		return NULL;
 	}
 
-	return watchDogInfo.identity;
+	return (unsigned char *)caps.identity;
 }
 
 int Watchdog::Open(const char *const path)
@@ -113,50 +178,62 @@ int Watchdog::Open(const char *const path)
 		return -1;
 	}
 
-	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (backend != NULL) {
+		Close();
+	}
+
+	backend = NewWatchdogBackend(path);
+
+	if (backend->Open(path) < 0) {
+		int error = errno;
 
-	if (fd == -1) {
+		delete backend;
+		backend = NULL;
+		errno = error;
 
 		Logmsg(LOG_ERR,
 		       "unable to open watchdog device: %s", MyStrerror(errno));
 		return -1;
 	}
 
+	//The backend may resolve an alias such as "softdog" to a real node.
+	strncpy((char *)this->path, backend->GetPath(), sizeof(this->path) - 1);
+
+	if (backend->GetFd() >= 0) {
+		HandoverOffer(backend->GetFd(), this->path);
+	}
+
 	if (this->Ping() != 0) {
 		Close();
 		return -1;
 	}
 
+	ProbeCapabilities();
+
 	if (CanMagicClose() == false) {
 		Logmsg(LOG_ALERT,
 		       "watchdog device does not support magic close char");
 	}
 
-	strcpy((char *)this->path, path);
-
 	return 0;
 }
 
-int Watchdog::GetOptimalPingInterval()
+//Returns half of the device timeout in milliseconds.
+long Watchdog::GetOptimalPingInterval()
 {
-	int timeout = 0;
+	int timeout = GetRawTimeout();
 
-	if (ioctl(fd, WDIOC_GETTIMEOUT, &timeout) < 0) {
-		return 1;
+	if (timeout < 1) {
+		return 1000;
 	}
 
-	timeout /= 2;
-
-	if (timeout < 1 || timeout == 0)
-		return 1;
-
-	return timeout;
+	return timeout * 500L;
 }
 
 int Watchdog::Disable()
 {
 	int options = WDIOS_DISABLECARD;
-	if (ioctl(fd, WDIOC_SETOPTIONS, &options) < 0) {
+	if (Ioctl(WDIOC_SETOPTIONS, &options) < 0) {
 		Logmsg(LOG_CRIT, "WDIOS_DISABLECARD ioctl failed: %s",
 		       MyStrerror(errno));
 		return -1;
@@ -168,7 +245,7 @@ int Watchdog::Disable()
 int Watchdog::Enable()
 {
 	int options = WDIOS_ENABLECARD;
-	if (ioctl(fd, WDIOC_SETOPTIONS, &options) < 0) {
+	if (Ioctl(WDIOC_SETOPTIONS, &options) < 0) {
 		Logmsg(LOG_CRIT, "WDIOS_ENABLECARD ioctl failed: %s",
 		       MyStrerror(errno));
 		return -1;
@@ -179,8 +256,6 @@ int Watchdog::Enable()
 
 int Watchdog::ConfigureWatchdogTimeout(int timeout)
 {
-	struct watchdog_info watchDogInfo;
-
 	if (timeout <= 0)
 		return 0;
 
@@ -188,20 +263,20 @@ int Watchdog::ConfigureWatchdogTimeout(int timeout)
 		return -1;
 	}
 
-	if (ioctl(fd, WDIOC_GETSUPPORT, &watchDogInfo) < 0) {
-		Logmsg(LOG_CRIT, "WDIOC_GETSUPPORT ioctl failed: %s",
-		       MyStrerror(errno));
+	if (caps.haveInfo == false) {
+		Logmsg(LOG_CRIT, "WDIOC_GETSUPPORT ioctl failed");
 		return -1;
 	}
 
-	if (!(watchDogInfo.options & WDIOF_SETTIMEOUT)) {
+	if (!(caps.options & WDIOF_SETTIMEOUT)) {
 		return -1;
 	}
 
 	int oldTimeout = timeout;
 
-	if (ioctl(fd, WDIOC_SETTIMEOUT, &timeout) < 0) {
-		this->timeout = GetOptimalPingInterval();
+	if (Ioctl(WDIOC_SETTIMEOUT, &timeout) < 0) {
+		Ioctl(WDIOC_GETTIMEOUT, &caps.timeout);
+		this->timeout = GetRawTimeout();
 
 		fprintf(stderr, "watchdogd: unable to set WDT timeout\n");
 		fprintf(stderr, "using default: %i", this->timeout);
@@ -222,6 +297,7 @@ int Watchdog::ConfigureWatchdogTimeout(int timeout)
 	}
 
 	this->timeout = timeout;
+	caps.timeout = timeout;
 
 	if (Enable() < 0) {
 		return -1;
@@ -230,29 +306,136 @@ int Watchdog::ConfigureWatchdogTimeout(int timeout)
 	return Ping();
 }
 
-long unsigned Watchdog::GetStatus()
+int Watchdog::ConfigurePretimeout(int pretimeout)
+{
+	if (pretimeout <= 0) {
+		return 0;
+	}
+
+	if (caps.haveInfo == false) {
+		Logmsg(LOG_ERR, "WDIOC_GETSUPPORT ioctl failed");
+		return -1;
+	}
+
+	if (!(caps.options & WDIOF_PRETIMEOUT)) {
+		Logmsg(LOG_ERR, "%s does not support a pretimeout", path);
+		return -1;
+	}
+
+	int timeout = GetRawTimeout();
+
+	if (timeout > 0 && pretimeout >= timeout) {
+		Logmsg(LOG_ERR, "pretimeout %is must be less than the timeout %is", pretimeout, timeout);
+		return -1;
+	}
+
+	int requested = pretimeout;
+
+	if (Ioctl(WDIOC_SETPRETIMEOUT, &pretimeout) < 0) {
+		Logmsg(LOG_ERR, "WDIOC_SETPRETIMEOUT ioctl failed: %s", MyStrerror(errno));
+		return -1;
+	}
+
+	if (pretimeout != requested) {
+		Logmsg(LOG_WARNING, "actual WDT pretimeout: %i seconds (requested %i)",
+		       pretimeout, requested);
+	}
+
+	caps.pretimeout = pretimeout;
+
+	return Ping();
+}
+
+int Watchdog::GetPretimeout()
+{
+	return caps.pretimeout;
+}
+
+bool Watchdog::GetSysfsAttributePath(const char *attribute, char *buf, size_t len)
 {
-	long unsigned status = 0;
+	char copy[sizeof(path)] = {'\0'};
 
-	ioctl(fd, WDIOC_GETBOOTSTATUS, &status);
+	strncpy(copy, path, sizeof(copy) - 1);
 
-	return status;
+	const char *name = basename(copy);
+
+	//The legacy /dev/watchdog node is an alias of watchdog0.
+	if (strcmp(name, "watchdog") == 0) {
+		name = "watchdog0";
+	}
+
+	return SysrootPath(buf, len, "/sys/class/watchdog/%s/%s", name, attribute);
 }
 
-long Watchdog::GetFirmwareVersion()
+bool Watchdog::SetPretimeoutGovernor(const char *governor)
 {
-	struct watchdog_info watchDogInfo = {0};
+	char buf[128] = {'\0'};
+
+	if (governor == NULL || GetSysfsAttributePath("pretimeout_governor", buf, sizeof(buf)) == false) {
+		return false;
+	}
 
-	ioctl(fd, WDIOC_GETSUPPORT, &watchDogInfo);
+	int attr = open(buf, O_WRONLY | O_CLOEXEC);
 
-	return watchDogInfo.firmware_version;
+	if (attr < 0) {
+		Logmsg(LOG_ERR, "unable to open %s: %s", buf, MyStrerror(errno));
+		return false;
+	}
+
+	if (write(attr, governor, strlen(governor)) < 0) {
+		Logmsg(LOG_ERR, "unable to set pretimeout governor %s: %s", governor, MyStrerror(errno));
+		close(attr);
+		return false;
+	}
+
+	close(attr);
+
+	return true;
+}
+
+bool Watchdog::GetPretimeoutGovernor(char *governor, size_t len)
+{
+	char buf[128] = {'\0'};
+
+	if (len == 0 || GetSysfsAttributePath("pretimeout_governor", buf, sizeof(buf)) == false) {
+		return false;
+	}
+
+	int attr = open(buf, O_RDONLY | O_CLOEXEC);
+
+	if (attr < 0) {
+		return false;
+	}
+
+	ssize_t ret = read(attr, governor, len - 1);
+
+	close(attr);
+
+	if (ret <= 0) {
+		return false;
+	}
+
+	governor[ret] = '\0';
+	governor[strcspn(governor, "\n")] = '\0';
+
+	return true;
+}
+
+long unsigned Watchdog::GetStatus()
+{
+	return (long unsigned)caps.bootstatus;
+}
+
+long Watchdog::GetFirmwareVersion()
+{
+	return caps.firmwareVersion;
 }
 
 long Watchdog::GetTimeleft()
 {
 	int timeleft = 0;
 
-	if (ioctl(fd, WDIOC_GETTIMELEFT, &timeleft) < 0) {
+	if (Ioctl(WDIOC_GETTIMELEFT, &timeleft) < 0) {
 		return -1;
 	}
 
@@ -261,14 +444,16 @@ long Watchdog::GetTimeleft()
 
 int Watchdog::GetRawTimeout()
 {
-	int timeout = 0;
-	ioctl(fd, WDIOC_GETTIMEOUT, &timeout);
-	return timeout;
+	return caps.timeout;
 }
 
-bool Watchdog::CheckWatchdogTimeout(int timeout)
+//Returns true if a keepalive arriving latency milliseconds after the
+//previous one could be too late for the device.
+bool Watchdog::CheckWatchdogTimeout(long latency)
 {
-	if (timeout <= this->timeout) {
+	int timeout = this->timeout > 0 ? this->timeout : GetRawTimeout();
+
+	if (timeout <= 0 || latency < timeout * 1000L) {
 		return false;
 	}
 	return true;
@@ -16,34 +16,68 @@
 
 #ifndef WATCHDOG_H
 #define WATCHDOG_H
+class WatchdogBackend;
+
+//Probed once when the device is opened, see Watchdog::ProbeCapabilities().
+struct watchdogcaps {
+	char identity[32];
+	unsigned int options;
+	unsigned int firmwareVersion;
+	int timeout;
+	int pretimeout;
+	int bootstatus;
+	int nowayout;
+	unsigned long major;
+	unsigned long minor;
+	bool haveInfo;
+	bool haveNode;
+};
+
 class Watchdog {
 	const char path[64] = {'\0'};
-	int fd = -1;
+	WatchdogBackend *backend = NULL;
+	struct watchdogcaps caps = {};
 	int timeout = 0;
-	int pingInterval = 0;
+	long pingInterval = 0;
 	bool CanMagicClose();
+	bool GetSysfsAttributePath(const char *, char *, size_t);
+	int Ioctl(unsigned long, void *);
+	void ProbeCapabilities();
 public:
 	int Ping();
 	int Close();
 	int Open(const char *const);
-	int GetOptimalPingInterval();
+	long GetOptimalPingInterval();
 	long GetFirmwareVersion();
 	bool PrintWdtInfo();
 	unsigned char *Getdentity();
 	int ConfigureWatchdogTimeout(int);
+	int ConfigurePretimeout(int);
+	int GetPretimeout();
+	bool SetPretimeoutGovernor(const char *);
+	bool GetPretimeoutGovernor(char *, size_t);
 	int GetWatchdogBootStatus();
 	long GetTimeleft();
 	int GetRawTimeout();
-	bool CheckWatchdogTimeout(int);
+	bool CheckWatchdogTimeout(long);
 	long unsigned GetStatus();
 	unsigned char * GetIdentity();
 	int Disable();
 	int Enable();
-	void SetPingInterval(int i) {
+	void SetPingInterval(long i) {
 		pingInterval = i;
 	}
-	int GetPingInterval() {
+	long GetPingInterval() {
 		return pingInterval;
 	}
+	const char *GetPath() {
+		return path;
+	}
+	WatchdogBackend *GetBackend() {
+		return backend;
+	}
+	const struct watchdogcaps *GetCapabilities() {
+		return &caps;
+	}
 };
 #endif
@@ -77,6 +77,10 @@
 #define IDENTIFY 0x800
 #define BUSYBOXDEVOPTCOMPAT 0x1000
 #define LOGLVLSETCMDLN 0x2000
+#define KEEPALIVETHREAD 0x4000
+#define ADAPTIVEINTERVAL 0x8000
+#define HEALTHGATE 0x10000
+#define FORKTEST 0x20000
 
 #define SCRIPTFAILED 0x1
 #define FORKFAILED 0x2
@@ -86,6 +90,10 @@
 #define PIDFILERROR 0x20
 #define PINGFAILED 0x40
 #define NETWORKDOWN 0x80
+#define CHECKHUNG 0x100
+#define PROCESSERROR 0x200
+#define PRESSURETOOHIGH 0x400
+#define CGROUPERROR 0x800
 
 //TODO: Split this struct into an options struct(values read in from config file) and a runtime struct.
 struct cfgoptions {
@@ -98,6 +106,10 @@ struct cfgoptions {
 	const config_setting_t *networkInterfaces = NULL;
 	pingobj_t *pingObj = NULL;
 	const config_setting_t *pidFiles = NULL;
+	const config_setting_t *processes = NULL;
+	const config_setting_t *pressure = NULL;
+	const config_setting_t *cgroups = NULL;
+	const config_setting_t *watchdogDevices = NULL;
 	const char *devicepath = NULL;
 	const char *pidfileName = NULL;
 	const char *testexepath = "/usr/libexec/watchdog/scripts";
@@ -106,16 +118,29 @@ struct cfgoptions {
 	const char *confile = "/etc/watchdogd.conf";
 	unsigned long options = 0;
 	const char *logTarget = NULL;
+	const char *pretimeoutGovernor = NULL;
+	const char *pretimeoutScript = NULL;
 	const char *logUpto = NULL;
-	time_t sleeptime = -1;
+	const char *sysroot = NULL;
+	//Intervals are in milliseconds.
+	long sleeptime = -1;
+	long minInterval = 0;
+	long maxInterval = 0;
+	long checkInterval = 5000;
+	long monitorDeadline = 0;
 	unsigned long minfreepages = 0;
 	int testBinTimeout = 60;
 	int repairBinTimeout = 60;
 	int sigtermDelay = 0;
 	int priority = 0;
+	int keepalivePriority = 0;
+	int keepaliveCpu = -1;
 	int watchdogTimeout = -1;
+	int watchdogPretimeout = -1;
 	int testExeReturnValue = 0;
 	int allocatableMemory = 0;
+	int maxZombies = -1;
+	int maxProcessTable = 90;
 	volatile std::atomic_uint error = {0};
 	bool haveConfigFile = false;
 };
@@ -153,6 +178,7 @@ struct dbusinfo
 {
 	cfgoptions **config;
 	Watchdog **wdt;
+	struct keepalive *keepalive;
 	int fd;
 	bool miniMode;
 };